@@ -1,20 +1,80 @@
 [BITS 32]
 [ORG 0h]
 
+; Pages of data carried by the process, to compare fork latency across
+; process sizes (nasm -DPAGES=n)
+%ifndef PAGES
+%define PAGES 1
+%endif
+%defstr PAGES_STR PAGES
+
 
 [SECTION .text]
 
+; Page the data in, so fork() has all of it to share
+mov edi, pages
+mov ecx, PAGES
+touch:
+mov [edi], ecx
+add edi, 4096
+loop touch
+
+rdtsc
+mov esi, eax
+
 mov eax, 0x1
 int 0x80
+mov ebp, eax
 
-mov ebx, str
+test eax, eax
+jz child
+
+parent:
+rdtsc
+sub eax, esi
+
+; Write the cycle count out as hex
+mov edi, hex_end
+mov ecx, 8
+.digit:
+dec edi
+mov edx, eax
+and edx, 0xF
+mov dl, [digits + edx]
+mov [edi], dl
+shr eax, 4
+loop .digit
+
+mov ebx, msg
 mov eax, 0x0
 int 0x80
 
+; waitpid(child, 0), then exit(0)
+mov eax, 13
+mov ebx, ebp
+mov ecx, 0
+int 0x80
 
+mov eax, 12
+mov ebx, 0
+int 0x80
 
-jmp $
+child:
+mov ebx, str
+mov eax, 0x0
+int 0x80
+
+mov eax, 12
+mov ebx, 0
+int 0x80
 
 [SECTION .data]
 
-str:	db	"I am a forking user program!", 0xa
+str:	db	"I am a forking user program!", 0xa, 0
+msg:	db	"fork with ", PAGES_STR, " pages took 0x"
+hex:	db	"00000000"
+hex_end:	db	" cycles", 0xa, 0
+digits:	db	"0123456789abcdef"
+
+align 4096
+pages:	times PAGES * 4096 db 0
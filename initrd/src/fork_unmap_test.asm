@@ -0,0 +1,146 @@
+[BITS 32]
+[ORG 0h]
+
+; Forks over and over while a second thread maps, writes and unmaps a
+; shared memory segment. Each child unmaps the segment if it inherited it,
+; then exits. A fork racing with the unmap must neither keep a freed
+; frame mapped nor follow a freed region, so the kernel survives this.
+
+%define SYS_PUTS            0
+%define SYS_FORK            1
+%define SYS_THREAD_CREATE   11
+%define SYS_EXIT            12
+%define SYS_WAITPID         13
+%define SYS_SHM_CREATE      18
+%define SYS_SHM_MAP         19
+%define SYS_SHM_UNMAP       20
+
+%define SHM_SIZE            0x4000
+%define SHM_ADDR            0xA0000000
+%define ROUNDS              2048
+
+[SECTION .text]
+
+mov eax, SYS_SHM_CREATE
+mov ebx, name
+mov ecx, SHM_SIZE
+int 0x80
+cmp eax, -1
+je fail
+mov [segment], eax
+
+mov eax, SYS_THREAD_CREATE
+mov ebx, unmapper
+mov ecx, stack_top
+int 0x80
+mov ebp, eax
+
+.fork:
+mov eax, SYS_FORK
+int 0x80
+test eax, eax
+jz child
+
+mov ebx, eax
+mov eax, SYS_WAITPID
+mov ecx, 0
+int 0x80
+
+inc dword [forks]
+cmp dword [done], 0
+je .fork
+
+mov eax, SYS_WAITPID
+mov ebx, ebp
+mov ecx, 0
+int 0x80
+
+mov eax, [forks]
+mov edi, count + 8
+call hex
+
+mov ebx, msg
+mov eax, SYS_PUTS
+int 0x80
+
+mov eax, SYS_EXIT
+mov ebx, 0
+int 0x80
+
+; Drops the segment if it was mapped when the parent forked
+child:
+mov eax, SYS_SHM_UNMAP
+mov ebx, SHM_ADDR
+int 0x80
+
+mov eax, SYS_EXIT
+mov ebx, 0
+int 0x80
+
+unmapper:
+mov esi, ROUNDS
+.round:
+mov eax, SYS_SHM_MAP
+mov ebx, [segment]
+mov ecx, SHM_ADDR
+int 0x80
+cmp eax, -1
+je .next
+
+mov edi, SHM_ADDR
+.touch:
+mov [edi], esi
+add edi, 0x1000
+cmp edi, SHM_ADDR + SHM_SIZE
+jb .touch
+
+mov eax, SYS_SHM_UNMAP
+mov ebx, SHM_ADDR
+int 0x80
+
+.next:
+dec esi
+jnz .round
+
+mov dword [done], 1
+
+mov eax, SYS_EXIT
+mov ebx, 0
+int 0x80
+
+fail:
+mov ebx, failed
+mov eax, SYS_PUTS
+int 0x80
+
+mov eax, SYS_EXIT
+mov ebx, 1
+int 0x80
+
+; Write eax out as hex, ending at edi
+hex:
+mov ecx, 8
+.digit:
+dec edi
+mov edx, eax
+and edx, 0xF
+mov dl, [digits + edx]
+mov [edi], dl
+shr eax, 4
+loop .digit
+ret
+
+[SECTION .data]
+
+name:		db	"fork_unmap", 0
+msg:		db	"fork vs unmap: 0x"
+count:		db	"00000000 forks survived", 0xa, 0
+failed:		db	"fork vs unmap: no segment", 0xa, 0
+digits:		db	"0123456789abcdef"
+
+align 4
+segment:	dd	0
+forks:		dd	0
+done:		dd	0
+			times 256 dd 0
+stack_top:
@@ -0,0 +1,96 @@
+[BITS 32]
+[ORG 0h]
+
+; Two threads incrementing a counter under one mutex. The count has to come
+; out right, and the cycles show what contended locking costs.
+
+%define SYS_PUTS            0
+%define SYS_THREAD_CREATE   11
+%define SYS_EXIT            12
+%define SYS_WAITPID         13
+
+%define ROUNDS              100000
+
+
+[SECTION .text]
+
+rdtsc
+mov esi, eax
+
+mov eax, SYS_THREAD_CREATE
+mov ebx, worker
+mov ecx, stack_top
+int 0x80
+mov ebp, eax
+
+call count
+
+mov eax, SYS_WAITPID
+mov ebx, ebp
+mov ecx, 0
+int 0x80
+
+rdtsc
+sub eax, esi
+mov edi, cycles + 8
+call hex
+
+mov eax, [counter]
+mov edi, total + 8
+call hex
+
+mov ebx, msg
+mov eax, SYS_PUTS
+int 0x80
+
+mov eax, SYS_EXIT
+mov ebx, 0
+int 0x80
+
+worker:
+call count
+
+mov eax, SYS_EXIT
+mov ebx, 0
+int 0x80
+
+; Add ROUNDS to the counter, one at a time under the mutex
+count:
+mov ebx, mutex
+mov ecx, ROUNDS
+.round:
+call mutex_lock
+inc dword [counter]
+call mutex_unlock
+loop .round
+ret
+
+; Write eax out as hex, ending at edi
+hex:
+push ecx
+mov ecx, 8
+.digit:
+dec edi
+mov edx, eax
+and edx, 0xF
+mov dl, [digits + edx]
+mov [edi], dl
+shr eax, 4
+loop .digit
+pop ecx
+ret
+
+%include "sync.inc"
+
+[SECTION .data]
+
+msg:		db	"futex mutex: counter 0x"
+total:		db	"00000000 (0x30d40 expected), 0x"
+cycles:		db	"00000000 cycles", 0xa, 0
+digits:		db	"0123456789abcdef"
+
+align 4
+mutex:		dd	0
+counter:	dd	0
+			times 256 dd 0
+stack_top:
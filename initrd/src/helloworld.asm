@@ -8,7 +8,10 @@ mov eax, 0x0
 mov ebx, str
 int 0x80
 
-jmp $
+; exit(0)
+mov eax, 12
+mov ebx, 0
+int 0x80
 
 [SECTION .data]
 
@@ -0,0 +1,129 @@
+[BITS 32]
+[ORG 0h]
+
+; Cycles to write CALLS dots to the console with one write system call each,
+; compared with queueing CALLS writes on a submission ring and handing them
+; to the kernel with a single ioring_enter
+
+%define SYS_PUTS            0
+%define SYS_WRITE           8
+%define SYS_IORING_SETUP    9
+%define SYS_IORING_ENTER    10
+%define SYS_EXIT            12
+%define FD_CONSOLE          1
+%define IORING_OP_WRITE     2
+
+; ioring_shared_t
+%define SQ_TAIL             4
+%define CQ_HEAD             8
+%define CQ_TAIL             12
+%define SQES                24
+
+; ioring_sqe_t
+%define SQE_SIZE            32
+%define SQE_OPCODE          0
+%define SQE_FD              4
+%define SQE_ADDR            8
+%define SQE_LEN             12
+%define SQE_USER_DATA       24
+
+%define CALLS               64
+
+
+[SECTION .text]
+
+; One system call per write
+rdtsc
+mov esi, eax
+mov edi, CALLS
+.single:
+mov eax, SYS_WRITE
+mov ebx, FD_CONSOLE
+mov ecx, dot
+mov edx, 1
+push esi
+mov esi, 0
+int 0x80
+pop esi
+dec edi
+jnz .single
+
+rdtsc
+sub eax, esi
+mov edi, single + 8
+call hex
+
+; Ring as large as the batch
+mov eax, SYS_IORING_SETUP
+mov ebx, CALLS
+mov ecx, 0
+int 0x80
+cmp eax, -1
+je .done
+mov ebp, eax
+
+; Queue the writes and submit them in one go, waiting for all of them
+rdtsc
+mov esi, eax
+
+mov ebx, ebp
+add ebx, [ebp + SQES]
+xor ecx, ecx
+.queue:
+mov byte [ebx + SQE_OPCODE], IORING_OP_WRITE
+mov dword [ebx + SQE_FD], FD_CONSOLE
+mov dword [ebx + SQE_ADDR], dot
+mov dword [ebx + SQE_LEN], 1
+mov [ebx + SQE_USER_DATA], ecx
+add ebx, SQE_SIZE
+inc ecx
+cmp ecx, CALLS
+jne .queue
+
+; Entries are written before the tail that publishes them
+add dword [ebp + SQ_TAIL], CALLS
+
+mov eax, SYS_IORING_ENTER
+mov ebx, CALLS
+mov ecx, CALLS
+mov edx, 0
+int 0x80
+
+; Consume the completions
+mov eax, [ebp + CQ_TAIL]
+mov [ebp + CQ_HEAD], eax
+
+rdtsc
+sub eax, esi
+mov edi, batched + 8
+call hex
+
+.done:
+mov ebx, msg
+mov eax, SYS_PUTS
+int 0x80
+
+mov eax, SYS_EXIT
+mov ebx, 0
+int 0x80
+
+; Write eax out as hex, ending at edi
+hex:
+mov ecx, 8
+.digit:
+dec edi
+mov edx, eax
+and edx, 0xF
+mov dl, [digits + edx]
+mov [edi], dl
+shr eax, 4
+loop .digit
+ret
+
+[SECTION .data]
+
+msg:			db	0xa, "64 console writes: system calls 0x"
+single:			db	"00000000 cycles, one ioring_enter 0x"
+batched:		db	"00000000 cycles", 0xa, 0
+digits:			db	"0123456789abcdef"
+dot:			db	"."
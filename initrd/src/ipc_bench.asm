@@ -0,0 +1,126 @@
+[BITS 32]
+[ORG 0h]
+
+; Round trip latency of synchronous IPC between a client and a forked
+; server, which replies with the message plus one. Each call switches
+; straight to the server and each reply straight back.
+
+%define SYS_PUTS            0
+%define SYS_FORK            1
+%define SYS_EXIT            12
+%define SYS_WAITPID         13
+%define SYS_IPC_CALL        16
+%define SYS_IPC_REPLY_WAIT  17
+
+%define VDSO_SYSCALL        0xFF400000
+
+%define CALLS_SHIFT         14
+%define CALLS               (1 << CALLS_SHIFT)
+%define QUIT                0xFFFFFFFF
+
+; Make CALLS calls, checking every reply, and write the average cycles out
+; as hex at %2
+%macro MEASURE 2
+rdtsc
+mov [start], eax
+mov ebx, 0
+%%loop:
+mov eax, SYS_IPC_CALL
+mov ecx, ebp
+%1
+test eax, eax
+jnz %%fail
+inc dword [expect]
+cmp ebx, [expect]
+jne %%fail
+cmp ebx, CALLS
+jb %%loop
+
+rdtsc
+sub eax, [start]
+shr eax, CALLS_SHIFT
+mov edi, %2 + 8
+call hex
+%%fail:
+mov dword [expect], 0
+%endmacro
+
+%macro INT80 0
+int 0x80
+%endmacro
+
+%macro VDSO 0
+call VDSO_SYSCALL
+%endmacro
+
+
+[SECTION .text]
+
+mov eax, SYS_FORK
+int 0x80
+mov ebp, eax
+
+test eax, eax
+jz server
+
+MEASURE INT80, via_int80
+MEASURE VDSO, via_vdso
+
+; The server exits instead of replying, failing the call
+mov eax, SYS_IPC_CALL
+mov ebx, QUIT
+mov ecx, ebp
+int 0x80
+
+mov eax, SYS_WAITPID
+mov ebx, ebp
+mov ecx, 0
+int 0x80
+
+mov ebx, msg
+mov eax, SYS_PUTS
+int 0x80
+
+mov eax, SYS_EXIT
+mov ebx, 0
+int 0x80
+
+server:
+mov ecx, 0
+.serve:
+mov eax, SYS_IPC_REPLY_WAIT
+call VDSO_SYSCALL
+cmp ebx, QUIT
+je .quit
+mov ecx, eax
+inc ebx
+jmp .serve
+
+.quit:
+mov eax, SYS_EXIT
+mov ebx, 0
+int 0x80
+
+; Write eax out as hex, ending at edi
+hex:
+mov ecx, 8
+.digit:
+dec edi
+mov edx, eax
+and edx, 0xF
+mov dl, [digits + edx]
+mov [edi], dl
+shr eax, 4
+loop .digit
+ret
+
+[SECTION .data]
+
+msg:		db	"IPC round trip: int 0x80 0x"
+via_int80:	db	"00000000 cycles, vDSO 0x"
+via_vdso:	db	"00000000 cycles", 0xa, 0
+digits:		db	"0123456789abcdef"
+
+align 4
+start:		dd	0
+expect:		dd	0
@@ -0,0 +1,158 @@
+[BITS 32]
+[ORG 0h]
+
+; Pipe throughput between a forked writer and its parent. Writes and reads
+; of whole aligned pages move frames between the address spaces, unaligned
+; ones are copied into the pipe and out again. The writer touches every page
+; of its buffer before each write, as if it produced the data.
+
+%define SYS_PUTS            0
+%define SYS_FORK            1
+%define SYS_CLOSE           6
+%define SYS_READ            7
+%define SYS_WRITE           8
+%define SYS_EXIT            12
+%define SYS_WAITPID         13
+%define SYS_PIPE            15
+
+; Buffers in the stack region, far below the stack itself
+%define WBUF                0xBFF00000
+%define RBUF                0xBFF40000
+
+%define CHUNK               0x4000
+%define CHUNKS              256
+%define TOTAL               (CHUNK * CHUNKS)
+
+[SECTION .text]
+
+mov eax, SYS_PIPE
+mov ebx, fds
+int 0x80
+
+mov eax, SYS_FORK
+int 0x80
+mov ebp, eax
+
+test eax, eax
+jz writer
+
+mov eax, SYS_CLOSE
+mov ebx, [fds + 4]
+int 0x80
+
+mov ecx, RBUF
+call receive
+mov edi, flip + 8
+call hex
+
+mov ecx, RBUF + 1
+call receive
+mov edi, copy + 8
+call hex
+
+mov eax, SYS_WAITPID
+mov ebx, ebp
+mov ecx, 0
+int 0x80
+
+mov ebx, msg
+mov eax, SYS_PUTS
+int 0x80
+
+mov eax, SYS_EXIT
+mov ebx, 0
+int 0x80
+
+; Read TOTAL bytes into the buffer at ecx, returning the cycles it took
+receive:
+push ecx
+rdtsc
+mov [start], eax
+pop ecx
+mov dword [left], TOTAL
+
+.read:
+push ecx
+mov eax, SYS_READ
+mov ebx, [fds]
+mov edx, [left]
+cmp edx, CHUNK
+jbe .len
+mov edx, CHUNK
+.len:
+mov esi, 0
+int 0x80
+pop ecx
+
+cmp eax, 0
+jle .done
+sub [left], eax
+jnz .read
+
+.done:
+rdtsc
+sub eax, [start]
+ret
+
+writer:
+mov eax, SYS_CLOSE
+mov ebx, [fds]
+int 0x80
+
+mov ecx, WBUF
+call send
+mov ecx, WBUF + 1
+call send
+
+mov eax, SYS_EXIT
+mov ebx, 0
+int 0x80
+
+; Write TOTAL bytes from the buffer at ecx, CHUNK at a time
+send:
+mov edi, CHUNKS
+.chunk:
+mov eax, ecx
+and eax, ~0xFFF
+.touch:
+mov [eax], edi
+add eax, 0x1000
+cmp eax, WBUF + CHUNK + 0x1000
+jb .touch
+
+push ecx
+mov eax, SYS_WRITE
+mov ebx, [fds + 4]
+mov edx, CHUNK
+mov esi, 0
+int 0x80
+pop ecx
+
+dec edi
+jnz .chunk
+ret
+
+; Write eax out as hex, ending at edi
+hex:
+mov ecx, 8
+.digit:
+dec edi
+mov edx, eax
+and edx, 0xF
+mov dl, [digits + edx]
+mov [edi], dl
+shr eax, 4
+loop .digit
+ret
+
+[SECTION .data]
+
+msg:		db	"pipe, 4MiB: page flipping 0x"
+flip:		db	"00000000 cycles, copying 0x"
+copy:		db	"00000000 cycles", 0xa, 0
+digits:		db	"0123456789abcdef"
+
+align 4
+fds:		dd	0, 0
+start:		dd	0
+left:		dd	0
@@ -0,0 +1,192 @@
+[BITS 32]
+[ORG 0h]
+
+; Hands a 60KiB buffer back and forth through a shared memory segment. The
+; parent maps it at a fixed address and the forked child wherever the
+; kernel puts it. Each round the parent fills the buffer and bumps seq, the
+; child checks every word and acks, both sleeping on futexes meanwhile.
+
+%define SYS_PUTS            0
+%define SYS_FORK            1
+%define SYS_EXIT            12
+%define SYS_WAITPID         13
+%define SYS_FUTEX           14
+%define SYS_SHM_CREATE      18
+%define SYS_SHM_MAP         19
+%define SYS_SHM_UNMAP       20
+
+%define FUTEX_WAIT          0
+%define FUTEX_WAKE          1
+
+%define SHM_SIZE            0x10000
+%define SHM_ADDR            0x90000000
+
+; Segment layout
+%define SEQ                 0
+%define ACK                 4
+%define ERRORS              8
+%define DATA                0x1000
+
+%define ROUNDS_SHIFT        10
+%define ROUNDS              (1 << ROUNDS_SHIFT)
+
+[SECTION .text]
+
+mov eax, SYS_FORK
+int 0x80
+mov [child], eax
+
+mov eax, SYS_SHM_CREATE
+mov ebx, name
+mov ecx, SHM_SIZE
+int 0x80
+cmp eax, -1
+je fail
+
+mov ebx, eax
+mov eax, SYS_SHM_MAP
+mov ecx, SHM_ADDR
+cmp dword [child], 0
+jne .map
+mov ecx, 0
+.map:
+int 0x80
+cmp eax, -1
+je fail
+mov ebp, eax
+
+cmp dword [child], 0
+je consumer
+
+rdtsc
+mov [start], eax
+
+mov esi, 1
+.round:
+lea edi, [ebp + DATA]
+mov eax, esi
+mov ecx, (SHM_SIZE - DATA) / 4
+rep stosd
+
+mov [ebp + SEQ], esi
+lea ebx, [ebp + SEQ]
+mov ecx, FUTEX_WAKE
+mov edx, 1
+mov eax, SYS_FUTEX
+int 0x80
+
+lea ebx, [ebp + ACK]
+call wait_for
+
+inc esi
+cmp esi, ROUNDS
+jbe .round
+
+rdtsc
+sub eax, [start]
+shr eax, ROUNDS_SHIFT
+mov edi, cycles + 8
+call hex
+
+mov eax, SYS_WAITPID
+mov ebx, [child]
+mov ecx, 0
+int 0x80
+
+mov eax, [ebp + ERRORS]
+mov edi, errors + 8
+call hex
+
+mov eax, SYS_SHM_UNMAP
+mov ebx, ebp
+int 0x80
+
+mov ebx, msg
+mov eax, SYS_PUTS
+int 0x80
+
+mov eax, SYS_EXIT
+mov ebx, 0
+int 0x80
+
+consumer:
+mov esi, 1
+.round:
+lea ebx, [ebp + SEQ]
+call wait_for
+
+lea edi, [ebp + DATA]
+mov ecx, (SHM_SIZE - DATA) / 4
+.check:
+cmp [edi], esi
+je .next
+inc dword [ebp + ERRORS]
+.next:
+add edi, 4
+loop .check
+
+mov [ebp + ACK], esi
+lea ebx, [ebp + ACK]
+mov ecx, FUTEX_WAKE
+mov edx, 1
+mov eax, SYS_FUTEX
+int 0x80
+
+inc esi
+cmp esi, ROUNDS
+jbe .round
+
+mov eax, SYS_SHM_UNMAP
+mov ebx, ebp
+int 0x80
+
+mov eax, SYS_EXIT
+mov ebx, 0
+int 0x80
+
+; Sleep until the word at ebx is esi
+wait_for:
+mov edx, [ebx]
+cmp edx, esi
+je .done
+mov ecx, FUTEX_WAIT
+mov eax, SYS_FUTEX
+int 0x80
+jmp wait_for
+.done:
+ret
+
+fail:
+mov ebx, failed
+mov eax, SYS_PUTS
+int 0x80
+
+mov eax, SYS_EXIT
+mov ebx, 1
+int 0x80
+
+; Write eax out as hex, ending at edi
+hex:
+mov ecx, 8
+.digit:
+dec edi
+mov edx, eax
+and edx, 0xF
+mov dl, [digits + edx]
+mov [edi], dl
+shr eax, 4
+loop .digit
+ret
+
+[SECTION .data]
+
+name:		db	"bench", 0
+msg:		db	"shm, 60KiB rounds: 0x"
+cycles:		db	"00000000 cycles, errors 0x"
+errors:		db	"00000000", 0xa, 0
+failed:		db	"shm: no segment", 0xa, 0
+digits:		db	"0123456789abcdef"
+
+align 4
+child:		dd	0
+start:		dd	0
@@ -0,0 +1,116 @@
+[BITS 32]
+[ORG 0h]
+
+; Average cycles of system calls through int 0x80, compared with calling the
+; vDSO: a null system call, which it makes with SYSENTER where the CPU has
+; it, and getpid and clock_gettime, which it answers without the kernel
+
+%define SYS_PUTS            0
+%define SYS_CLOCK_GETTIME   2
+%define SYS_NULL            3
+%define SYS_GETPID          4
+%define SYS_EXIT            12
+%define CLOCK_MONOTONIC     1
+
+%define VDSO_SYSCALL        0xFF400000
+%define VDSO_GETPID         0xFF400010
+%define VDSO_CLOCK_GETTIME  0xFF400018
+
+%define CALLS_SHIFT     16
+%define CALLS           (1 << CALLS_SHIFT)
+
+; Run a call CALLS times and write the average cycles out as hex at %2
+%macro MEASURE 2
+rdtsc
+mov esi, eax
+mov edi, CALLS
+%%loop:
+%1
+dec edi
+jnz %%loop
+
+rdtsc
+sub eax, esi
+shr eax, CALLS_SHIFT
+mov edi, %2 + 8
+call hex
+%endmacro
+
+%macro NULL_INT80 0
+mov eax, SYS_NULL
+int 0x80
+%endmacro
+
+%macro NULL_VDSO 0
+mov eax, SYS_NULL
+call VDSO_SYSCALL
+%endmacro
+
+%macro GETPID_INT80 0
+mov eax, SYS_GETPID
+int 0x80
+%endmacro
+
+%macro GETPID_VDSO 0
+call VDSO_GETPID
+%endmacro
+
+%macro TIME_INT80 0
+mov eax, SYS_CLOCK_GETTIME
+mov ebx, CLOCK_MONOTONIC
+mov ecx, ts
+int 0x80
+%endmacro
+
+%macro TIME_VDSO 0
+mov ebx, CLOCK_MONOTONIC
+mov ecx, ts
+call VDSO_CLOCK_GETTIME
+%endmacro
+
+
+[SECTION .text]
+
+MEASURE NULL_INT80, null_int80
+MEASURE NULL_VDSO, null_vdso
+MEASURE GETPID_INT80, getpid_int80
+MEASURE GETPID_VDSO, getpid_vdso
+MEASURE TIME_INT80, time_int80
+MEASURE TIME_VDSO, time_vdso
+
+mov ebx, msg
+mov eax, SYS_PUTS
+int 0x80
+
+mov eax, SYS_EXIT
+mov ebx, 0
+int 0x80
+
+; Write eax out as hex, ending at edi
+hex:
+mov ecx, 8
+.digit:
+dec edi
+mov edx, eax
+and edx, 0xF
+mov dl, [digits + edx]
+mov [edi], dl
+shr eax, 4
+loop .digit
+ret
+
+[SECTION .data]
+
+msg:			db	"null syscall:  int 0x80 0x"
+null_int80:		db	"00000000 cycles, vDSO 0x"
+null_vdso:		db	"00000000 cycles", 0xa
+				db	"getpid:        int 0x80 0x"
+getpid_int80:	db	"00000000 cycles, vDSO 0x"
+getpid_vdso:	db	"00000000 cycles", 0xa
+				db	"clock_gettime: int 0x80 0x"
+time_int80:		db	"00000000 cycles, vDSO 0x"
+time_vdso:		db	"00000000 cycles", 0xa, 0
+digits:			db	"0123456789abcdef"
+
+align 4
+ts:				dd	0, 0
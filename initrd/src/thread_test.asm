@@ -0,0 +1,76 @@
+[BITS 32]
+[ORG 0h]
+
+; Cycles from thread_create until the new thread runs, seen through memory
+; both threads share. Compare with fork_test, which copies the address space.
+
+%define SYS_PUTS            0
+%define SYS_THREAD_CREATE   11
+%define SYS_EXIT            12
+%define SYS_WAITPID         13
+
+
+[SECTION .text]
+
+rdtsc
+mov esi, eax
+
+mov eax, SYS_THREAD_CREATE
+mov ebx, thread
+mov ecx, stack_top
+int 0x80
+mov ebp, eax
+
+; The thread stores its start time where this one can see it
+.wait:
+pause
+mov eax, [started]
+test eax, eax
+jz .wait
+
+sub eax, esi
+
+; Write the cycle count out as hex
+mov edi, hex_end
+mov ecx, 8
+.digit:
+dec edi
+mov edx, eax
+and edx, 0xF
+mov dl, [digits + edx]
+mov [edi], dl
+shr eax, 4
+loop .digit
+
+mov ebx, msg
+mov eax, SYS_PUTS
+int 0x80
+
+mov eax, SYS_WAITPID
+mov ebx, ebp
+mov ecx, 0
+int 0x80
+
+mov eax, SYS_EXIT
+mov ebx, 0
+int 0x80
+
+thread:
+rdtsc
+mov [started], eax
+
+mov eax, SYS_EXIT
+mov ebx, 0
+int 0x80
+
+[SECTION .data]
+
+msg:		db	"thread_create: 0x"
+hex:		db	"00000000"
+hex_end:	db	" cycles", 0xa, 0
+digits:		db	"0123456789abcdef"
+
+align 4
+started:	dd	0
+			times 256 dd 0
+stack_top:
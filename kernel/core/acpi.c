@@ -0,0 +1,103 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <core/acpi.h>
+#include <memory/memory.h>
+#include <memory/paging.h>
+
+// Every valid table the root table points to, mapped once at boot
+static acpi_header_t *acpi_tables[ACPI_MAX_TABLES];
+static uint32_t acpi_table_count;
+
+
+/**
+ * Map firmware tables, those above usable memory aren't in the direct map
+ * @param  phys physical address
+ * @param  size bytes needed
+ * @return      virtual address of `phys`, 0 if it can't be mapped
+ */
+void *acpi_map(uint32_t phys, uint32_t size) {
+    if (phys + size <= meminfo.highest_free_address)
+        return phys_to_virt(phys);
+
+    return mmio_map(phys, size);
+}
+
+static bool acpi_checksum(void *table, uint32_t length) {
+    uint8_t sum = 0;
+
+    for (uint32_t i = 0; i < length; i++)
+        sum += ((uint8_t *)table)[i];
+
+    return sum == 0;
+}
+
+// Scan a range of the BIOS area on 16 byte boundaries for the RSDP
+static acpi_rsdp_t *acpi_scan(uint32_t start, uint32_t end) {
+    for (uint32_t phys = start; phys < end; phys += 16) {
+        acpi_rsdp_t *rsdp = (acpi_rsdp_t *)phys_to_virt(phys);
+
+        if (!memcmp(rsdp->signature, "RSD PTR ", 8) && acpi_checksum(rsdp, sizeof(acpi_rsdp_t)))
+            return rsdp;
+    }
+
+    return 0;
+}
+
+// Map a whole table, the header says how long it is
+static acpi_header_t *acpi_map_table(uint32_t phys) {
+    acpi_header_t *header = (acpi_header_t *)acpi_map(phys, sizeof(acpi_header_t));
+    if (!header)
+        return 0;
+
+    // Page mapped for the header may hold the rest too
+    if ((phys & 0xFFF) + header->length <= PAGE_SIZE)
+        return header;
+
+    return (acpi_header_t *)acpi_map(phys, header->length);
+}
+
+/**
+ * Locate the root table and map the tables it lists. The root pointer is
+ * looked for in the first KiB of the EBDA, then in the BIOS ROM area.
+ */
+void acpi_init() {
+    uint32_t ebda = *(uint16_t *)phys_to_virt(0x40E) << 4;
+
+    acpi_rsdp_t *rsdp = 0;
+    if (ebda)
+        rsdp = acpi_scan(ebda, ebda + 0x400);
+    if (!rsdp)
+        rsdp = acpi_scan(0xE0000, 0x100000);
+    if (!rsdp)
+        return;
+
+    acpi_header_t *rsdt = acpi_map_table(rsdp->rsdt);
+    if (!rsdt || !acpi_checksum(rsdt, rsdt->length))
+        return;
+
+    uint32_t entries = (rsdt->length - sizeof(acpi_header_t)) / 4;
+    uint32_t *tables = (uint32_t *)(rsdt + 1);
+
+    for (uint32_t i = 0; i < entries && acpi_table_count < ACPI_MAX_TABLES; i++) {
+        acpi_header_t *table = acpi_map_table(tables[i]);
+
+        if (table && acpi_checksum(table, table->length))
+            acpi_tables[acpi_table_count++] = table;
+    }
+}
+
+/**
+ * Find a system description table
+ * @param  signature four character name, e.g. "FACP"
+ * @return           mapped table, 0 if there's none or no ACPI at all
+ */
+acpi_header_t *acpi_find(const char *signature) {
+    for (uint32_t i = 0; i < acpi_table_count; i++) {
+        if (!memcmp(acpi_tables[i]->signature, signature, 4))
+            return acpi_tables[i];
+    }
+
+    return 0;
+}
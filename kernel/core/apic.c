@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <core/apic.h>
+#include <core/clock.h>
+#include <core/cpu.h>
+#include <core/interrupt.h>
+#include <core/spinlock.h>
+#include <memory/memory.h>
+#include <memory/paging.h>
+
+volatile uint32_t *apic;
+uint32_t apic_timer_khz;
+
+// Nothing to acknowledge, the APIC doesn't expect an EOI for these
+static void apic_spurious(registers_t *r) {
+    (void)r;
+}
+
+/**
+ * Map and enable the local APIC of the bootstrap processor. Legacy PIC
+ * interrupts keep arriving through LINT0, so drivers don't notice.
+ * @return true if there is a local APIC
+ */
+bool apic_init() {
+    if (!cpu_has_edx(CPUID_EDX_APIC) || !cpu_has_edx(CPUID_EDX_MSR))
+        return false;
+
+    uint64_t base = rdmsr(MSR_APIC_BASE);
+
+    apic = (volatile uint32_t *)mmio_map(base & 0xFFFFF000, PAGE_SIZE);
+    if (!apic)
+        return false;
+
+    isr_install_handler(APIC_SPURIOUS_VECTOR, apic_spurious);
+
+    apic_enable();
+    return true;
+}
+
+/**
+ * Enable the local APIC of the CPU this runs on. Every CPU sees its own at
+ * the same address. Only the bootstrap processor takes PIC interrupts.
+ */
+void apic_enable() {
+    uint64_t base = rdmsr(MSR_APIC_BASE);
+    wrmsr(MSR_APIC_BASE, base | APIC_BASE_ENABLE);
+
+    // Virtual wire mode, in case firmware left the LVT masked
+    if (base & APIC_BASE_BSP)
+        apic_write(APIC_LVT_LINT0, APIC_LVT_EXTINT);
+    else
+        apic_write(APIC_LVT_LINT0, APIC_LVT_MASKED | APIC_LVT_EXTINT);
+
+    apic_write(APIC_LVT_LINT1, APIC_LVT_NMI);
+    apic_write(APIC_LVT_TIMER, APIC_LVT_MASKED | APIC_TIMER_VECTOR);
+
+    apic_write(APIC_TPR, 0);
+    apic_write(APIC_SVR, APIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+/**
+ * Send an inter-processor interrupt
+ * @param apic_id local APIC ID of the target CPU
+ * @param command vector and delivery mode, see APIC_ICR_*
+ */
+void apic_send_ipi(uint8_t apic_id, uint32_t command) {
+    uint32_t flags = irq_save();
+
+    apic_write(APIC_ICR_HIGH, (uint32_t)apic_id << 24);
+    apic_write(APIC_ICR_LOW, command);
+
+    while (apic_read(APIC_ICR_LOW) & APIC_ICR_PENDING)
+        cpu_relax();
+
+    irq_restore(flags);
+}
+
+// Measure the timer frequency against the TSC, which is calibrated already
+void apic_timer_calibrate() {
+    apic_write(APIC_TIMER_DIV, APIC_TIMER_DIV_16);
+    apic_write(APIC_LVT_TIMER, APIC_LVT_MASKED | APIC_TIMER_VECTOR);
+    apic_write(APIC_TIMER_INIT, 0xFFFFFFFF);
+
+    uint64_t end = ktime_get_ns() + 10000000;
+    while (ktime_get_ns() < end);
+
+    apic_timer_khz = (0xFFFFFFFF - apic_read(APIC_TIMER_CUR)) / 10;
+    apic_write(APIC_TIMER_INIT, 0);
+}
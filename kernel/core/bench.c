@@ -0,0 +1,89 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <core/bench.h>
+#include <core/cpu.h>
+#include <memory/memory.h>
+#include <memory/paging.h>
+
+/**
+ * Run every benchmark and print the results
+ */
+void bench_run() {
+    bench_context_switch();
+}
+
+// Read a spread of kernel pages, as the kernel does on its way in and out of a switch
+static void bench_touch_kernel() {
+    volatile uint8_t *kernel = (volatile uint8_t *)VIRTUAL_BASE;
+
+    for (uint32_t i = 0; i < BENCH_PAGES; i++)
+        (void)kernel[i * (0x400000 / BENCH_PAGES)];
+}
+
+// Average cycles for switching to an address space and touching the kernel
+static uint32_t bench_switches(page_directory_t *a, page_directory_t *b) {
+    uint64_t start = rdtsc();
+
+    for (uint32_t i = 0; i < BENCH_SWITCHES; i++) {
+        load_page_dir(b->phys);
+        bench_touch_kernel();
+        load_page_dir(a->phys);
+        bench_touch_kernel();
+    }
+
+    return (rdtsc() - start) / (2 * BENCH_SWITCHES);
+}
+
+// Map the first 4MiB of the kernel with 4KiB pages and no global bit
+static page_table_t *bench_split_kernel(page_directory_t *pd) {
+    page_table_t *pt = (page_table_t *)kvalloc(sizeof(page_table_t));
+
+    for (uint32_t i = 0; i < 1024; i++)
+        pt->page_phys[i] = (i * PAGE_SIZE) | PT_PRESENT | PT_RW;
+
+    pd->table_phys[VIRTUAL_BASE >> 22] = virt_to_phys(pt) | PT_PRESENT | PT_RW;
+    return pt;
+}
+
+/**
+ * Measure the cost of an address space switch followed by kernel work, with
+ * the kernel on 4KiB pages, on 4MiB pages, and on global 4MiB pages
+ */
+void bench_context_switch() {
+    uint32_t small, large, global;
+
+    // Both sides share the kernel half, stack included
+    page_directory_t *a = create_pd();
+    page_directory_t *b = create_pd();
+    uint32_t kernel_pde = a->table_phys[VIRTUAL_BASE >> 22];
+    uint32_t cr4 = read_cr4();
+
+    asm volatile("cli");
+
+    // Global entries are flushed along with everything else once PGE is off
+    write_cr4(cr4 & ~CR4_PGE);
+
+    page_table_t *pt_a = bench_split_kernel(a);
+    page_table_t *pt_b = bench_split_kernel(b);
+    small = bench_switches(a, b);
+
+    a->table_phys[VIRTUAL_BASE >> 22] = kernel_pde;
+    b->table_phys[VIRTUAL_BASE >> 22] = kernel_pde;
+    large = bench_switches(a, b);
+
+    write_cr4(cr4);
+    global = bench_switches(a, b);
+
+    load_page_dir(current_pd->phys);
+    asm volatile("sti");
+
+    kfree(pt_a);
+    kfree(pt_b);
+    free_pd(a);
+    free_pd(b);
+
+    printf("[bench] switch + %u kernel pages: 4KiB %u, 4MiB %u, 4MiB global %u cycles\n",
+           BENCH_PAGES, small, large, global);
+}
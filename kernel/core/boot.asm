@@ -24,7 +24,7 @@ global _init_stack_start
 global _init_stack_end
 
 _init_stack_start:
-	resb 0x1000
+	resb 0x4000		; Kernel stack of the boot thread, same size as KSTACK_SIZE
 _init_stack_end:
 
 section .data
@@ -0,0 +1,254 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <core/acpi.h>
+#include <core/clock.h>
+#include <core/cpu.h>
+#include <core/port.h>
+#include <core/spinlock.h>
+#include <driver/pit.h>
+#include <memory/memory.h>
+#include <task/uaccess.h>
+#include <task/vdso.h>
+
+clocksource_t *clocksource;
+
+uint32_t tsc_khz;
+bool tsc_stable;
+
+// Counter value and time when the clock was last brought up to date, by
+// the timer interrupt of any CPU. The fraction of a ns is carried over, so
+// rounding doesn't add up. Readers don't lock, they retry while seq is odd
+// or has changed.
+static spinlock_t clock_lock = SPINLOCK_INIT;
+static volatile uint32_t clock_seq;
+static uint64_t clock_last;
+static uint64_t clock_ns;
+static uint64_t clock_frac;
+
+// Largest number of cycles converted in one go without overflowing
+static uint64_t clock_max_cycles;
+
+static uint16_t pm_timer_port;
+
+
+static uint64_t tsc_read() {
+    return rdtsc();
+}
+
+static uint64_t pm_timer_read() {
+    return inportl(pm_timer_port);
+}
+
+// Channel 2 counts down, time has to go up
+static uint64_t pit_read() {
+    return (uint16_t)~pit_ch2_read();
+}
+
+// Frequency of the TSC is filled in once it's calibrated
+static clocksource_t tsc_clocksource = {
+    .name = "TSC", .read = tsc_read, .mask = ~0ull, .vdso = true
+};
+
+static clocksource_t pm_clocksource = {
+    .name = "ACPI PM timer", .read = pm_timer_read, .mask = 0xFFFFFF, .hz = ACPI_PM_TIMER_HZ
+};
+
+static clocksource_t pit_clocksource = {
+    .name = "PIT", .read = pit_read, .mask = 0xFFFF, .hz = PIT_HZ
+};
+
+// Pick the most precise conversion to ns whose multiplier fits in 32 bits
+static void clocksource_setup(clocksource_t *cs) {
+    uint32_t shift = 32;
+    uint64_t mult;
+
+    while ((mult = (1000000000ull << shift) / cs->hz) > 0xFFFFFFFF)
+        shift--;
+
+    cs->mult = mult;
+    cs->shift = shift;
+
+    // Room for the fraction carried over as well
+    clock_max_cycles = ~0ull / mult / 2;
+
+    // Half the wraparound period, so a read can't miss a whole one
+    uint64_t wrap = cs->mask / 2;
+    cs->max_idle = wrap / cs->hz * 1000000000 + wrap % cs->hz * 1000000000 / cs->hz;
+}
+
+// Measure the TSC frequency against PIT channel 2, whose frequency is known
+static uint32_t tsc_calibrate() {
+    pit_ch2_start(CLOCK_CALIBRATE_COUNT);
+    uint64_t start = rdtsc();
+    while (!pit_ch2_done());
+    uint64_t cycles = rdtsc() - start;
+
+    return cycles * PIT_HZ / CLOCK_CALIBRATE_COUNT / 1000;
+}
+
+/**
+ * Calibrate the TSC and decide whether it can be trusted. It has to measure
+ * the same every time, and under a hypervisor, which may not keep it in step
+ * with real time (e.g. QEMU without KVM), it has to be marked invariant.
+ * @return true if time can be kept with the TSC
+ */
+static bool tsc_check() {
+    if (!cpu_has_edx(CPUID_EDX_TSC))
+        return false;
+
+    uint32_t min = ~0u, max = 0;
+    for (uint32_t i = 0; i < CLOCK_CALIBRATE_RUNS; i++) {
+        uint32_t khz = tsc_calibrate();
+
+        if (khz < min)
+            min = khz;
+        if (khz > max)
+            max = khz;
+    }
+
+    tsc_khz = min;
+
+    if (!min || max - min > min / 100)
+        return false;
+
+    if (cpu_has_ecx(CPUID_ECX_HYPERVISOR) && !cpu_has_invariant_tsc())
+        return false;
+
+    return true;
+}
+
+/**
+ * Choose a clock source: the TSC if it's stable, the ACPI power management
+ * timer otherwise, and PIT channel 2 as a last resort. Time starts at 0.
+ */
+void clock_init() {
+    uint32_t flags = irq_save();
+    tsc_stable = tsc_check();
+    irq_restore(flags);
+
+    acpi_fadt_t *fadt = (acpi_fadt_t *)acpi_find("FACP");
+
+    if (tsc_stable) {
+        tsc_clocksource.hz = tsc_khz * 1000;
+        clocksource = &tsc_clocksource;
+    } else if (fadt && fadt->pm_tmr_blk && fadt->pm_tmr_len == 4) {
+        pm_timer_port = fadt->pm_tmr_blk;
+        if (fadt->flags & ACPI_FADT_TMR_VAL_EXT)
+            pm_clocksource.mask = 0xFFFFFFFF;
+
+        clocksource = &pm_clocksource;
+    } else {
+        pit_ch2_free_run();
+        clocksource = &pit_clocksource;
+    }
+
+    clocksource_setup(clocksource);
+    clock_last = clocksource->read();
+
+    printf("Clock: %s (TSC %d kHz, %s)\n", clocksource->name, tsc_khz,
+           tsc_stable ? "stable" : "unstable");
+}
+
+// Cycles since clock_last, 0 if this CPU's TSC is a little behind
+static inline uint64_t clock_delta(uint64_t now, uint64_t last) {
+    uint64_t delta = (now - last) & clocksource->mask;
+    return delta > clocksource->mask / 2 ? 0 : delta;
+}
+
+// Convert cycles to ns in pieces the multiplication can take
+static uint64_t clock_convert(uint64_t delta, uint64_t *frac) {
+    uint64_t ns = 0;
+
+    while (delta) {
+        uint64_t cycles = delta < clock_max_cycles ? delta : clock_max_cycles;
+        delta -= cycles;
+
+        *frac += cycles * clocksource->mult;
+        ns += *frac >> clocksource->shift;
+        *frac &= (1ull << clocksource->shift) - 1;
+    }
+
+    return ns;
+}
+
+/**
+ * Bring the time up to date and publish it to the vDSO. Called from the
+ * timer interrupt, which comes at least every max_idle of the clock source.
+ * @return nanoseconds since clock_init()
+ */
+uint64_t ktime_update() {
+    if (!clocksource)
+        return 0;
+
+    uint32_t flags = spin_lock_irqsave(&clock_lock);
+
+    uint64_t now = clocksource->read();
+    uint64_t delta = clock_delta(now, clock_last);
+
+    clock_seq++;
+    asm volatile("" : : : "memory");
+
+    if (delta) {
+        clock_last = now;
+        clock_ns += clock_convert(delta, &clock_frac);
+    }
+
+    asm volatile("" : : : "memory");
+    clock_seq++;
+
+    uint64_t ns = clock_ns;
+    vdso_update_time(clock_last, clock_ns, clock_frac);
+
+    spin_unlock_irqrestore(&clock_lock, flags);
+    return ns;
+}
+
+/**
+ * Monotonic time since clock_init(), extrapolated from the last update
+ * without taking a lock
+ * @return nanoseconds
+ */
+uint64_t ktime_get_ns() {
+    if (!clocksource)
+        return 0;
+
+    uint32_t seq;
+    uint64_t last, ns, frac, delta;
+
+    do {
+        while ((seq = clock_seq) & 1)
+            asm volatile("pause");
+        asm volatile("" : : : "memory");
+
+        last = clock_last;
+        ns = clock_ns;
+        frac = clock_frac;
+        delta = clock_delta(clocksource->read(), last);
+
+        asm volatile("" : : : "memory");
+    } while (seq != clock_seq);
+
+    // Long since the last update, e.g. a counter that wraps around quickly
+    // like the PIT's polled before timers run, or a CPU idle without ticks
+    if (delta > clocksource->mask / 4 || delta > clock_max_cycles)
+        return ktime_update();
+
+    return ns + clock_convert(delta, &frac);
+}
+
+/**
+ * Read a clock, as a system call
+ * @param  clock CLOCK_MONOTONIC, nothing else is kept track of
+ * @param  ts    where the time is stored in user memory
+ * @return       0 on success, -1 on a bad clock or pointer
+ */
+int clock_gettime(uint32_t clock, struct timespec *ts) {
+    if (clock != CLOCK_MONOTONIC)
+        return -1;
+
+    uint64_t ns = ktime_get_ns();
+    struct timespec now = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+
+    return copy_to_user(ts, &now, sizeof(now)) ? 0 : -1;
+}
@@ -93,7 +93,11 @@ ISR_NOERRCODE 28
 ISR_NOERRCODE 29
 ISR_NOERRCODE 30
 ISR_NOERRCODE 31
+ISR_NOERRCODE 48              ; Local APIC timer
+ISR_NOERRCODE 49              ; Reschedule IPI
+ISR_NOERRCODE 50              ; TLB shootdown IPI
 ISR_NOERRCODE 128
+ISR_NOERRCODE 255             ; Local APIC spurious interrupt
 IRQ   0,    32
 IRQ   1,    33
 IRQ   2,    34
@@ -113,6 +117,7 @@ IRQ  15,    47
 
 
 extern isr_handler
+global isr_return
 
 isr_common_stub:
     pusha                    ; Pushes edi,esi,ebp,esp,ebx,edx,ecx,eax
@@ -124,15 +129,16 @@ isr_common_stub:
     mov ds, ax
     mov es, ax
     mov fs, ax
+    mov ax, 0x30  ; GS points at this CPU's data, see this_cpu()
     mov gs, ax
 
     call isr_handler
 
+isr_return:                  ; New threads start here to leave through their trap frame
     pop ebx        ; reload the original data segment descriptor
     mov ds, bx
     mov es, bx
-    mov fs, bx
-    mov gs, bx
+    mov fs, bx     ; GS stays, iret clears it on the way to user mode
 
     popa                     ; Pops edi,esi,ebp...
     add esp, 8     ; Cleans up the pushed error code and pushed ISR number
@@ -152,6 +158,7 @@ irq_common_stub:
     mov ds, ax
     mov es, ax
     mov fs, ax
+    mov ax, 0x30  ; GS points at this CPU's data, see this_cpu()
     mov gs, ax
 
     call irq_handler
@@ -159,8 +166,7 @@ irq_common_stub:
     pop ebx        ; reload the original data segment descriptor
     mov ds, bx
     mov es, bx
-    mov fs, bx
-    mov gs, bx
+    mov fs, bx     ; GS stays, iret clears it on the way to user mode
 
     popa                     ; Pops edi,esi,ebp...
     add esp, 8     ; Cleans up the pushed error code and pushed ISR number
@@ -0,0 +1,165 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <core/cpu.h>
+#include <core/fpu.h>
+#include <core/interrupt.h>
+#include <core/smp.h>
+#include <memory/slab.h>
+#include <task/thread.h>
+
+static kmem_cache_t *fpu_cache;
+static bool fpu_fxsr;
+
+// Registers as FNINIT leaves them, copied into every new save area
+static uint8_t fpu_initial[FPU_STATE_SIZE] __attribute__((aligned(FPU_STATE_ALIGN)));
+
+
+static inline void clts() {
+    asm volatile("clts" : : : "memory");
+}
+
+static inline void stts() {
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+static void fpu_save(void *area) {
+    if (fpu_fxsr)
+        asm volatile("fxsave (%0)" : : "r" (area) : "memory");
+    else
+        asm volatile("fnsave (%0)" : : "r" (area) : "memory");
+}
+
+static void fpu_restore(void *area) {
+    if (fpu_fxsr)
+        asm volatile("fxrstor (%0)" : : "r" (area) : "memory");
+    else
+        asm volatile("frstor (%0)" : : "r" (area) : "memory");
+}
+
+/**
+ * Device not available (#NM), the current thread used the FPU after a switch.
+ * The registers still belong to whichever thread used them last on this
+ * CPU, they're saved to that thread before the current one's are loaded.
+ */
+static void fpu_trap(registers_t *r) {
+    (void)r;
+    cpu_t *cpu = this_cpu();
+    thread_t *thread = cpu->current;
+
+    clts();
+
+    if (cpu->fpu_owner == thread)
+        return;
+
+    if (cpu->fpu_owner)
+        fpu_save(cpu->fpu_owner->fpu);
+
+    // First use, the thread starts from a clean FPU
+    if (!thread->fpu) {
+        thread->fpu = kmem_cache_alloc(fpu_cache);
+        memcpy(thread->fpu, fpu_initial, FPU_STATE_SIZE);
+    }
+
+    fpu_restore(thread->fpu);
+    cpu->fpu_owner = thread;
+}
+
+// Enable the FPU, and SSE if there is one, with every use trapping until
+// a thread owns it
+void fpu_init_cpu() {
+    write_cr0((read_cr0() | CR0_MP | CR0_NE | CR0_TS) & ~CR0_EM);
+
+    if (fpu_fxsr)
+        write_cr4(read_cr4() | CR4_OSFXSR | (cpu_has_edx(CPUID_EDX_SSE) ? CR4_OSXMMEXCPT : 0));
+}
+
+/**
+ * Switch FPU state lazily. Threads get a save area the first time they use
+ * the FPU, and registers are only saved and restored when another thread on
+ * the same CPU uses it too.
+ */
+void fpu_init() {
+    fpu_fxsr = cpu_has_edx(CPUID_EDX_FXSR);
+    fpu_init_cpu();
+
+    fpu_cache = kmem_cache_create("fpu_state", FPU_STATE_SIZE, FPU_STATE_ALIGN, 0);
+
+    clts();
+    asm volatile("fninit");
+    fpu_save(fpu_initial);
+    stts();
+
+    isr_install_handler(7, fpu_trap);
+
+    printf("FPU: lazy switching with %s\n", fpu_fxsr ? "FXSAVE" : "FNSAVE");
+}
+
+/**
+ * Called on every thread switch with interrupts disabled. If `next` was the
+ * last to use this CPU's FPU the registers are still its own, otherwise its
+ * first FPU instruction traps.
+ * @param cpu  current CPU
+ * @param next thread being switched to
+ */
+void fpu_switch(cpu_t *cpu, thread_t *next) {
+    if (cpu->fpu_owner == next)
+        clts();
+    else
+        stts();
+}
+
+/**
+ * Write the FPU registers back to the thread owning them on this CPU, e.g.
+ * before its save area is copied. The owner's next use reloads them.
+ */
+void fpu_flush() {
+    uint32_t flags = irq_save();
+    cpu_t *cpu = this_cpu();
+
+    if (cpu->fpu_owner) {
+        clts();
+        fpu_save(cpu->fpu_owner->fpu);
+        cpu->fpu_owner = 0;
+        stts();
+    }
+
+    irq_restore(flags);
+}
+
+/**
+ * Give a new thread the FPU state of another one
+ * @param to   thread that hasn't run yet
+ * @param from thread to copy, nothing is copied if it never used the FPU
+ */
+void fpu_copy(thread_t *to, thread_t *from) {
+    if (!from->fpu)
+        return;
+
+    fpu_flush();
+
+    to->fpu = kmem_cache_alloc(fpu_cache);
+    memcpy(to->fpu, from->fpu, FPU_STATE_SIZE);
+}
+
+/**
+ * Drop the FPU state of a thread exiting on the current CPU. Threads don't
+ * leave the CPU holding their registers, so no other one can.
+ * @param thread current thread
+ */
+void fpu_release(thread_t *thread) {
+    uint32_t flags = irq_save();
+    cpu_t *cpu = this_cpu();
+
+    if (cpu->fpu_owner == thread) {
+        cpu->fpu_owner = 0;
+        stts();
+    }
+
+    if (thread->fpu)
+        kmem_cache_free(fpu_cache, thread->fpu);
+
+    thread->fpu = 0;
+    irq_restore(flags);
+}
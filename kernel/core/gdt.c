@@ -1,31 +1,55 @@
+#include <string.h>
+
 #include <core/gdt.h>
+#include <core/smp.h>
 
-struct gdt_entry gdt[6];
-struct tss_entry tss;
-struct gdt_ptr gp;
+static void gdt_set_gate(struct gdt_entry *gdt, int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran);
+static void write_tss(struct cpu *cpu, int num, uint16_t ss0, uint32_t esp0);
 
+// Set up the descriptor tables of the bootstrap processor
 void gdt_init() {
+    gdt_init_cpu(&cpus[0]);
+}
+
+/**
+ * Install a CPU's own GDT and TSS. One segment covers the CPU's cpu_t and is
+ * loaded into GS, which is how this_cpu() finds it.
+ * @param cpu CPU this runs on
+ */
+void gdt_init_cpu(struct cpu *cpu) {
+    struct gdt_entry *gdt = cpu->gdt;
+
+    cpu->self = cpu;
+
     /* Setup the GDT pointer and limit */
-    gp.limit = (sizeof(struct gdt_entry) * 6) - 1;
-    gp.base = &gdt;
+    cpu->gp.limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
+    cpu->gp.base = (uint32_t)gdt;
 
-    gdt_set_gate(0, 0, 0, 0, 0);                // Null segment
+    gdt_set_gate(gdt, 0, 0, 0, 0, 0);                // Null segment
 
-    gdt_set_gate(1, 0, 0xFFFFFFFF, 0x9A, 0xCF); // Code segment
-    gdt_set_gate(2, 0, 0xFFFFFFFF, 0x92, 0xCF); // Data segment
+    gdt_set_gate(gdt, 1, 0, 0xFFFFFFFF, 0x9A, 0xCF); // Code segment
+    gdt_set_gate(gdt, 2, 0, 0xFFFFFFFF, 0x92, 0xCF); // Data segment
 
-    gdt_set_gate(3, 0, 0xFFFFFFFF, 0xFA, 0xCF); // User mode code segment
-    gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF); // User mode data segment
+    gdt_set_gate(gdt, 3, 0, 0xFFFFFFFF, 0xFA, 0xCF); // User mode code segment
+    gdt_set_gate(gdt, 4, 0, 0xFFFFFFFF, 0xF2, 0xCF); // User mode data segment
 
-    write_tss(5, 0x10, 0x0);
+    write_tss(cpu, 5, 0x10, 0x0);
+
+    // Per-CPU data segment, byte granular
+    gdt_set_gate(gdt, 6, (uint32_t)cpu, sizeof(cpu_t) - 1, 0x92, 0x40);
+
+    // Never loaded, user mode reads the CPU number from its limit with LSL
+    gdt_set_gate(gdt, 7, 0, cpu->id, 0xF2, 0x40);
 
     /* Flush out the old GDT and install the new changes! */
-    gdt_flush((uint32_t) &gp);
+    gdt_flush((uint32_t) &cpu->gp);
     tss_flush();
+
+    asm volatile("mov %0, %%gs" : : "r" (SEL_PERCPU));
 }
 
 /* Setup a descriptor in the Global Descriptor Table */
-static void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
+static void gdt_set_gate(struct gdt_entry *gdt, int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
     /* Setup the descriptor base address */
     gdt[num].base_low    = (base & 0xFFFF);
     gdt[num].base_middle = (base >> 16) & 0xFF;
@@ -41,19 +65,21 @@ static void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access,
 }
 
 // Initialise our task state segment structure.
-static void write_tss(int num, uint16_t ss0, uint32_t esp0) {
+static void write_tss(struct cpu *cpu, int num, uint16_t ss0, uint32_t esp0) {
+   struct tss_entry *tss = &cpu->tss;
+
    // Firstly, let's compute the base and limit of our entry into the GDT.
-   uint32_t base = (uint32_t) &tss;
-   uint32_t limit = base + sizeof(tss);
+   uint32_t base = (uint32_t) tss;
+   uint32_t limit = base + sizeof(*tss);
 
    // Now, add our TSS descriptor's address to the GDT.
-   gdt_set_gate(num, base, limit, 0xE9, 0x00);
+   gdt_set_gate(cpu->gdt, num, base, limit, 0xE9, 0x00);
 
    // Ensure the descriptor is initially zero.
-   memset(&tss, 0, sizeof(tss));
+   memset(tss, 0, sizeof(*tss));
 
-   tss.ss0  = ss0;  // Set the kernel stack segment.
-   tss.esp0 = esp0; // Set the kernel stack pointer.
+   tss->ss0  = ss0;  // Set the kernel stack segment.
+   tss->esp0 = esp0; // Set the kernel stack pointer.
 
    // Here we set the cs, ss, ds, es, fs and gs entries in the TSS. These specify what
    // segments should be loaded when the processor switches to kernel mode. Therefore
@@ -61,6 +87,6 @@ static void write_tss(int num, uint16_t ss0, uint32_t esp0) {
    // but with the last two bits set, making 0x0b and 0x13. The setting of these bits
    // sets the RPL (requested privilege level) to 3, meaning that this TSS can be used
    // to switch to kernel mode from ring 3.
-   tss.cs   = 0x0b;
-   tss.ss = tss.ds = tss.es = tss.fs = tss.gs = 0x13;
+   tss->cs   = 0x0b;
+   tss->ss = tss->ds = tss->es = tss->fs = tss->gs = 0x13;
 }
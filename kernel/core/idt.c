@@ -16,7 +16,7 @@ void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags) {
     *  is set here, along with any access flags */
     idt[num].sel = sel;
     idt[num].always0 = 0;
-    idt[num].flags = flags | 0x60;
+    idt[num].flags = flags;
 }
 
 
@@ -92,9 +92,22 @@ void idt_init() {
     idt_set_gate(45, (uint32_t)irq13, 0x08, 0x8E);
     idt_set_gate(46, (uint32_t)irq14, 0x08, 0x8E);
     idt_set_gate(47, (uint32_t)irq15, 0x08, 0x8E);
-    idt_set_gate(128, (uint32_t)isr128, 0x08, 0x8E);
+
+    // Vectors of the local APIC, reachable only by hardware and IPIs
+    idt_set_gate(48, (uint32_t)isr48, 0x08, 0x8E);
+    idt_set_gate(49, (uint32_t)isr49, 0x08, 0x8E);
+    idt_set_gate(50, (uint32_t)isr50, 0x08, 0x8E);
+    idt_set_gate(255, (uint32_t)isr255, 0x08, 0x8E);
+
+    // System calls are the only gate user mode may use itself (DPL 3)
+    idt_set_gate(128, (uint32_t)isr128, 0x08, 0xEE);
 
     idt_flush((uint32_t)&idtp);
 
     asm volatile("sti");
 }
+
+// Application processors share the bootstrap processor's IDT
+void idt_load() {
+    idt_flush((uint32_t)&idtp);
+}
@@ -1,5 +1,11 @@
 #include <core/gdt.h>
 #include <core/interrupt.h>
+#include <core/acpi.h>
+#include <core/bench.h>
+#include <core/clock.h>
+#include <core/fpu.h>
+#include <core/smp.h>
+#include <core/timer.h>
 #include <memory/memory.h>
 #include <driver/vga.h>
 #include <driver/initrd.h>
@@ -14,9 +20,20 @@ void kernel_main(void) {
 
 	mem_print_reserved();
 
+#ifdef KERNEL_BENCH
+	bench_run();
+#endif
+
+	acpi_init();
+	clock_init();
+	timer_init();
+
+	fpu_init();
 	syscall_init();
 	multitask_init();
+	smp_init();
 
+	fs_init();
 	fs_root = initrd_init(meminfo.initrd_start);
 	printf("Root dir:\n");
     int i = 0;
@@ -35,13 +52,19 @@ void kernel_main(void) {
 	}
 	printf("\n");
 
-	int child = fork();
+	// Start user programs, each in its own process
+	spawn("fork_test.bin");
+	spawn("fork_test_big.bin");
+	spawn("helloworld.bin");
+	spawn("syscall_bench.bin");
+	spawn("ioring_bench.bin");
+	spawn("thread_test.bin");
+	spawn("futex_test.bin");
+	spawn("pipe_bench.bin");
+	spawn("ipc_bench.bin");
+	spawn("shm_bench.bin");
+	spawn("fork_unmap_test.bin");
 
-	if (child == thread->pid) {
-		exec("fork_test.bin");
-	} else {
-		exec("helloworld.bin");
-	}
-	
-	for (;;);
+	// Nothing left for the boot thread to do, the idle thread takes over
+	scheduler_block(THREAD_ZOMBIE);
 }
\ No newline at end of file
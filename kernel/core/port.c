@@ -8,4 +8,10 @@ unsigned char inportb (unsigned short _port)
 void outportb (unsigned short _port, unsigned char _data)
 {
     __asm__ __volatile__ ("outb %1, %0" : : "dN" (_port), "a" (_data));
-}
\ No newline at end of file
+}
+unsigned int inportl (unsigned short _port)
+{
+    unsigned int rv;
+    __asm__ __volatile__ ("inl %1, %0" : "=a" (rv) : "dN" (_port));
+    return rv;
+}
@@ -0,0 +1,318 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <core/acpi.h>
+#include <core/apic.h>
+#include <core/clock.h>
+#include <core/cpu.h>
+#include <core/fpu.h>
+#include <core/gdt.h>
+#include <core/interrupt.h>
+#include <core/smp.h>
+#include <core/timer.h>
+#include <memory/memory.h>
+#include <memory/paging.h>
+#include <task/kstack.h>
+#include <task/scheduler.h>
+#include <task/syscall.h>
+
+// The bootstrap processor is always cpus[0]
+cpu_t cpus[SMP_MAX_CPUS] = { [0] = { .online = true } };
+uint32_t cpu_count = 1;
+
+// trampoline.asm
+extern uint8_t trampoline_start[];
+extern uint8_t trampoline_data[];
+extern uint8_t trampoline_end[];
+
+// Processor being started and the stack it starts on, one at a time
+static cpu_t *volatile ap_booting;
+static uint32_t ap_stack;
+
+// Shootdown in progress: page to invalidate and CPUs that haven't yet
+static spinlock_t tlb_lock = SPINLOCK_INIT;
+static volatile uint32_t tlb_addr;
+static volatile uint32_t tlb_acks;
+
+
+// Add a processor listed by firmware, the bootstrap processor is there already
+static void smp_add_cpu(uint8_t apic_id) {
+    if (apic_id == cpus[0].apic_id || cpu_count == SMP_MAX_CPUS)
+        return;
+
+    cpu_t *cpu = &cpus[cpu_count];
+    cpu->id = cpu_count++;
+    cpu->apic_id = apic_id;
+}
+
+// Every enabled local APIC in the MADT is a processor
+static bool madt_parse() {
+    acpi_madt_t *madt = (acpi_madt_t *)acpi_find("APIC");
+    if (!madt)
+        return false;
+
+    uint8_t *entry = (uint8_t *)(madt + 1);
+    uint8_t *end = (uint8_t *)madt + madt->header.length;
+
+    while (entry + sizeof(acpi_madt_entry_t) <= end) {
+        acpi_madt_entry_t *header = (acpi_madt_entry_t *)entry;
+        if (header->length < sizeof(acpi_madt_entry_t))
+            break;
+
+        if (header->type == ACPI_MADT_LAPIC) {
+            acpi_madt_lapic_t *lapic = (acpi_madt_lapic_t *)header;
+            if (lapic->flags & ACPI_MADT_ENABLED)
+                smp_add_cpu(lapic->apic_id);
+        }
+
+        entry += header->length;
+    }
+
+    return true;
+}
+
+static bool mp_checksum(void *table, uint32_t length) {
+    uint8_t sum = 0;
+
+    for (uint32_t i = 0; i < length; i++)
+        sum += ((uint8_t *)table)[i];
+
+    return sum == 0;
+}
+
+// Scan a range of the BIOS area on 16 byte boundaries for the MP pointer
+static mp_pointer_t *mp_scan(uint32_t start, uint32_t end) {
+    for (uint32_t phys = start; phys < end; phys += 16) {
+        mp_pointer_t *mp = (mp_pointer_t *)phys_to_virt(phys);
+
+        if (!memcmp(mp->signature, "_MP_", 4) && mp_checksum(mp, mp->length * 16))
+            return mp;
+    }
+
+    return 0;
+}
+
+/**
+ * Find the processors in the MP configuration table of older firmware. The
+ * pointer to it is in the first KiB of the EBDA, the last KiB of base
+ * memory or the BIOS ROM.
+ * @return true if there is a configuration table
+ */
+static bool mp_parse() {
+    uint32_t ebda = *(uint16_t *)phys_to_virt(0x40E) << 4;
+    uint32_t base_end = *(uint16_t *)phys_to_virt(0x413) * 1024;
+
+    mp_pointer_t *mp = 0;
+    if (ebda)
+        mp = mp_scan(ebda, ebda + 0x400);
+    if (!mp && base_end)
+        mp = mp_scan(base_end - 0x400, base_end);
+    if (!mp)
+        mp = mp_scan(0xF0000, 0x100000);
+
+    // No table means one of the default configurations, with two CPUs at most
+    if (!mp || !mp->config)
+        return false;
+
+    mp_config_t *config = (mp_config_t *)acpi_map(mp->config, sizeof(mp_config_t));
+    if (!config || memcmp(config->signature, "PCMP", 4))
+        return false;
+
+    config = (mp_config_t *)acpi_map(mp->config, config->length);
+    if (!config || !mp_checksum(config, config->length))
+        return false;
+
+    uint8_t *entry = (uint8_t *)(config + 1);
+    for (uint32_t i = 0; i < config->entries; i++) {
+        if (*entry != MP_ENTRY_PROCESSOR) {
+            entry += 8;
+            continue;
+        }
+
+        mp_processor_t *cpu = (mp_processor_t *)entry;
+        if (cpu->flags & MP_PROCESSOR_ENABLED)
+            smp_add_cpu(cpu->apic_id);
+
+        entry += sizeof(mp_processor_t);
+    }
+
+    return true;
+}
+
+static void smp_delay(uint64_t ns) {
+    uint64_t end = ktime_get_ns() + ns;
+    while (ktime_get_ns() < end)
+        cpu_relax();
+}
+
+// INIT, then the startup IPI twice as the MP specification says
+static bool smp_start_cpu(cpu_t *cpu) {
+    apic_send_ipi(cpu->apic_id, APIC_ICR_INIT | APIC_ICR_ASSERT);
+    smp_delay(10000000);
+
+    for (uint32_t i = 0; i < 2 && !cpu->online; i++) {
+        apic_send_ipi(cpu->apic_id, APIC_ICR_STARTUP | (TRAMPOLINE_BASE >> 12));
+        smp_delay(200000);
+    }
+
+    uint64_t end = ktime_get_ns() + 100000000;
+    while (!cpu->online && ktime_get_ns() < end)
+        cpu_relax();
+
+    return cpu->online;
+}
+
+/**
+ * First C code run by an application processor, on the stack smp_init()
+ * allocated for it. Paging is on, with low memory still identity mapped.
+ */
+void ap_main() {
+    cpu_t *cpu = ap_booting;
+
+    gdt_init_cpu(cpu);
+    idt_load();
+    switch_pd(kernel_pd);
+    fpu_init_cpu();
+    syscall_init_cpu();
+
+    apic_enable();
+    timer_init_cpu();
+
+    // Becomes the CPU's idle thread, the CPU counts as online from there
+    scheduler_start_cpu(ap_stack);
+}
+
+static void tlb_ipi(registers_t *r) {
+    (void)r;
+    apic_eoi();
+    tlb_poll();
+}
+
+/**
+ * Start every other processor the firmware lists, from the MADT or else the
+ * MP configuration table. They run their idle threads until a busy CPU has
+ * threads to spare.
+ */
+void smp_init() {
+    isr_install_handler(IPI_TLB_VECTOR, tlb_ipi);
+
+    // Processors need their own local APIC timer to schedule anything
+    if (!apic || !apic_timer_khz)
+        return;
+
+    cpus[0].apic_id = apic_id();
+
+    if (!madt_parse())
+        mp_parse();
+
+    if (cpu_count == 1)
+        return;
+
+    // Trampoline runs at a fixed address below 1MiB, which stays identity
+    // mapped in its address space until the processor reaches ap_main()
+    memcpy(phys_to_virt(TRAMPOLINE_BASE), trampoline_start, trampoline_end - trampoline_start);
+    trampoline_data_t *data = (trampoline_data_t *)phys_to_virt(TRAMPOLINE_BASE + (trampoline_data - trampoline_start));
+
+    page_directory_t *pd = create_pd();
+    pd->table_phys[0] = PD_PRESENT | PD_RW | PD_LARGE;
+
+    data->cr3 = pd->phys;
+    data->cr4 = read_cr4();
+    data->entry = (uint32_t)ap_main;
+
+    uint32_t online = 1;
+    for (uint32_t i = 1; i < cpu_count; i++) {
+        cpu_t *cpu = &cpus[i];
+
+        ap_stack = kstack_alloc();
+        data->stack = ap_stack;
+        ap_booting = cpu;
+
+        if (smp_start_cpu(cpu))
+            online++;
+        else
+            printf("SMP: CPU %d (APIC ID %d) didn't start\n", cpu->id, cpu->apic_id);
+    }
+
+    free_pd(pd);
+
+    printf("SMP: %d of %d CPUs online\n", online, cpu_count);
+}
+
+/**
+ * Ask a CPU to look at its run queues, e.g. because a thread was queued on
+ * it or because it's idle and others have threads waiting
+ * @param cpu CPU to interrupt, nothing happens if it's the current one
+ */
+void smp_send_resched(cpu_t *cpu) {
+    if (cpu != this_cpu() && cpu->online)
+        apic_send_ipi(cpu->apic_id, IPI_RESCHED_VECTOR);
+}
+
+// Flush what another CPU asked for, from the IPI or while spinning on a lock
+void tlb_poll() {
+    cpu_t *cpu = this_cpu();
+    if (!cpu->tlb_pending)
+        return;
+
+    // CR3 is reloaded as is, it may not match cpu->pd in the middle of a switch
+    if (tlb_addr == TLB_FLUSH_ALL)
+        write_cr3(read_cr3());
+    else
+        invlpg((void *)tlb_addr);
+
+    cpu->tlb_pending = false;
+    __sync_fetch_and_sub(&tlb_acks, 1);
+}
+
+/**
+ * Invalidate a page on every CPU that may have it cached. The kernel half
+ * is shared by every address space, so it's all of them for kernel pages,
+ * and only the ones running `pd` for user pages.
+ * @param pd   address space the mapping changed in
+ * @param virt page, or TLB_FLUSH_ALL for every page of the user half
+ */
+void tlb_shootdown(page_directory_t *pd, uint32_t virt) {
+    uint32_t flags = irq_save();
+    cpu_t *me = this_cpu();
+    bool kernel = virt != TLB_FLUSH_ALL && virt >= VIRTUAL_BASE;
+
+    if (kernel || pd == me->pd) {
+        if (virt == TLB_FLUSH_ALL)
+            write_cr3(read_cr3());
+        else
+            invlpg((void *)virt);
+    }
+
+    uint32_t targets = 0, count = 0;
+    for (uint32_t c = 0; c < cpu_count; c++) {
+        if (&cpus[c] != me && cpus[c].online && (kernel || cpus[c].pd == pd)) {
+            targets |= 1 << c;
+            count++;
+        }
+    }
+
+    if (!targets) {
+        irq_restore(flags);
+        return;
+    }
+
+    spin_lock(&tlb_lock);
+
+    tlb_addr = virt;
+    tlb_acks = count;
+
+    for (uint32_t c = 0; c < cpu_count; c++) {
+        if (targets & (1 << c)) {
+            cpus[c].tlb_pending = true;
+            apic_send_ipi(cpus[c].apic_id, IPI_TLB_VECTOR);
+        }
+    }
+
+    while (tlb_acks)
+        cpu_relax();
+
+    spin_unlock(&tlb_lock);
+    irq_restore(flags);
+}
@@ -0,0 +1,334 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <core/apic.h>
+#include <core/clock.h>
+#include <core/cpu.h>
+#include <core/interrupt.h>
+#include <core/port.h>
+#include <core/smp.h>
+#include <core/timer.h>
+#include <driver/pit.h>
+#include <task/scheduler.h>
+
+clockevent_t *clockevent;
+
+
+static void pit_arm(uint64_t delta) {
+    uint32_t count = delta * PIT_HZ / 1000000000;
+    pit_oneshot(count ? count : 1);
+}
+
+static void lapic_arm(uint64_t delta) {
+    uint32_t count = delta * apic_timer_khz / 1000000;
+    apic_write(APIC_TIMER_INIT, count ? count : 1);
+}
+
+static void lapic_stop() {
+    apic_write(APIC_TIMER_INIT, 0);
+}
+
+static void deadline_arm(uint64_t delta) {
+    wrmsr(MSR_TSC_DEADLINE, rdtsc() + delta * tsc_khz / 1000000);
+}
+
+static void deadline_stop() {
+    wrmsr(MSR_TSC_DEADLINE, 0);
+}
+
+static clockevent_t pit_clockevent = {
+    "PIT one-shot", pit_arm, pit_stop, PIT_MAX_COUNT * 1000000000ull / PIT_HZ
+};
+
+static clockevent_t lapic_clockevent = {
+    "local APIC one-shot", lapic_arm, lapic_stop, 0
+};
+
+static clockevent_t deadline_clockevent = {
+    "local APIC TSC-deadline", deadline_arm, deadline_stop, 1000000000ull
+};
+
+// Timer interrupts from the local APIC have to be acknowledged to it
+static void apic_timer_handler(registers_t *r) {
+    apic_eoi();
+    timer_interrupt(r);
+}
+
+/**
+ * Pick a clock event device, in order of preference the local APIC timer in
+ * TSC-deadline mode, in one-shot mode, then the PIT. Nothing is armed until
+ * a timer is added.
+ */
+void timer_init() {
+    if (apic_init())
+        apic_timer_calibrate();
+
+    if (apic_timer_khz) {
+        // PIT isn't needed anymore, mask IRQ 0 on the master PIC
+        pit_stop();
+        outportb(0x21, inportb(0x21) | 1);
+
+        isr_install_handler(APIC_TIMER_VECTOR, apic_timer_handler);
+
+        // Deadlines are in TSC cycles, so the TSC has to keep time
+        if (tsc_stable && cpu_has_ecx(CPUID_ECX_TSC_DEADLINE)) {
+            clockevent = &deadline_clockevent;
+        } else {
+            lapic_clockevent.max_delta = 0xFFFFFFFFull * 1000000 / apic_timer_khz;
+            clockevent = &lapic_clockevent;
+        }
+    } else {
+        pit_stop();
+        irq_install_handler(0, timer_interrupt);
+        clockevent = &pit_clockevent;
+    }
+
+    timer_init_cpu();
+
+    printf("Timer: %s\n", clockevent->name);
+}
+
+/**
+ * Start the timer wheel of the CPU this runs on, and set up its local APIC
+ * timer the same way as the bootstrap processor's
+ */
+void timer_init_cpu() {
+    timer_base_t *base = &this_cpu()->timers;
+
+    base->clock = ktime_get_ns() >> TIMER_SHIFT;
+    base->armed = ~0ull;
+
+    if (clockevent == &deadline_clockevent) {
+        apic_write(APIC_LVT_TIMER, APIC_TIMER_DEADLINE | APIC_TIMER_VECTOR);
+    } else if (clockevent == &lapic_clockevent) {
+        apic_write(APIC_TIMER_DIV, APIC_TIMER_DIV_16);
+        apic_write(APIC_LVT_TIMER, APIC_TIMER_ONESHOT | APIC_TIMER_VECTOR);
+    }
+}
+
+// First wheel unit at or after `ns`, so timers never fire early
+static inline uint64_t wheel_unit(uint64_t ns) {
+    return (ns + (1 << TIMER_SHIFT) - 1) >> TIMER_SHIFT;
+}
+
+static void wheel_insert(timer_base_t *base, timer_t *timer) {
+    uint64_t unit = wheel_unit(timer->expires);
+    if (unit < base->clock)
+        unit = base->clock;
+
+    // Beyond the top level, park it in the furthest slot and look again then
+    uint64_t range = 1ull << (TIMER_BITS * TIMER_LEVELS);
+    if (unit - base->clock >= range)
+        unit = base->clock + range - 1;
+
+    uint32_t level = 0;
+    while (unit - base->clock >= 1ull << (TIMER_BITS * (level + 1)))
+        level++;
+
+    uint32_t slot = (unit >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1);
+
+    timer->base = base;
+    timer->level = level;
+    timer->slot = slot;
+    timer->prev = 0;
+    timer->next = base->wheel[level][slot];
+    if (timer->next)
+        timer->next->prev = timer;
+
+    base->wheel[level][slot] = timer;
+    base->map[level] |= 1ull << slot;
+}
+
+static void wheel_remove(timer_base_t *base, timer_t *timer) {
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        base->wheel[timer->level][timer->slot] = timer->next;
+
+    if (timer->next)
+        timer->next->prev = timer->prev;
+
+    if (!base->wheel[timer->level][timer->slot])
+        base->map[timer->level] &= ~(1ull << timer->slot);
+}
+
+/**
+ * Find the first unit at or after the wheel's clock at which a slot is due, either
+ * to fire its timers or to cascade them to the level below
+ * @return wheel unit, ~0 if there are no timers
+ */
+static uint64_t wheel_next(timer_base_t *base) {
+    uint64_t next = ~0ull;
+
+    for (uint32_t level = 0; level < TIMER_LEVELS; level++) {
+        uint64_t map = base->map[level];
+        if (!map)
+            continue;
+
+        // Slots of this level are only processed on their boundaries
+        uint32_t shift = TIMER_BITS * level;
+        uint64_t start = (base->clock + (1ull << shift) - 1) >> shift;
+        uint32_t idx = start & (TIMER_SLOTS - 1);
+
+        // Rotate so that the slot at `start` is bit 0
+        if (idx)
+            map = (map >> idx) | (map << (TIMER_SLOTS - idx));
+
+        uint64_t unit = (start + __builtin_ctzll(map)) << shift;
+        if (unit < next)
+            next = unit;
+    }
+
+    return next;
+}
+
+// Process the slots due at `unit`, all units before it have been processed.
+// Callbacks run without the wheel locked, so they can arm timers themselves.
+static void wheel_advance(timer_base_t *base, uint64_t unit) {
+    base->clock = unit;
+
+    // Cascade from the top, so timers moved down are handled further below
+    for (uint32_t level = TIMER_LEVELS - 1; level > 0; level--) {
+        uint32_t shift = TIMER_BITS * level;
+        if (unit & ((1ull << shift) - 1))
+            continue;
+
+        timer_t **slot = &base->wheel[level][(unit >> shift) & (TIMER_SLOTS - 1)];
+        while (*slot) {
+            timer_t *timer = *slot;
+            wheel_remove(base, timer);
+            wheel_insert(base, timer);
+        }
+    }
+
+    // Callbacks may re-arm their timer, it goes into a later slot
+    base->clock = unit + 1;
+
+    timer_t **slot = &base->wheel[0][unit & (TIMER_SLOTS - 1)];
+    while (*slot) {
+        timer_t *timer = *slot;
+        wheel_remove(base, timer);
+        timer->pending = false;
+
+        spin_unlock(&base->lock);
+        timer->fn(timer->arg);
+        spin_lock(&base->lock);
+    }
+}
+
+// Arm this CPU's clock event device for the next slot that's due
+static void timer_reprogram(timer_base_t *base, uint64_t now) {
+    uint64_t next = wheel_next(base);
+    uint64_t delta;
+
+    if (next != ~0ull) {
+        uint64_t when = next << TIMER_SHIFT;
+        delta = when > now ? when - now : 0;
+    } else if (clocksource->max_idle < clockevent->max_delta) {
+        // Nothing to wait for, but a clock source that wraps around has to be read
+        delta = clocksource->max_idle;
+    } else {
+        base->armed = ~0ull;
+        clockevent->stop();
+        return;
+    }
+
+    if (delta < TIMER_MIN_NS)
+        delta = TIMER_MIN_NS;
+    if (delta > clockevent->max_delta)
+        delta = clockevent->max_delta;
+    if (delta > clocksource->max_idle)
+        delta = clocksource->max_idle;
+
+    base->armed = now + delta;
+    clockevent->arm(delta);
+}
+
+void timer_setup(timer_t *timer, void (*fn)(void *), void *arg) {
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->base = 0;
+    timer->pending = false;
+}
+
+// Take a timer off the wheel it's on, which may be another CPU's
+static void timer_detach(timer_t *timer) {
+    timer_base_t *base = timer->base;
+    if (!base)
+        return;
+
+    spin_lock(&base->lock);
+
+    if (timer->pending && timer->base == base) {
+        wheel_remove(base, timer);
+        timer->pending = false;
+    }
+
+    spin_unlock(&base->lock);
+}
+
+/**
+ * Arm a timer on the current CPU, or move it if it's pending already. A
+ * timer must not be armed from two CPUs at once.
+ * @param timer   timer set up with timer_setup()
+ * @param expires absolute time in ns at which it fires
+ */
+void timer_mod(timer_t *timer, uint64_t expires) {
+    uint32_t flags = irq_save();
+    timer_base_t *base = &this_cpu()->timers;
+
+    if (timer->base != base)
+        timer_detach(timer);
+
+    spin_lock(&base->lock);
+
+    if (timer->pending)
+        wheel_remove(base, timer);
+
+    timer->expires = expires;
+    timer->pending = true;
+    wheel_insert(base, timer);
+
+    // Device is armed too late for this one
+    if (clockevent && expires < base->armed)
+        timer_reprogram(base, ktime_get_ns());
+
+    spin_unlock(&base->lock);
+    irq_restore(flags);
+}
+
+/**
+ * Disarm a timer. The clock event device may still fire for it, which is
+ * harmless, and its callback may be running on another CPU.
+ * @param timer timer, pending or not
+ */
+void timer_del(timer_t *timer) {
+    uint32_t flags = irq_save();
+    timer_detach(timer);
+    irq_restore(flags);
+}
+
+// Run the timers that expired on this CPU, arm the device for the next one
+// and let the scheduler switch threads if one of them asked for it
+void timer_interrupt(registers_t *r) {
+    (void)r;
+
+    timer_base_t *base = &this_cpu()->timers;
+    uint64_t now = ktime_update();
+    uint64_t unit = now >> TIMER_SHIFT;
+    uint64_t next;
+
+    spin_lock(&base->lock);
+    base->armed = ~0ull;
+
+    while ((next = wheel_next(base)) <= unit)
+        wheel_advance(base, next);
+
+    if (base->clock <= unit)
+        base->clock = unit + 1;
+
+    timer_reprogram(base, ktime_get_ns());
+    spin_unlock(&base->lock);
+
+    preempt();
+}
@@ -0,0 +1,69 @@
+; Application processors start executing here in real mode, at the page the
+; startup IPI names. smp_init() copies this to TRAMPOLINE_BASE and fills in
+; trampoline_data, so every address is relative to that copy.
+
+TRAMPOLINE_BASE equ 0x7000
+%define T(x) ((x) - trampoline_start + TRAMPOLINE_BASE)
+
+[SECTION .text]
+
+global trampoline_start
+global trampoline_data
+global trampoline_end
+
+[BITS 16]
+trampoline_start:
+	cli
+	cld
+	xor ax, ax
+	mov ds, ax
+
+	lgdt [T(trampoline_gdt_ptr)]
+
+	mov eax, cr0
+	or eax, 1						; Protected mode
+	mov cr0, eax
+
+	jmp dword 0x08:T(trampoline_32)
+
+[BITS 32]
+trampoline_32:
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+	mov ss, ax
+
+	; Same paging setup as the bootstrap processor. Low memory is identity
+	; mapped in this directory, so the next instruction can still be fetched.
+	mov eax, [T(trampoline_data) + 4]	; cr4
+	mov cr4, eax
+	mov eax, [T(trampoline_data)]		; cr3
+	mov cr3, eax
+
+	mov eax, cr0
+	or eax, 0x80010000				; Paging, supervisor write protect
+	mov cr0, eax
+
+	mov esp, [T(trampoline_data) + 8]	; stack
+	xor ebp, ebp
+	mov eax, [T(trampoline_data) + 12]	; entry, ap_main() in the higher half
+	jmp eax
+
+align 8
+trampoline_gdt:
+	dq 0
+	dq 0x00CF9A000000FFFF			; Code segment
+	dq 0x00CF92000000FFFF			; Data segment
+trampoline_gdt_ptr:
+	dw trampoline_gdt_ptr - trampoline_gdt - 1
+	dd T(trampoline_gdt)
+
+align 4
+trampoline_data:					; trampoline_data_t
+	dd 0							; cr3
+	dd 0							; cr4
+	dd 0							; stack
+	dd 0							; entry
+trampoline_end:
@@ -1,6 +1,12 @@
+#include <memory/slab.h>
 #include <driver/fs.h>
 
 fs_node_t *fs_root = 0; // The root of the filesystem.
+kmem_cache_t *fs_node_cache;
+
+void fs_init() {
+    fs_node_cache = kmem_cache_create("fs_node_t", sizeof(fs_node_t), 4, 0);
+}
 
 uint32_t fs_read(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
     if (node->read != 0)
@@ -1,13 +1,16 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
+#include <memory/heap.h>
+#include <memory/slab.h>
 #include <driver/initrd.h>
 
 initrd_header_t *initrd_header;     // The header.
 initrd_file_header_t *file_headers; // The list of file headers.
 fs_node_t *initrd_root;             // Our root directory node.
 fs_node_t *initrd_dev;              // We also add a directory node for /dev, so we can mount devfs later on.
-fs_node_t *root_nodes;              // List of file nodes.
+fs_node_t **root_nodes;             // List of file nodes.
 int nroot_nodes;                    // Number of file nodes.
 
 struct dirent dirent;
@@ -37,9 +40,9 @@ static struct dirent *initrd_readdir(fs_node_t *node, uint32_t index) {
     if (index > nroot_nodes)
         return 0;
 
-    strcpy(dirent.name, root_nodes[index-1].name);
-    dirent.name[strlen(root_nodes[index-1].name)] = 0;
-    dirent.ino = root_nodes[index-1].inode;
+    strcpy(dirent.name, root_nodes[index-1]->name);
+    dirent.name[strlen(root_nodes[index-1]->name)] = 0;
+    dirent.ino = root_nodes[index-1]->inode;
     return &dirent;
 }
 
@@ -48,8 +51,8 @@ static fs_node_t *initrd_finddir(fs_node_t *node, char *name) {
        return initrd_dev;
 
     for (int i = 0; i < nroot_nodes; i++)
-       if (!strcmp(name, root_nodes[i].name))
-           return &root_nodes[i];
+       if (!strcmp(name, root_nodes[i]->name))
+           return root_nodes[i];
 
     return 0;
 }
@@ -65,7 +68,7 @@ fs_node_t *initrd_init(uint32_t location) {
     }
 
     // Initialise the root directory.
-    initrd_root = (fs_node_t*)kmalloc(sizeof(fs_node_t));
+    initrd_root = (fs_node_t*)kmem_cache_alloc(fs_node_cache);
     strcpy(initrd_root->name, "initrd");
     initrd_root->mask = initrd_root->uid = initrd_root->gid = initrd_root->length = 0;
     initrd_root->inode = 0;
@@ -80,7 +83,7 @@ fs_node_t *initrd_init(uint32_t location) {
     initrd_root->impl = 0;
 
     // Initialise the /dev directory (required!)
-    initrd_dev = (fs_node_t*)kmalloc(sizeof(fs_node_t));
+    initrd_dev = (fs_node_t*)kmem_cache_alloc(fs_node_cache);
     strcpy(initrd_dev->name, "dev");
     initrd_dev->mask = initrd_dev->uid = initrd_dev->gid = initrd_dev->length = 0;
     initrd_dev->inode = 1;
@@ -94,7 +97,7 @@ fs_node_t *initrd_init(uint32_t location) {
     initrd_dev->ptr = 0;
     initrd_dev->impl = 0;
 
-    root_nodes = (fs_node_t*)kmalloc(sizeof(fs_node_t) * initrd_header->size);
+    root_nodes = (fs_node_t**)kmalloc(sizeof(fs_node_t *) * initrd_header->size);
     nroot_nodes = initrd_header->size;
 
     // Create node for each file in initrd
@@ -104,18 +107,19 @@ fs_node_t *initrd_init(uint32_t location) {
         // of memory.
         file_headers[i].offset += location;
         // Create a new file node.
-        strcpy(root_nodes[i].name, &file_headers[i].name);
-        root_nodes[i].mask = root_nodes[i].uid = root_nodes[i].gid = 0;
-        root_nodes[i].length = file_headers[i].length;
-        root_nodes[i].inode = i + 2;
-        root_nodes[i].flags = FS_FILE;
-        root_nodes[i].read = &initrd_read;
-        root_nodes[i].write = 0;
-        root_nodes[i].readdir = 0;
-        root_nodes[i].finddir = 0;
-        root_nodes[i].open = 0;
-        root_nodes[i].close = 0;
-        root_nodes[i].impl = 0;
+        root_nodes[i] = (fs_node_t*)kmem_cache_alloc(fs_node_cache);
+        strcpy(root_nodes[i]->name, &file_headers[i].name);
+        root_nodes[i]->mask = root_nodes[i]->uid = root_nodes[i]->gid = 0;
+        root_nodes[i]->length = file_headers[i].length;
+        root_nodes[i]->inode = i + 2;
+        root_nodes[i]->flags = FS_FILE;
+        root_nodes[i]->read = &initrd_read;
+        root_nodes[i]->write = 0;
+        root_nodes[i]->readdir = 0;
+        root_nodes[i]->finddir = 0;
+        root_nodes[i]->open = 0;
+        root_nodes[i]->close = 0;
+        root_nodes[i]->impl = 0;
     }
     return initrd_root;
 }
@@ -3,6 +3,7 @@
 #include <core/interrupt.h>
 #include <driver/kb.h>
 #include <driver/vga.h>
+#include <task/wait.h>
 
 // Maps scancodes to ascii values
 static const unsigned char key_map[] = {
@@ -40,6 +41,9 @@ static volatile uint8_t buf_len = 0;
 // Keyboard modifier status
 static volatile bool caps, shift, ctrl, alt;
 
+// Threads waiting for a key press
+static wait_queue_t kb_wait;
+
 
 
 void kb_init() {
@@ -70,6 +74,9 @@ void kb_handler() {
         // Character key was pressed
         unsigned char c = key_map[scancode];
 
+        // Readers on other CPUs take characters out under the same lock
+        spin_lock(&kb_wait.lock);
+
         uint8_t i = buf_i + buf_len++;
         if (i == KB_BUF_MAX)
             i -= KB_BUF_MAX;
@@ -84,6 +91,9 @@ void kb_handler() {
 
         else
             buf[i] = c;        
+
+        spin_unlock(&kb_wait.lock);
+        wake_up(&kb_wait);
     }
 }
 
@@ -92,7 +102,10 @@ void kb_handler() {
 unsigned char kb_getchar() {
     unsigned char c;
 
-    while (!buf_len);
+    // Like wait_event(), but the character is taken before the lock is dropped
+    uint32_t flags = spin_lock_irqsave(&kb_wait.lock);
+    while (!buf_len)
+        sleep_on(&kb_wait);
 
     c = buf[buf_i];
 
@@ -100,6 +113,7 @@ unsigned char kb_getchar() {
     if (++buf_i == KB_BUF_MAX)
         buf_i = 0;
 
+    spin_unlock_irqrestore(&kb_wait.lock, flags);
     return c;
 }
 
@@ -0,0 +1,59 @@
+#include <stdint.h>
+
+#include <core/port.h>
+#include <driver/pit.h>
+
+/**
+ * Raise IRQ 0 once after `count` PIT cycles
+ * @param count cycles of PIT_HZ, 0 counts as 0x10000
+ */
+void pit_oneshot(uint16_t count) {
+    outportb(PIT_CMD, 0x30);                // Channel 0, lobyte/hibyte, mode 0
+    outportb(PIT_CH0, count & 0xFF);
+    outportb(PIT_CH0, count >> 8);
+}
+
+// Leave channel 0 waiting for a count, so it won't raise IRQ 0
+void pit_stop() {
+    outportb(PIT_CMD, 0x30);
+}
+
+/**
+ * Start counting down on channel 2, which is polled instead of raising an IRQ
+ * @param count cycles of PIT_HZ until pit_ch2_done() returns true
+ */
+void pit_ch2_start(uint16_t count) {
+    // Gate the channel on and keep the speaker quiet
+    uint8_t gate = inportb(PIT_GATE);
+    outportb(PIT_GATE, (gate & ~PIT_GATE_SPKR) & ~PIT_GATE_CH2);
+
+    outportb(PIT_CMD, 0xB0);                // Channel 2, lobyte/hibyte, mode 0
+    outportb(PIT_CH2, count & 0xFF);
+    outportb(PIT_CH2, count >> 8);
+
+    // Rising edge of the gate loads the count
+    outportb(PIT_GATE, (gate & ~PIT_GATE_SPKR) | PIT_GATE_CH2);
+}
+
+bool pit_ch2_done() {
+    return inportb(PIT_GATE) & PIT_OUT_CH2;
+}
+
+// Let channel 2 count down from 0xFFFF over and over, for reading the time
+void pit_ch2_free_run() {
+    uint8_t gate = inportb(PIT_GATE);
+    outportb(PIT_GATE, (gate & ~PIT_GATE_SPKR) | PIT_GATE_CH2);
+
+    outportb(PIT_CMD, 0xB4);                // Channel 2, lobyte/hibyte, mode 2
+    outportb(PIT_CH2, 0);
+    outportb(PIT_CH2, 0);
+}
+
+// Current count of channel 2
+uint16_t pit_ch2_read() {
+    outportb(PIT_CMD, 0x80);                // Latch channel 2
+    uint8_t lo = inportb(PIT_CH2);
+    uint8_t hi = inportb(PIT_CH2);
+
+    return lo | hi << 8;
+}
@@ -5,6 +5,7 @@
 
 #include <driver/vga.h>
 #include <core/port.h>
+#include <core/spinlock.h>
 
 static const size_t VGA_WIDTH = 80;
 static const size_t VGA_HEIGHT = 25;
@@ -15,6 +16,9 @@ static size_t vga_column;
 static uint8_t vga_color;
 static uint16_t* vga_buffer;
 
+// Characters from several CPUs may interleave, but the cursor stays sane
+static spinlock_t vga_lock = SPINLOCK_INIT;
+
 void vga_init(void) {
 	vga_row = 0;
 	vga_column = 0;
@@ -60,6 +64,8 @@ void vga_scroll() {
 }
 
 void vga_putch(char c) {
+	uint32_t flags = spin_lock_irqsave(&vga_lock);
+
 	if (c == '\n') {
 	    vga_row++;
 	    vga_column = 0;
@@ -77,6 +83,8 @@ void vga_putch(char c) {
 		vga_scroll();
 
 	vga_update_cursor();
+
+	spin_unlock_irqrestore(&vga_lock, flags);
 }
 
 void vga_puts(const char* data) {
@@ -0,0 +1,107 @@
+#ifndef __CORE_ACPI_H
+#define __CORE_ACPI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Root System Description Pointer, found in the BIOS area
+typedef struct {
+	char signature[8];			// "RSD PTR "
+	uint8_t checksum;
+	char oem_id[6];
+	uint8_t revision;
+	uint32_t rsdt;
+} __attribute__((packed)) acpi_rsdp_t;
+
+// Header shared by all system description tables
+typedef struct {
+	char signature[4];
+	uint32_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem_id[6];
+	char oem_table_id[8];
+	uint32_t oem_revision;
+	uint32_t creator_id;
+	uint32_t creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+// Fixed ACPI Description Table, only the fields up to the flags
+typedef struct {
+	acpi_header_t header;
+	uint32_t firmware_ctrl;
+	uint32_t dsdt;
+	uint8_t reserved;
+	uint8_t preferred_pm_profile;
+	uint16_t sci_int;
+	uint32_t smi_cmd;
+	uint8_t acpi_enable;
+	uint8_t acpi_disable;
+	uint8_t s4bios_req;
+	uint8_t pstate_cnt;
+	uint32_t pm1a_evt_blk;
+	uint32_t pm1b_evt_blk;
+	uint32_t pm1a_cnt_blk;
+	uint32_t pm1b_cnt_blk;
+	uint32_t pm2_cnt_blk;
+	uint32_t pm_tmr_blk;		// I/O port of the power management timer
+	uint32_t gpe0_blk;
+	uint32_t gpe1_blk;
+	uint8_t pm1_evt_len;
+	uint8_t pm1_cnt_len;
+	uint8_t pm2_cnt_len;
+	uint8_t pm_tmr_len;
+	uint8_t gpe0_blk_len;
+	uint8_t gpe1_blk_len;
+	uint8_t gpe1_base;
+	uint8_t cst_cnt;
+	uint16_t p_lvl2_lat;
+	uint16_t p_lvl3_lat;
+	uint16_t flush_size;
+	uint16_t flush_stride;
+	uint8_t duty_offset;
+	uint8_t duty_width;
+	uint8_t day_alrm;
+	uint8_t mon_alrm;
+	uint8_t century;
+	uint16_t iapc_boot_arch;
+	uint8_t reserved2;
+	uint32_t flags;
+} __attribute__((packed)) acpi_fadt_t;
+
+#define ACPI_FADT_TMR_VAL_EXT   (1<<8)  // PM timer is 32 bits wide instead of 24
+
+// Multiple APIC Description Table, followed by variable length entries
+typedef struct {
+	acpi_header_t header;
+	uint32_t lapic_addr;
+	uint32_t flags;
+} __attribute__((packed)) acpi_madt_t;
+
+typedef struct {
+	uint8_t type;
+	uint8_t length;
+} __attribute__((packed)) acpi_madt_entry_t;
+
+// Processor with a local APIC
+typedef struct {
+	acpi_madt_entry_t header;
+	uint8_t processor_id;
+	uint8_t apic_id;
+	uint32_t flags;
+} __attribute__((packed)) acpi_madt_lapic_t;
+
+#define ACPI_MADT_LAPIC         0
+#define ACPI_MADT_ENABLED       (1<<0)
+
+// Tables kept track of from the root table
+#define ACPI_MAX_TABLES         32
+
+// Frequency of the power management timer
+#define ACPI_PM_TIMER_HZ        3579545
+
+void acpi_init();
+void *acpi_map(uint32_t phys, uint32_t size);
+acpi_header_t *acpi_find(const char *signature);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef __CORE_APIC_H
+#define __CORE_APIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Local APIC registers, as offsets from its base
+#define APIC_ID         0x020
+#define APIC_TPR        0x080       // Task priority
+#define APIC_EOI        0x0B0
+#define APIC_SVR        0x0F0       // Spurious interrupt vector
+#define APIC_ICR_LOW    0x300       // Interrupt command
+#define APIC_ICR_HIGH   0x310       // Destination of the interrupt command
+#define APIC_LVT_TIMER  0x320
+#define APIC_LVT_LINT0  0x350
+#define APIC_LVT_LINT1  0x360
+#define APIC_TIMER_INIT 0x380       // Initial count
+#define APIC_TIMER_CUR  0x390       // Current count
+#define APIC_TIMER_DIV  0x3E0       // Divide configuration
+
+// Register flags
+#define APIC_SVR_ENABLE         (1<<8)
+#define APIC_LVT_MASKED         (1<<16)
+#define APIC_LVT_EXTINT         (7<<8)
+#define APIC_LVT_NMI            (4<<8)
+#define APIC_TIMER_ONESHOT      (0<<17)
+#define APIC_TIMER_DEADLINE     (2<<17)
+#define APIC_TIMER_DIV_16       0x3
+
+#define APIC_ICR_INIT           (5<<8)
+#define APIC_ICR_STARTUP        (6<<8)
+#define APIC_ICR_PENDING        (1<<12)
+#define APIC_ICR_ASSERT         (1<<14)
+
+#define APIC_BASE_BSP           (1<<8)
+#define APIC_BASE_ENABLE        (1<<11)
+
+// Interrupt vectors
+#define APIC_TIMER_VECTOR       48
+#define APIC_SPURIOUS_VECTOR    255
+
+// Local APIC timer ticks per millisecond, with the divider set to 16
+extern uint32_t apic_timer_khz;
+
+extern volatile uint32_t *apic;
+
+bool apic_init();
+void apic_enable();
+void apic_timer_calibrate();
+void apic_send_ipi(uint8_t apic_id, uint32_t command);
+
+static inline uint32_t apic_read(uint32_t reg) {
+    return apic[reg / 4];
+}
+
+static inline void apic_write(uint32_t reg, uint32_t value) {
+    apic[reg / 4] = value;
+}
+
+static inline void apic_eoi() {
+    apic_write(APIC_EOI, 0);
+}
+
+static inline uint8_t apic_id() {
+    return apic_read(APIC_ID) >> 24;
+}
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef __CORE_BENCH_H
+#define __CORE_BENCH_H
+
+#include <stdint.h>
+
+// Boot time microbenchmarks, run when the kernel is built with -DKERNEL_BENCH
+
+// Address space switches per measurement
+#define BENCH_SWITCHES  1000
+
+// Kernel pages touched after every switch, spread over the first 4MiB
+#define BENCH_PAGES     128
+
+void bench_run();
+void bench_context_switch();
+
+#endif
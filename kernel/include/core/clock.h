@@ -0,0 +1,51 @@
+#ifndef __CORE_CLOCK_H
+#define __CORE_CLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <driver/pit.h>
+
+// Length of one TSC calibration window on PIT channel 2 (10ms)
+#define CLOCK_CALIBRATE_COUNT   (PIT_HZ / 100)
+#define CLOCK_CALIBRATE_RUNS    3
+
+// Clocks of clock_gettime()
+#define CLOCK_REALTIME          0
+#define CLOCK_MONOTONIC         1
+
+struct timespec {
+	uint32_t tv_sec;
+	uint32_t tv_nsec;
+};
+
+/**
+ * Free running counter the time is read from
+ */
+typedef struct {
+	const char *name;
+	uint64_t (*read)();
+	uint64_t mask;			// Counter wraps around after this value
+	uint32_t hz;
+	bool vdso;				// User mode can read the counter itself
+
+	// Conversion to ns, cycles * mult >> shift
+	uint32_t mult;
+	uint32_t shift;
+
+	// Time has to be read at least this often to notice wraparounds (ns)
+	uint64_t max_idle;
+} clocksource_t;
+
+extern clocksource_t *clocksource;
+
+// Measured TSC frequency, and whether it's good enough to keep time with
+extern uint32_t tsc_khz;
+extern bool tsc_stable;
+
+void clock_init();
+uint64_t ktime_get_ns();
+uint64_t ktime_update();
+int clock_gettime(uint32_t clock, struct timespec *ts);
+
+#endif
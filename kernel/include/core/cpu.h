@@ -0,0 +1,130 @@
+#ifndef __CORE_CPU_H
+#define __CORE_CPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Control register 0 flags
+#define CR0_MP (1<<1)          // WAIT traps along with other FPU instructions when TS is set
+#define CR0_EM (1<<2)          // No FPU, every FPU instruction traps
+#define CR0_TS (1<<3)          // Task switched, the next FPU instruction traps
+#define CR0_NE (1<<5)          // Native FPU error reporting
+#define CR0_WP (1<<16)         // Supervisor writes honour read-only pages
+
+// Control register 4 flags
+#define CR4_PSE (1<<4)         // 4MiB pages
+#define CR4_PGE (1<<7)         // Global pages survive CR3 reloads
+#define CR4_OSFXSR (1<<9)      // FXSAVE/FXRSTOR cover SSE registers, SSE enabled
+#define CR4_OSXMMEXCPT (1<<10) // Unmasked SSE exceptions raise #XM
+
+// EFLAGS bits
+#define EFLAGS_IF (1<<9)       // Interrupts enabled
+
+// CPUID leaf 1 feature flags
+#define CPUID_EDX_PSE (1<<3)
+#define CPUID_EDX_TSC (1<<4)
+#define CPUID_EDX_MSR (1<<5)
+#define CPUID_EDX_APIC (1<<9)
+#define CPUID_EDX_SEP (1<<11)
+#define CPUID_EDX_PGE (1<<13)
+#define CPUID_EDX_FXSR (1<<24)
+#define CPUID_EDX_SSE (1<<25)
+#define CPUID_ECX_TSC_DEADLINE (1<<24)
+#define CPUID_ECX_HYPERVISOR (1u<<31)
+
+// CPUID leaf 0x80000007 flags
+#define CPUID_EXT_EDX_INVARIANT_TSC (1<<8)
+
+// Model specific registers
+#define MSR_APIC_BASE 0x1B
+#define MSR_TSC_DEADLINE 0x6E0
+
+// Read the time stamp counter
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    asm volatile("cpuid" : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx) : "a" (leaf), "c" (0));
+}
+
+// Check for a feature flag in EDX of CPUID leaf 1
+static inline bool cpu_has_edx(uint32_t flag) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return edx & flag;
+}
+
+// Check for a feature flag in ECX of CPUID leaf 1
+static inline bool cpu_has_ecx(uint32_t flag) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return ecx & flag;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a" (lo), "=d" (hi) : "c" (msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" : : "c" (msr), "a" ((uint32_t)value), "d" ((uint32_t)(value >> 32)) : "memory");
+}
+
+// Does the TSC tick at a constant rate in every power state?
+static inline bool cpu_has_invariant_tsc() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000007)
+        return false;
+
+    cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return edx & CPUID_EXT_EDX_INVARIANT_TSC;
+}
+
+// Disable interrupts, returning the previous flags for irq_restore()
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    asm volatile("pushf; pop %0; cli" : "=r" (flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    if (flags & EFLAGS_IF)
+        asm volatile("sti" : : : "memory");
+}
+
+static inline uint32_t read_cr0() {
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r" (cr0));
+    return cr0;
+}
+
+static inline void write_cr0(uint32_t cr0) {
+    asm volatile("mov %0, %%cr0" : : "r" (cr0) : "memory");
+}
+
+static inline uint32_t read_cr3() {
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r" (cr3));
+    return cr3;
+}
+
+static inline void write_cr3(uint32_t cr3) {
+    asm volatile("mov %0, %%cr3" : : "r" (cr3) : "memory");
+}
+
+static inline uint32_t read_cr4() {
+    uint32_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r" (cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint32_t cr4) {
+    asm volatile("mov %0, %%cr4" : : "r" (cr4) : "memory");
+}
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef __CORE_FPU_H
+#define __CORE_FPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// FXSAVE area, FNSAVE on processors without FXSR uses the first 108 bytes
+#define FPU_STATE_SIZE  512
+#define FPU_STATE_ALIGN 16
+
+struct cpu;
+struct thread;
+
+void fpu_init();
+void fpu_init_cpu();
+void fpu_switch(struct cpu *cpu, struct thread *next);
+void fpu_flush();
+void fpu_copy(struct thread *to, struct thread *from);
+void fpu_release(struct thread *thread);
+
+#endif
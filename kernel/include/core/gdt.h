@@ -3,6 +3,16 @@
 
 #include <stdint.h>
 
+// Kernel code and data, user code and data, the TSS, the per-CPU segment and
+// the CPU number segment
+#define GDT_ENTRIES 8
+
+// Selector of the segment that starts at the CPU's own cpu_t
+#define SEL_PERCPU  0x30
+
+// User mode selector of a segment whose limit is the CPU number, for LSL
+#define SEL_CPU_ID  0x3B
+
 /* Defines a GDT entry */
 struct gdt_entry {
     unsigned short limit_low;
@@ -51,10 +61,9 @@ struct tss_entry {
 extern void gdt_flush();
 extern void tss_flush();
 
-extern struct tss_entry tss;
+struct cpu;
 
 extern void gdt_init();
-static void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran);
-static void write_tss(int num, uint16_t ss0, uint32_t esp0);
+extern void gdt_init_cpu(struct cpu *cpu);
 
 #endif
@@ -33,10 +33,14 @@ extern isr_t isr[];
 extern void idt_init();
 extern void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags);
 extern void idt_flush();
+extern void idt_load();
 
 extern void irq_install_handler(int irq_no, isr_t isr);
 extern void isr_install_handler(int isr_no, isr_t isr);
 
+// Returns from an interrupt with the trap frame at the top of the stack
+extern void isr_return();
+
 
 // These extern directives let us access the addresses of our ASM ISR handlers.
 extern void isr0 ();
@@ -87,6 +91,10 @@ extern void irq12();
 extern void irq13();
 extern void irq14();
 extern void irq15();
+extern void isr48();
+extern void isr49();
+extern void isr50();
+extern void isr255();
 extern void isr128();
 
 #endif
@@ -3,5 +3,6 @@
 
 unsigned char inportb (unsigned short _port);
 void outportb (unsigned short _port, unsigned char _data);
+unsigned int inportl (unsigned short _port);
 
 #endif
\ No newline at end of file
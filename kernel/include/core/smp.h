@@ -0,0 +1,110 @@
+#ifndef __CORE_SMP_H
+#define __CORE_SMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <core/gdt.h>
+#include <core/spinlock.h>
+#include <core/timer.h>
+
+#define SMP_MAX_CPUS        16
+
+// Application processors start in real mode at this page, below the boot
+// sector, which is reserved along with the rest of low memory
+#define TRAMPOLINE_BASE     0x7000
+
+// Interrupt vectors of inter-processor interrupts
+#define IPI_RESCHED_VECTOR  49
+#define IPI_TLB_VECTOR      50
+
+// tlb_shootdown() address that flushes every non-global entry
+#define TLB_FLUSH_ALL       0xFFFFFFFF
+
+/**
+ * State private to one CPU. Each CPU's GS segment starts at its own cpu_t,
+ * see this_cpu().
+ */
+typedef struct cpu {
+	struct cpu *self;
+	uint32_t id;				// Index into cpus[]
+	uint8_t apic_id;
+	volatile bool online;
+
+	struct thread *current;		// Thread running on this CPU
+	struct thread *prev;		// Thread switched away from, until its state is saved
+	struct page_directory *pd;	// Address space loaded into CR3
+	struct thread *volatile fpu_owner;	// Thread whose registers the FPU holds
+
+	struct gdt_entry gdt[GDT_ENTRIES];
+	struct gdt_ptr gp;
+	struct tss_entry tss;
+
+	timer_base_t timers;
+
+	volatile bool tlb_pending;	// Another CPU waits for this one to flush its TLB
+} cpu_t;
+
+// Values handed to an application processor by the BSP, at the end of the trampoline
+typedef struct {
+	uint32_t cr3;
+	uint32_t cr4;
+	uint32_t stack;
+	uint32_t entry;
+} __attribute__((packed)) trampoline_data_t;
+
+// MultiProcessor Specification floating pointer, for machines without ACPI
+typedef struct {
+	char signature[4];			// "_MP_"
+	uint32_t config;			// Physical address of the configuration table
+	uint8_t length;				// In 16 byte units
+	uint8_t revision;
+	uint8_t checksum;
+	uint8_t features[5];
+} __attribute__((packed)) mp_pointer_t;
+
+typedef struct {
+	char signature[4];			// "PCMP"
+	uint16_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem_id[8];
+	char product_id[12];
+	uint32_t oem_table;
+	uint16_t oem_table_size;
+	uint16_t entries;
+	uint32_t lapic_addr;
+	uint16_t ext_length;
+	uint8_t ext_checksum;
+	uint8_t reserved;
+} __attribute__((packed)) mp_config_t;
+
+// Configuration table entry describing a processor, the others are 8 bytes
+typedef struct {
+	uint8_t type;				// MP_ENTRY_PROCESSOR
+	uint8_t apic_id;
+	uint8_t apic_version;
+	uint8_t flags;
+	uint32_t signature;
+	uint32_t features;
+	uint32_t reserved[2];
+} __attribute__((packed)) mp_processor_t;
+
+#define MP_ENTRY_PROCESSOR  0
+#define MP_PROCESSOR_ENABLED (1<<0)
+
+extern cpu_t cpus[SMP_MAX_CPUS];
+extern uint32_t cpu_count;
+
+void smp_init();
+void ap_main();
+void tlb_shootdown(struct page_directory *pd, uint32_t virt);
+void smp_send_resched(cpu_t *cpu);
+
+static inline cpu_t *this_cpu() {
+	cpu_t *cpu;
+	asm volatile("mov %%gs:0, %0" : "=r" (cpu));
+	return cpu;
+}
+
+#endif
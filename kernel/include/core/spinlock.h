@@ -0,0 +1,57 @@
+#ifndef __CORE_SPINLOCK_H
+#define __CORE_SPINLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <core/cpu.h>
+
+typedef struct {
+	volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT   { 0 }
+
+// smp.c, flushes the TLB if another CPU asked this one to
+void tlb_poll();
+
+static inline void cpu_relax() {
+    asm volatile("pause" : : : "memory");
+}
+
+static inline bool spin_trylock(spinlock_t *lock) {
+    return !__sync_lock_test_and_set(&lock->locked, 1);
+}
+
+/**
+ * Take a lock, spinning until it's free. Whoever holds it may be waiting for
+ * this CPU to flush its TLB, so that's done while spinning.
+ * @param lock lock to take
+ */
+static inline void spin_lock(spinlock_t *lock) {
+    while (!spin_trylock(lock)) {
+        while (lock->locked) {
+            tlb_poll();
+            cpu_relax();
+        }
+    }
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+    __sync_lock_release(&lock->locked);
+}
+
+// Take a lock with interrupts disabled, so an IRQ handler on the same CPU
+// can't try to take it again, returning the flags for spin_unlock_irqrestore()
+static inline uint32_t spin_lock_irqsave(spinlock_t *lock) {
+    uint32_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint32_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef __CORE_TIMER_H
+#define __CORE_TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <core/interrupt.h>
+#include <core/spinlock.h>
+
+// Hierarchical timer wheel. Level 0 has one slot per 2^TIMER_SHIFT ns (~16us),
+// each level above covers TIMER_SLOTS times the range of the one below.
+#define TIMER_SHIFT     14
+#define TIMER_BITS      6
+#define TIMER_SLOTS     (1 << TIMER_BITS)
+#define TIMER_LEVELS    4
+
+// Shortest delay a clock event device is programmed with
+#define TIMER_MIN_NS    2000
+
+/**
+ * Function called from the timer interrupt once `expires` has passed. The
+ * timer is no longer pending by then, so it may be re-armed.
+ */
+typedef struct timer {
+	uint64_t expires;			// Absolute time in ns, see ktime_get_ns()
+	void (*fn)(void *arg);
+	void *arg;
+
+	struct timer *next;			// Neighbours in a wheel slot
+	struct timer *prev;
+	struct timer_base *base;	// Wheel of the CPU it was armed on
+	uint8_t level;
+	uint8_t slot;
+	bool pending;
+} timer_t;
+
+/**
+ * Timer wheel of one CPU, each level has a bitmap of its non-empty slots.
+ * Timers fire on the CPU that armed them.
+ */
+typedef struct timer_base {
+	spinlock_t lock;
+	timer_t *wheel[TIMER_LEVELS][TIMER_SLOTS];
+	uint64_t map[TIMER_LEVELS];
+	uint64_t clock;				// Every unit before this one has been processed
+	uint64_t armed;				// Time the clock event device is armed for, ~0 if stopped
+} timer_base_t;
+
+/**
+ * Device that raises a single interrupt after a given delay
+ */
+typedef struct {
+	const char *name;
+	void (*arm)(uint64_t delta);	// Interrupt in `delta` ns
+	void (*stop)();
+	uint64_t max_delta;
+} clockevent_t;
+
+extern clockevent_t *clockevent;
+
+void timer_init();
+void timer_init_cpu();
+void timer_setup(timer_t *timer, void (*fn)(void *), void *arg);
+void timer_mod(timer_t *timer, uint64_t expires);
+void timer_del(timer_t *timer);
+void timer_interrupt(registers_t *r);
+
+static inline bool timer_pending(timer_t *timer) {
+	return timer->pending;
+}
+
+#endif
@@ -11,6 +11,8 @@
 #define FS_SYMLINK     0x06
 #define FS_MOUNTPOINT  0x08 // Is the file an active mountpoint?
 
+struct fs_node;
+
 // Define read/write/open/close callbacks
 typedef uint32_t (*read_type_t)(struct fs_node*,uint32_t,uint32_t,uint8_t*);
 typedef uint32_t (*write_type_t)(struct fs_node*,uint32_t,uint32_t,uint8_t*);
@@ -44,6 +46,9 @@ struct dirent {
 };
 
 extern fs_node_t *fs_root;  // The root of the filesystem.
+extern struct kmem_cache *fs_node_cache;
+
+void fs_init();
 
 // Standard read/write/open/close functions. Note that these are all suffixed with
 uint32_t fs_read(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer);
@@ -0,0 +1,32 @@
+#ifndef __DRIVER_PIT_H
+#define __DRIVER_PIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <core/port.h>
+
+// Input clock of the programmable interval timer
+#define PIT_HZ          1193182
+
+#define PIT_CH0         0x40
+#define PIT_CH2         0x42
+#define PIT_CMD         0x43
+
+// Port B of the keyboard controller gates channel 2 and exposes its output
+#define PIT_GATE        0x61
+#define PIT_GATE_CH2    (1<<0)
+#define PIT_GATE_SPKR   (1<<1)
+#define PIT_OUT_CH2     (1<<5)
+
+// Longest count a channel can be loaded with
+#define PIT_MAX_COUNT   0xFFFF
+
+void pit_oneshot(uint16_t count);
+void pit_stop();
+void pit_ch2_start(uint16_t count);
+bool pit_ch2_done();
+void pit_ch2_free_run();
+uint16_t pit_ch2_read();
+
+#endif
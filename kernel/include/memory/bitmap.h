@@ -33,4 +33,50 @@ inline void bitmap_clear(uint32_t *bitmap, uint32_t n) {
     bitmap[INDEX_TO_BIT(n)] &= ~(1 << OFFSET_TO_BIT(n));
 }
 
+/**
+ * Set a run of bits in a bitmap, a whole word at a time where possible
+ * @param  bitmap pointer to bitmap to act on
+ * @param  n      first bit to set
+ * @param  count  number of bits to set
+ * @return        number of bitmap words written
+ */
+static inline uint32_t bitmap_set_range(uint32_t *bitmap, uint32_t n, uint32_t count) {
+    uint32_t words = 0;
+
+    while (count) {
+        uint32_t offset = OFFSET_TO_BIT(n);
+        uint32_t bits = (32 - offset < count) ? 32 - offset : count;
+
+        bitmap[INDEX_TO_BIT(n)] |= (bits == 32) ? 0xFFFFFFFF : ((1u << bits) - 1) << offset;
+        n += bits;
+        count -= bits;
+        words++;
+    }
+
+    return words;
+}
+
+/**
+ * Clear a run of bits in a bitmap, a whole word at a time where possible
+ * @param  bitmap pointer to bitmap to act on
+ * @param  n      first bit to clear
+ * @param  count  number of bits to clear
+ * @return        number of bitmap words written
+ */
+static inline uint32_t bitmap_clear_range(uint32_t *bitmap, uint32_t n, uint32_t count) {
+    uint32_t words = 0;
+
+    while (count) {
+        uint32_t offset = OFFSET_TO_BIT(n);
+        uint32_t bits = (32 - offset < count) ? 32 - offset : count;
+
+        bitmap[INDEX_TO_BIT(n)] &= ~((bits == 32) ? 0xFFFFFFFF : ((1u << bits) - 1) << offset);
+        n += bits;
+        count -= bits;
+        words++;
+    }
+
+    return words;
+}
+
 #endif
\ No newline at end of file
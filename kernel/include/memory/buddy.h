@@ -0,0 +1,51 @@
+#ifndef __MEMORY_BUDDY_H
+#define __MEMORY_BUDDY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Largest block handed out is 2^BUDDY_MAX_ORDER frames (4MiB)
+#define BUDDY_MAX_ORDER 10
+#define BUDDY_ORDERS    (BUDDY_MAX_ORDER + 1)
+
+// Summary levels needed to cover 2^20 frames (4GiB) at order 0
+#define BUDDY_LEVELS    4
+
+// Frames below 16MiB are kept back for ISA DMA
+#define ZONE_DMA_LIMIT  0x1000000
+
+enum mem_zone_id {
+    ZONE_DMA,
+    ZONE_NORMAL,
+    MEM_ZONES
+};
+
+/**
+ * Hierarchical bitmap of free blocks for one order. Level 0 holds one bit per
+ * block, every level above holds one bit per non-empty word of the level
+ * below, so the first free block is found in BUDDY_LEVELS steps.
+ */
+typedef struct {
+    uint32_t *level[BUDDY_LEVELS];
+    uint32_t depth;
+    uint32_t blocks;
+} buddy_freemap_t;
+
+typedef struct {
+    const char *name;
+    uint32_t base;          // First frame of the zone, aligned to the max order
+    uint32_t frames;        // Frames spanned by the zone
+    uint32_t free_frames;
+    uint32_t free_blocks[BUDDY_ORDERS];
+    buddy_freemap_t free[BUDDY_ORDERS];
+} mem_zone_t;
+
+extern mem_zone_t mem_zones[MEM_ZONES];
+
+void buddy_init(uint32_t *bitmap, uint32_t frames);
+uint32_t buddy_allocate(enum mem_zone_id zone, uint32_t order);
+void buddy_free(uint32_t frame, uint32_t order);
+void buddy_reserve(uint32_t frame);
+void buddy_print_zones();
+
+#endif
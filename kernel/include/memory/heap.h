@@ -4,34 +4,59 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-#define MAX_HEAP_BLOCKS 1000
-
+// Two-level segregated fit: each power of two size class is split linearly
+// into HEAP_SL_COUNT second level lists
+#define HEAP_SL_BITS    4
+#define HEAP_SL_COUNT   (1 << HEAP_SL_BITS)
+#define HEAP_FL_SHIFT   (HEAP_SL_BITS + 3)
+#define HEAP_FL_COUNT   (32 - HEAP_FL_SHIFT + 1)
+#define HEAP_SMALL      (1 << HEAP_FL_SHIFT)
+
+#define HEAP_ALIGN      8
+#define HEAP_HEADER     8               // prev_phys and size
+#define HEAP_MIN_SIZE   8               // Room for the free list links
+#define HEAP_MIN_BLOCK  (HEAP_HEADER + HEAP_MIN_SIZE)
+
+// Smallest block of frames the heap grows by (64KiB)
+#define HEAP_GROW_ORDER 4
+
+// Flags kept in the low bits of heap_block_t.size
+#define HEAP_FREE       (1<<0)          // Block is free
+#define HEAP_PREV_FREE  (1<<1)          // Block physically before is free
+#define HEAP_FLAGS      (HEAP_FREE | HEAP_PREV_FREE)
+
+/**
+ * Boundary tag placed in front of every heap allocation. The free list links
+ * overlap the payload, so they only exist while the block is free.
+ */
 typedef struct heap_block {
-	void *addr;
-	uint32_t size;
-	bool free;
+	struct heap_block *prev_phys;	// Block immediately before this one
+	uint32_t size;					// Payload size and flags
 
-	// Blocks to the immediate left and right
-	struct heap_block *l;
-	struct heap_block *r;
+	struct heap_block *next_free;
+	struct heap_block *prev_free;
 } heap_block_t;
 
 typedef struct {
-	uint32_t size;
-	uint32_t limit;
-	heap_block_t *high;
-	heap_block_t *block[MAX_HEAP_BLOCKS];
-} heap_list_t;
+	uint32_t fl_bitmap;
+	uint32_t sl_bitmap[HEAP_FL_COUNT];
+	heap_block_t *free[HEAP_FL_COUNT][HEAP_SL_COUNT];
+
+	// Sentinel that terminates the growable heap area
+	heap_block_t *end;
+
+	// Usage statistics
+	uint32_t used_bytes;
+	uint32_t free_bytes;
+	uint32_t allocations;
+} heap_t;
 
-heap_list_t heap_list;
-heap_block_t block_pool[MAX_HEAP_BLOCKS];
+extern heap_t heap;
 
 void heap_init();
 heap_block_t *heap_add(void *addr, uint32_t size);
 void kfree(void *addr);
 void *kmalloc(uint32_t size);
 void *kvalloc(uint32_t size);
-void sbrk();
-void brk(void *addr);
 
-#endif
\ No newline at end of file
+#endif
@@ -13,6 +13,25 @@
 
 #define VIRTUAL_BASE 0xC0000000
 
+// Physical memory below this is mapped at VIRTUAL_BASE, anything above is unused
+#define DIRECT_MAP_SIZE 0x30000000
+
+// Kernel virtual memory mapped page by page, above the direct map
+#define KERNEL_MAP_BASE (VIRTUAL_BASE + DIRECT_MAP_SIZE)
+
+// Device registers are mapped uncached in the last part of the kernel map
+#define MMIO_BASE 0xFF800000
+#define MMIO_END  0xFFC00000
+
+// Convert between a physical address and its location in the direct map
+static inline void *phys_to_virt(uint32_t phys) {
+    return (void *)(phys + VIRTUAL_BASE);
+}
+
+static inline uint32_t virt_to_phys(void *virt) {
+    return (uint32_t)virt - VIRTUAL_BASE;
+}
+
 /**
  * Enum declaring memory state values
  */
@@ -27,6 +46,13 @@ enum mem_states_t {
  */
 extern uint32_t *mem_bitmap;
 
+/**
+ * Number of mappings sharing each frame, for copy-on-write
+ */
+extern uint8_t *mem_refcount;
+
+#define MEM_REFCOUNT_MAX 0xFF
+
 /**
  * Structure containing internal data for i386 memory functions
  */
@@ -51,10 +77,29 @@ struct i386_mem_info {
 
 extern struct i386_mem_info meminfo;
 
+/**
+ * Counters describing the cost of building the frame allocator at boot
+ */
+struct mem_init_stats {
+    uint32_t mmap_entries;      // Memory map entries walked
+    uint32_t ranges;            // Ranges applied to the bitmap
+    uint32_t words;             // Bitmap words written
+    uint64_t bitmap_cycles;     // TSC cycles spent in mem_init_bitmap()
+    uint64_t buddy_cycles;      // TSC cycles spent in buddy_init()
+};
+
+extern struct mem_init_stats mem_init_stats;
+
 void mem_init();
 void mem_init_bitmap();
 uint32_t mem_allocate_frame();
 void mem_free_frame(uint32_t frame);
+uint32_t mem_allocate_frames(uint32_t order);
+uint32_t mem_allocate_dma_frames(uint32_t order);
+void mem_free_frames(uint32_t frame, uint32_t order);
+void mem_reserve_frame(uint32_t frame);
+bool mem_ref_frame(uint32_t frame);
+uint8_t mem_frame_refs(uint32_t frame);
 
 void elf_sections_read();
 void mem_print_reserved();
@@ -5,18 +5,26 @@
 #include <stdbool.h>
 
 #include <core/interrupt.h>
+#include <core/smp.h>
+#include <core/spinlock.h>
 
 // Page Table Entry flags
 #define PT_PRESENT (1<<0)      // Is the page present?
 #define PT_RW (1<<1)           // Is the page read/write?
 #define PT_USER (1<<2)         // Is the page user-mode?
 #define PT_WRITETHROUGH (1<<3) // Is writethrough enabled for the page?
+#define PT_NOCACHE (1<<4)      // Is caching disabled for the page? (device memory)
+#define PT_GLOBAL (1<<8)       // Is the page kept in the TLB across CR3 reloads?
+#define PT_COW (1<<9)          // Is the page shared copy-on-write? (available to OS)
+#define PT_SHARED (1<<10)      // Does the page stay shared across fork()? (available to OS)
 
 // Page Directory Entry flags
 #define PD_PRESENT (1<<0)
 #define PD_RW (1<<1)
 #define PD_USER (1<<2)
 #define PD_WRITETHROUGH (1<<3)
+#define PD_LARGE (1<<7)        // Does the entry map a 4MiB page itself?
+#define PD_GLOBAL (1<<8)
 
 // Page Fault error flags
 #define PF_PRESENT (1<<0)      // Was the page present?
@@ -29,33 +37,65 @@ typedef struct {
 	uint32_t page_phys[1024];
 } page_table_t;
 
-typedef struct {
-	page_table_t *table[1024];
+typedef struct page_directory {
 	uint32_t table_phys[1024];
 	uint32_t phys;
+
+	uint32_t refs;				// Threads running in it
+	spinlock_t lock;			// Regions and faults, its threads may run on several CPUs
+	struct vm_region *regions;	// Ranges paged in on demand
 } page_directory_t;
 
-extern page_directory_t *current_pd;
+// Last directory entry maps the directory itself, so the page tables of the
+// current address space appear as one array of PTEs at the top of memory
+#define PD_RECURSIVE    1023
+
+// First directory entry of the kernel half
+#define PD_KERNEL       (VIRTUAL_BASE >> 22)
+#define PT_SELF         ((uint32_t *)0xFFC00000)
+#define PD_SELF         ((uint32_t *)0xFFFFF000)
+
+// Page tables are in the direct map, so any directory's tables can be reached
+#define pd_table(pd, i) ((page_table_t *)phys_to_virt((pd)->table_phys[i] & ~0xFFF))
+
+// Address space loaded on the current CPU
+#define current_pd (this_cpu()->pd)
+
+// Address space set up by paging_init(), with nothing in the user half
 extern page_directory_t *kernel_pd;
 
 extern void load_page_dir(uint32_t);
-extern void disable_pse();
 extern uint32_t get_faulting_address();
 
 extern void paging_init();
 extern void switch_pd(page_directory_t * pd);
 extern uint32_t map_page_to_phys(uint32_t virt, uint32_t phys, uint32_t flags);
 extern uint32_t map_page(uint32_t virt, uint32_t flags);
+extern void unmap_page(uint32_t virt);
+extern void *mmio_map(uint32_t phys, uint32_t size);
 extern uint32_t get_phys(void *virt);
-extern void move_stack(uint32_t stack, uint32_t limit);
+extern page_directory_t *create_pd();
+extern void free_pd(page_directory_t *pd);
+extern page_directory_t *pd_get(page_directory_t *pd);
+extern void pd_put(page_directory_t *pd);
 extern page_directory_t *clone_pd(page_directory_t* base);
-extern page_table_t *copy_pt(page_table_t *src);
+extern page_table_t *cow_pt(page_table_t *src);
 extern void page_fault_handler(registers_t *r);
 
 inline bool is_page_mapped(void *addr) {
     return (get_phys(addr) != -1);
 }
 
+// Directory entry covering `virt` in the current address space
+static inline uint32_t *pde_of(uint32_t virt) {
+    return &PD_SELF[virt >> 22];
+}
+
+// Table entry of `virt` in the current address space, its PDE must be present
+static inline uint32_t *pte_of(uint32_t virt) {
+    return &PT_SELF[virt >> 12];
+}
+
 static inline void invlpg(void* m) {
     /* Clobber memory to avoid optimizer re-ordering access before invlpg, which may cause nasty bugs. */
     asm volatile ("invlpg (%0)" : : "b"(m) : "memory");
@@ -0,0 +1,42 @@
+#ifndef __MEMORY_SLAB_H
+#define __MEMORY_SLAB_H
+
+#include <stdint.h>
+
+#include <core/spinlock.h>
+
+// Slabs hold at least this many objects
+#define SLAB_MIN_OBJECTS 4
+
+typedef void (*kmem_ctor_t)(void *obj);
+
+/**
+ * Cache of fixed size objects carved out of page aligned slabs. Free objects
+ * are linked through their first word.
+ */
+typedef struct kmem_cache {
+	const char *name;
+	uint32_t size;			// Object size requested by the user
+	uint32_t stride;		// Object size rounded up to the alignment
+	uint32_t slab_size;		// Bytes per slab
+	kmem_ctor_t ctor;		// Prepares each object as it is handed out
+
+	spinlock_t lock;		// Covers the free list and statistics
+	void *free;				// Free objects
+
+	// Usage statistics
+	uint32_t slabs;
+	uint32_t objects;
+	uint32_t in_use;
+	uint32_t allocs;
+	uint32_t frees;
+
+	struct kmem_cache *next;
+} kmem_cache_t;
+
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align, kmem_ctor_t ctor);
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+void kmem_cache_print_stats();
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef __MEMORY_VM_H
+#define __MEMORY_VM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <memory/paging.h>
+#include <driver/fs.h>
+
+struct shm;
+
+/**
+ * Range of an address space whose pages are only mapped once touched. Pages
+ * of a file backed region past file_size are zero-filled, which covers BSS.
+ */
+typedef struct vm_region {
+	uint32_t start;
+	uint32_t end;
+	uint32_t flags;			// Page table flags for pages of the region
+
+	fs_node_t *node;		// Backing file, or 0 for anonymous memory
+	uint32_t offset;		// File offset of the region start
+	uint32_t file_size;		// Bytes of the region backed by the file
+	struct shm *shm;		// Shared memory segment mapped, or 0
+
+	struct vm_region *next;
+} vm_region_t;
+
+// Frame of zeroes shared by every untouched page that has only been read
+extern uint32_t vm_zero_frame;
+
+void vm_init();
+vm_region_t *vm_map_anon(page_directory_t *pd, uint32_t start, uint32_t end, uint32_t flags);
+vm_region_t *vm_map_file(page_directory_t *pd, uint32_t start, uint32_t end, uint32_t flags,
+                         fs_node_t *node, uint32_t offset, uint32_t file_size);
+vm_region_t *vm_map_shared(page_directory_t *pd, uint32_t start, uint32_t phys, uint32_t pages,
+                           uint32_t flags, struct shm *shm);
+vm_region_t *vm_find(page_directory_t *pd, uint32_t addr);
+bool vm_unmap(page_directory_t *pd, uint32_t start);
+bool vm_unmap_shm(page_directory_t *pd, uint32_t start);
+void vm_unmap_all(page_directory_t *pd);
+void vm_clone(page_directory_t *dst, page_directory_t *src);
+bool vm_fault(uint32_t virt, uint32_t err);
+
+#endif
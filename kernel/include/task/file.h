@@ -0,0 +1,42 @@
+#ifndef __TASK_FILE_H
+#define __TASK_FILE_H
+
+#include <stdint.h>
+
+#include <core/spinlock.h>
+#include <driver/fs.h>
+
+// Open files per process, descriptors index the table
+#define FILES_MAX   16
+
+// Every process starts with the console open as this descriptor
+#define FD_CONSOLE  1
+
+// Longest path file_open() takes, as fs_node_t has it
+#define FILE_NAME_MAX   128
+
+// Reads and writes of anything but pipes go through a kernel buffer this big
+#define FILE_BOUNCE     256
+
+/**
+ * Descriptor table, shared by the threads that work on the same files
+ */
+typedef struct files {
+	uint32_t refs;
+	spinlock_t lock;
+	fs_node_t *node[FILES_MAX];
+} files_t;
+
+void file_init();
+files_t *files_create();
+files_t *files_clone(files_t *files);
+files_t *files_get(files_t *files);
+void files_put(files_t *files);
+
+int32_t file_open(const char *name);
+int32_t file_close(uint32_t fd);
+int32_t file_pipe(int32_t *fds);
+int32_t file_read(uint32_t fd, uint8_t *buf, uint32_t len, uint32_t offset);
+int32_t file_write(uint32_t fd, uint8_t *buf, uint32_t len, uint32_t offset);
+
+#endif
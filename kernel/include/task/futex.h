@@ -0,0 +1,35 @@
+#ifndef __TASK_FUTEX_H
+#define __TASK_FUTEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <core/spinlock.h>
+#include <task/thread.h>
+
+// Operations
+#define FUTEX_WAIT      0   // Sleep if the word still holds val
+#define FUTEX_WAKE      1   // Wake up to val waiters
+#define FUTEX_REQUEUE   2   // Wake val, move up to val2 others to uaddr2
+
+// Waiters are hashed by the physical address of their word
+#define FUTEX_HASH_BITS 6
+#define FUTEX_BUCKETS   (1 << FUTEX_HASH_BITS)
+
+/**
+ * Thread sleeping in FUTEX_WAIT, lives on its kernel stack
+ */
+typedef struct futex_waiter {
+	uint32_t key;				// Physical address of the word
+	thread_t *thread;
+	struct futex_waiter *next;
+} futex_waiter_t;
+
+typedef struct {
+	spinlock_t lock;
+	futex_waiter_t *head;
+} futex_bucket_t;
+
+int32_t futex(uint32_t *uaddr, uint32_t op, uint32_t val, uint32_t *uaddr2, uint32_t val2);
+
+#endif
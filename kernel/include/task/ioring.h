@@ -0,0 +1,116 @@
+#ifndef __TASK_IORING_H
+#define __TASK_IORING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <core/spinlock.h>
+#include <core/timer.h>
+#include <task/wait.h>
+
+// Where a process's ring is mapped, below the user stack. A process has one.
+#define IORING_BASE         (VIRTUAL_BASE - USER_STACK_LIM - IORING_MAX_SIZE)
+#define IORING_MAX_SIZE     0x4000
+#define IORING_MAX_ENTRIES  256
+
+// Setup flags
+#define IORING_SETUP_SQPOLL (1<<0)  // A kernel thread picks up submissions
+
+// Enter flags
+#define IORING_ENTER_SQ_WAKEUP (1<<0)   // Wake the polling thread
+
+// Shared flags, set by the kernel. User mode has to fence (e.g. a locked
+// instruction) between updating sq_tail and testing these.
+#define IORING_SQ_NEED_WAKEUP (1<<0)    // Polling thread went to sleep
+
+// Polling thread keeps spinning this long after the last submission (ns)
+#define IORING_POLL_IDLE    1000000
+
+// Operations
+#define IORING_OP_NOP       0
+#define IORING_OP_READ      1       // fs_read() of an open file
+#define IORING_OP_WRITE     2       // fs_write(), e.g. to FD_CONSOLE
+#define IORING_OP_TIMEOUT   3       // Completes once `off` ns have passed
+
+/**
+ * Submission queue entry, filled in by user mode
+ */
+typedef struct {
+	uint8_t opcode;
+	uint8_t flags;
+	uint16_t reserved;
+	uint32_t fd;
+	uint32_t addr;				// User buffer
+	uint32_t len;
+	uint64_t off;				// File offset, or timeout in ns
+	uint32_t user_data;			// Passed back in the completion
+	uint32_t reserved2;
+} ioring_sqe_t;
+
+/**
+ * Completion queue entry, filled in by the kernel
+ */
+typedef struct {
+	uint32_t user_data;
+	int32_t res;				// What the equivalent system call would return
+} ioring_cqe_t;
+
+/**
+ * Start of the ring's memory, shared by user mode and the kernel. Indices
+ * run freely and are masked to find an entry. Each side only writes the
+ * index it owns: user mode sq_tail and cq_head, the kernel the others.
+ */
+typedef struct {
+	volatile uint32_t sq_head;
+	volatile uint32_t sq_tail;
+	volatile uint32_t cq_head;
+	volatile uint32_t cq_tail;
+	uint32_t sq_entries;
+	uint32_t cq_entries;		// Twice sq_entries
+	uint32_t sqes;				// Offsets of the entry arrays from the start
+	uint32_t cqes;
+	volatile uint32_t flags;
+} ioring_shared_t;
+
+/**
+ * Kernel side of a ring. Its memory is physically contiguous and accessed
+ * through the direct map, so the polling thread reaches it too.
+ */
+typedef struct ioring {
+	uint32_t refs;				// Threads using it and pending timeouts, not the poller
+	volatile bool dying;		// Polling thread is to free it and exit
+
+	ioring_shared_t *shared;
+	ioring_sqe_t *sqes;
+	ioring_cqe_t *cqes;
+	uint32_t frame;				// First frame of the ring's memory
+	uint32_t pages;
+
+	// Sizes as set up, the copies in shared memory can't be trusted
+	uint32_t sq_entries;
+	uint32_t cq_entries;
+
+	spinlock_t sq_lock;			// Taking submissions
+	uint32_t sq_head;			// Next submission to take
+
+	spinlock_t lock;			// Posting completions
+	uint32_t inflight;			// Completions promised to submissions taken
+	wait_queue_t cq_wait;		// Threads waiting for completions
+
+	struct thread *poller;		// SQPOLL thread, or 0
+	wait_queue_t sq_wait;		// Where the polling thread sleeps
+} ioring_t;
+
+typedef struct {
+	timer_t timer;
+	ioring_t *ring;
+	uint32_t user_data;
+} ioring_timeout_t;
+
+void ioring_init();
+ioring_t *ioring_get(ioring_t *ring);
+void ioring_put(ioring_t *ring);
+int32_t ioring_setup(uint32_t entries, uint32_t flags);
+int32_t ioring_enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags);
+
+#endif
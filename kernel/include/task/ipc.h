@@ -0,0 +1,12 @@
+#ifndef __TASK_IPC_H
+#define __TASK_IPC_H
+
+#include <stdint.h>
+
+#include <task/thread.h>
+
+int32_t ipc_call(uint32_t dest, uint32_t *msg);
+int32_t ipc_reply_wait(uint32_t to, uint32_t *msg);
+void ipc_exit(thread_t *thread);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef __TASK_KSTACK_H
+#define __TASK_KSTACK_H
+
+#include <stdint.h>
+
+#include <memory/memory.h>
+
+// Kernel stacks live in fixed slots at the start of the kernel map region,
+// each stack has an unmapped guard page below it to catch overflows
+#define KSTACK_BASE     KERNEL_MAP_BASE
+#define KSTACK_SIZE     0x4000
+#define KSTACK_SLOT     (KSTACK_SIZE + PAGE_SIZE)
+#define KSTACK_SLOTS    1024
+
+uint32_t kstack_alloc();
+void kstack_free(uint32_t top);
+
+#endif
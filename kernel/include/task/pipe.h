@@ -0,0 +1,45 @@
+#ifndef __TASK_PIPE_H
+#define __TASK_PIPE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <core/spinlock.h>
+#include <driver/fs.h>
+#include <task/wait.h>
+
+// Pages a pipe buffers at most
+#define PIPE_SLOTS  16
+
+/**
+ * Page of data in a pipe. Frames the pipe allocated itself are filled by
+ * copying, ones taken from a writer are shared copy-on-write and never
+ * written to again.
+ */
+typedef struct {
+	uint32_t frame;
+	uint16_t start;				// First byte not read yet
+	uint16_t end;				// End of the data
+	bool owned;					// More data may be appended
+} pipe_slot_t;
+
+typedef struct pipe {
+	spinlock_t lock;
+	pipe_slot_t slots[PIPE_SLOTS];
+	uint32_t head;				// Next slot to read, indices run freely
+	uint32_t tail;				// Next slot to fill
+
+	uint32_t readers;			// Open ends, counted per descriptor
+	uint32_t writers;
+
+	wait_queue_t read_wait;		// Readers waiting for data
+	wait_queue_t write_wait;	// Writers waiting for a free slot
+
+	fs_node_t read_node;
+	fs_node_t write_node;
+} pipe_t;
+
+void pipe_init();
+int32_t pipe_create(fs_node_t **read, fs_node_t **write);
+
+#endif
@@ -2,19 +2,59 @@
 #define __TASK_SCHEDULER_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <core/spinlock.h>
+#include <core/timer.h>
 #include <task/thread.h>
 
+// Priority levels, threads on level 0 run first
+#define SCHED_LEVELS        16
+
+// Time a thread may run on a level before it's moved down one (ns)
+#define SCHED_SLICE         10000000ull
+#define SCHED_QUANTUM(l)    (SCHED_SLICE << ((l) / 4))
+
+// Every thread goes back to the top level this often (1s), so none starve
+#define SCHED_BOOST         1000000000ull
+
+// thread_t.cpu of threads that haven't been put on any CPU's run queue yet
+#define SCHED_ANY_CPU       0xFF
+
 typedef struct {
-	thread_t *thread[1000];
-	uint32_t current;
-	uint32_t total;
-} scheduler_queue_t;
+	thread_t *head;
+	thread_t *tail;
+} run_queue_t;
+
+/**
+ * Scheduling state of one CPU. The running thread is on none of its queues,
+ * the lock is only taken with interrupts off.
+ */
+typedef struct {
+	spinlock_t lock;
+	run_queue_t queue[SCHED_LEVELS];	// One FIFO per priority level
+	uint32_t bitmap;		// Bit `l` is set while queue[l] is not empty
+	uint32_t nr_queued;		// Threads waiting, others may steal them
+	thread_t *idle;			// Runs whenever nothing else can, never queued
+
+	timer_t quantum_timer;	// Ends the running thread's quantum, only armed while others wait
+	timer_t boost_timer;	// Periodic priority boost, only armed while threads wait
+	bool need_resched;		// Set by the quantum timer, acted on once the timer interrupt is done
 
-thread_t *thread_queue;
+	uint64_t idle_cycles;	// Time spent halted with nothing to run
+} sched_cpu_t;
 
 extern void multitask_init();
+extern void scheduler_start_cpu(uint32_t esp0);
+extern void scheduler_idle();
 extern void scheduler_add(thread_t *thread);
 extern void scheduler_remove(thread_t *thread);
-extern thread_t *scheduler_next();
+extern void preempt();
+extern void schedule();
+extern void scheduler_yield();
+extern void scheduler_block(uint8_t state);
+extern void scheduler_wake(thread_t *thread);
+extern void scheduler_handoff(thread_t *next);
+extern void scheduler_sleep(uint64_t ns);
+extern uint64_t scheduler_idle_cycles();
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,42 @@
+#ifndef __TASK_SHM_H
+#define __TASK_SHM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <memory/memory.h>
+#include <memory/paging.h>
+
+// Segments that exist at once, and their limits
+#define SHM_MAX         32
+#define SHM_NAME_MAX    32
+#define SHM_MAX_ORDER   10      // 4MiB
+
+// Where shm_map() puts segments if the caller doesn't say
+#define SHM_BASE        0x80000000
+#define SHM_LIMIT       0xB0000000
+
+/**
+ * Named memory that processes map to share it. Its frames are contiguous,
+ * each mapping holds a reference to them and the segment one more. The
+ * segment itself is held by every region mapping it and by the address
+ * space that created it, and goes away with the last of them.
+ */
+typedef struct shm {
+	char name[SHM_NAME_MAX];
+	uint32_t frame;				// First frame
+	uint32_t order;				// Frames allocated, as a power of 2
+	uint32_t pages;				// Frames mapped
+	uint32_t refs;				// Regions mapping it, and the creator
+	page_directory_t *creator;	// Until its mappings are torn down
+	bool used;
+} shm_t;
+
+int32_t shm_create(const char *name, uint32_t size);
+uint32_t shm_map(uint32_t id, uint32_t addr);
+int32_t shm_unmap(uint32_t addr);
+void shm_get(shm_t *shm);
+void shm_put(shm_t *shm);
+void shm_exit(page_directory_t *pd);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef __TASK_SYSCALL_H
+#define __TASK_SYSCALL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <core/interrupt.h>
+
+// System call numbers, passed in eax with arguments in ebx, ecx, edx, esi
+// and edi. User mode enters through int 0x80 or by calling VDSO_SYSCALL.
+#define SYS_PUTS            0
+#define SYS_FORK            1
+#define SYS_CLOCK_GETTIME   2
+#define SYS_NULL            3
+#define SYS_GETPID          4
+#define SYS_OPEN            5
+#define SYS_CLOSE           6
+#define SYS_READ            7
+#define SYS_WRITE           8
+#define SYS_IORING_SETUP    9
+#define SYS_IORING_ENTER    10
+#define SYS_THREAD_CREATE   11
+#define SYS_EXIT            12
+#define SYS_WAITPID         13
+#define SYS_FUTEX           14
+#define SYS_PIPE            15
+#define SYS_IPC_CALL        16
+#define SYS_IPC_REPLY_WAIT  17
+#define SYS_SHM_CREATE      18
+#define SYS_SHM_MAP         19
+#define SYS_SHM_UNMAP       20
+
+#define NUM_SYSCALLS        21
+
+// Handlers get their first three arguments in eax, edx and ecx, the rest on
+// the stack. Each declares the arguments it takes, up to five.
+#define SYSCALL __attribute__((regparm(3)))
+
+typedef uint32_t SYSCALL (*syscall_t)();
+
+// SYSENTER model specific registers
+#define MSR_SYSENTER_CS     0x174
+#define MSR_SYSENTER_ESP    0x175
+#define MSR_SYSENTER_EIP    0x176
+
+void syscall_init_cpu();
+void syscall_handler(registers_t *regs);
+
+// sysenter.asm
+extern void sysenter_entry();
+extern uint8_t sysenter_args[];
+extern uint8_t sysenter_args_end[];
+extern uint8_t sysenter_args_fault[];
+extern uint8_t vdso_start[];
+extern uint8_t vdso_end[];
+extern uint8_t vdso_int80[];
+extern uint8_t vdso_int80_end[];
+
+#endif
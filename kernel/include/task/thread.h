@@ -4,17 +4,26 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include <core/smp.h>
+#include <core/timer.h>
 #include <memory/multiboot.h>
 #include <memory/paging.h>
 #include <memory/heap.h>
-
-#define KSTACK      0xF03FF000
-#define KSTACK_LIM  0x4000
+#include <task/file.h>
 
 #define USER_CS     0x1B
 #define USER_DS     0x23
 #define USER_STACK  0xBFFFFFFC
+#define USER_STACK_LIM  0x100000
+
+// Thread states
+#define THREAD_RUNNABLE 0       // Running or on a run queue
+#define THREAD_BLOCKED  1       // On a wait queue
+#define THREAD_SLEEPING 2       // Waiting for its sleep timer
+#define THREAD_ZOMBIE   3       // Finished, never runs again
 
+// Words of a message passed in registers by ipc_call() and ipc_reply_wait()
+#define IPC_WORDS       3
 
 typedef struct thread {	
 	uint32_t ebp;
@@ -25,26 +34,70 @@ typedef struct thread {
 
 	uint32_t pid;
 	uint8_t ring;
-	uint32_t esp0;
+	uint32_t esp0;			// Top of the thread's own kernel stack
 	page_directory_t *pd;
 
-	struct thread *next;
+	uint8_t state;
+	uint8_t priority;		// Run queue level, 0 is the highest
+	uint64_t runtime;		// Time used of the current quantum (ns)
+	uint64_t slice_start;	// When it last got the CPU
+
+	struct thread *next;	// Neighbours on the run queue
+	struct thread *prev;
+
+	struct thread *wait_next;	// Next on a wait queue
+	timer_t sleep_timer;
+
+	uint8_t cpu;			// CPU whose run queue it belongs to
+	volatile bool on_cpu;	// Running, or its registers aren't saved yet
+
+	void *fpu;				// FPU/SSE save area, allocated on first use
+
+	files_t *files;			// Open files, by descriptor
+	struct ioring *ioring;	// Submission/completion ring, if set up, not kept by fork()
+
+	uint32_t ppid;			// Thread that waits for it, 0 if none does
+	int32_t exit_code;
+	bool reaped;			// Zombie whose resources are freed, waitpid() may take it
+	struct thread *all_next;	// Every thread, in no particular order
+
+	// Message passing, see ipc.c
+	uint32_t ipc_msg[IPC_WORDS];	// Message to send, or the one received
+	uint32_t ipc_from;		// Sender of the message received
+	int32_t ipc_status;		// Result of the call, set with its reply
+	bool ipc_receiving;		// Blocked waiting for a message
+	bool ipc_dead;			// Exited, takes no more messages
+	struct thread *ipc_senders;	// Callers queued until it receives
+	struct thread *ipc_clients;	// Callers received, waiting for a reply
+	struct thread *ipc_next;	// Next on one of those lists
 } thread_t;
 
 uint32_t pids;
-thread_t *current_thread;
+
+// Thread running on the current CPU
+#define current_thread (this_cpu()->current)
 
 
 // thread.c
 extern thread_t *thread_init();
-extern thread_t *constuct_thread(void *start);
+extern thread_t *thread_adopt(uint32_t esp0);
+extern thread_t *construct_thread(void *start, void *arg);
+extern thread_t *spawn(char *name);
 extern uint32_t fork();
-extern void preempt();
+extern uint32_t thread_create(uint32_t entry, uint32_t stack);
+extern void thread_exit(int32_t code) __attribute__((noreturn));
+extern int32_t waitpid(int32_t pid, int32_t *status);
+extern thread_t *thread_find(uint32_t pid);
+extern void thread_find_done();
+extern void reaper_init();
+extern void switch_thread(thread_t *next);
+extern void finish_switch();
 extern void exec(char *name);
 
 // context.asm
 extern uint32_t get_eip();
 extern void switch_context(thread_t *from, thread_t *to);
+extern void thread_bootstrap();
 extern void become_user(uint32_t ds, uint32_t esp, uint32_t cs, void *eip);
 
 // syscall.c
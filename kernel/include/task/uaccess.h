@@ -0,0 +1,30 @@
+#ifndef __TASK_UACCESS_H
+#define __TASK_UACCESS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <core/interrupt.h>
+#include <memory/memory.h>
+
+// A buffer handed in from user mode has to be in the user half
+static inline bool user_range(const void *buf, uint32_t len) {
+	return (uint32_t)buf < VIRTUAL_BASE && len <= VIRTUAL_BASE - (uint32_t)buf;
+}
+
+bool copy_from_user(void *dst, const void *src, uint32_t len);
+bool copy_to_user(void *dst, const void *src, uint32_t len);
+int32_t strncpy_from_user(char *dst, const char *src, uint32_t max);
+bool uaccess_fixup(registers_t *regs);
+
+// usercopy.asm, without checking that user memory is meant
+extern uint32_t copy_user(void *dst, const void *src, uint32_t len);
+extern bool touch_user(uint32_t *addr);
+extern uint8_t copy_user_start[];
+extern uint8_t copy_user_end[];
+extern uint8_t copy_user_fault[];
+extern uint8_t touch_user_start[];
+extern uint8_t touch_user_end[];
+extern uint8_t touch_user_fault[];
+
+#endif
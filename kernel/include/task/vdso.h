@@ -0,0 +1,57 @@
+#ifndef __TASK_VDSO_H
+#define __TASK_VDSO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <core/smp.h>
+#include <memory/memory.h>
+
+// Kernel provided user code and the data it reads, at the same address in
+// every address space. Their page table, just below the MMIO window, is the
+// only one of the kernel half that user mode can reach.
+#define VDSO_BASE           (MMIO_BASE - 0x400000)
+#define VDSO_DATA           (VDSO_BASE + PAGE_SIZE)
+
+// Functions user mode can call, see sysenter.asm
+#define VDSO_SYSCALL        (VDSO_BASE + 0x00)
+#define VDSO_GETPID         (VDSO_BASE + 0x10)
+#define VDSO_CLOCK_GETTIME  (VDSO_BASE + 0x18)
+#define VDSO_GETCPU         (VDSO_BASE + 0x20)
+
+/**
+ * Read-only to user mode, the kernel writes it through the direct map.
+ * Offsets are relied on by sysenter.asm.
+ */
+typedef struct {
+	// Monotonic clock as of the last ktime_get_ns(), readable while seq is even
+	volatile uint32_t seq;
+	uint32_t tsc;				// Time can be extrapolated with the TSC
+	uint64_t cycle_last;
+	uint64_t ns;
+	uint32_t frac;				// Fraction of a ns, scaled by 1 << shift
+	uint32_t mult;
+	uint32_t shift;
+
+	// Thread running on each CPU, seq changes whenever one is switched in
+	struct {
+		volatile uint32_t seq;
+		uint32_t pid;
+	} cpus[SMP_MAX_CPUS] __attribute__((aligned(64)));
+} vdso_data_t;
+
+extern vdso_data_t *vdso_data;
+
+void vdso_init(bool sysenter);
+void vdso_update_time(uint64_t cycle_last, uint64_t ns, uint64_t frac);
+
+// Publish the pid of the thread being switched in on a CPU
+static inline void vdso_switch(uint32_t cpu, uint32_t pid) {
+	if (!vdso_data)
+		return;
+
+	vdso_data->cpus[cpu].seq++;
+	vdso_data->cpus[cpu].pid = pid;
+}
+
+#endif
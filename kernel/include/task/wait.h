@@ -0,0 +1,30 @@
+#ifndef __TASK_WAIT_H
+#define __TASK_WAIT_H
+
+#include <stdint.h>
+
+#include <core/cpu.h>
+#include <core/spinlock.h>
+#include <task/thread.h>
+
+// Threads blocked until some event happens, woken in the order they arrived
+typedef struct {
+	spinlock_t lock;
+	thread_t *head;
+	thread_t *tail;
+} wait_queue_t;
+
+void sleep_on(wait_queue_t *wq);
+void wake_up(wait_queue_t *wq);
+
+// Block the current thread until `cond` holds. The queue is locked while it's
+// checked, so a wake_up() from an IRQ handler or another CPU can't slip in
+// unnoticed.
+#define wait_event(wq, cond) do {                   \
+	uint32_t __flags = spin_lock_irqsave(&(wq)->lock); \
+	while (!(cond))                                 \
+		sleep_on(wq);                               \
+	spin_unlock_irqrestore(&(wq)->lock, __flags);   \
+} while (0)
+
+#endif
@@ -0,0 +1,268 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <memory/bitmap.h>
+#include <memory/memory.h>
+#include <memory/buddy.h>
+
+mem_zone_t mem_zones[MEM_ZONES];
+
+// Frame usage bitmap, kept in step with the free maps
+static uint32_t *frame_bitmap;
+static uint32_t total_frames;
+
+
+static void freemap_init(buddy_freemap_t *map, uint32_t blocks) {
+    map->blocks = blocks;
+    map->depth = 0;
+
+    if (blocks == 0)
+        return;
+
+    // Keep adding summary levels until a single word covers everything
+    uint32_t bits = blocks;
+    do {
+        uint32_t words = (bits + 31) / 32;
+        map->level[map->depth] = (uint32_t *)kmalloc(words * sizeof(uint32_t));
+        memset(map->level[map->depth], 0, words * sizeof(uint32_t));
+        map->depth++;
+        bits = words;
+    } while (bits > 1 && map->depth < BUDDY_LEVELS);
+}
+
+static inline bool freemap_test(buddy_freemap_t *map, uint32_t i) {
+    return i < map->blocks && (map->level[0][i / 32] & (1 << (i % 32)));
+}
+
+static inline bool freemap_empty(buddy_freemap_t *map) {
+    return map->depth == 0 || map->level[map->depth - 1][0] == 0;
+}
+
+static void freemap_set(buddy_freemap_t *map, uint32_t i) {
+    for (uint32_t l = 0; l < map->depth; l++) {
+        uint32_t *word = &map->level[l][i / 32];
+        bool was_empty = (*word == 0);
+
+        *word |= 1 << (i % 32);
+
+        // Summary bit above is already set
+        if (!was_empty)
+            return;
+        i /= 32;
+    }
+}
+
+static void freemap_clear(buddy_freemap_t *map, uint32_t i) {
+    for (uint32_t l = 0; l < map->depth; l++) {
+        uint32_t *word = &map->level[l][i / 32];
+
+        *word &= ~(1 << (i % 32));
+
+        // Word still has free blocks, summary bit above stays set
+        if (*word != 0)
+            return;
+        i /= 32;
+    }
+}
+
+// Walk down from the top summary word to the lowest free block
+static uint32_t freemap_first(buddy_freemap_t *map) {
+    uint32_t i = 0;
+    for (int32_t l = map->depth - 1; l >= 0; l--)
+        i = i * 32 + __builtin_ctz(map->level[l][i]);
+
+    return i;
+}
+
+
+static inline mem_zone_t *zone_of(uint32_t frame) {
+    return &mem_zones[frame < ZONE_DMA_LIMIT / PAGE_SIZE ? ZONE_DMA : ZONE_NORMAL];
+}
+
+static void zone_init(mem_zone_t *zone, const char *name, uint32_t base, uint32_t frames) {
+    zone->name = name;
+    zone->base = base;
+    zone->frames = frames;
+    zone->free_frames = 0;
+
+    for (uint32_t order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        zone->free_blocks[order] = 0;
+        freemap_init(&zone->free[order], (frames + (1 << order) - 1) >> order);
+    }
+}
+
+// Return a block to its zone, merging with its buddy for as long as possible
+static void zone_free_block(mem_zone_t *zone, uint32_t frame, uint32_t order) {
+    uint32_t block = (frame - zone->base) >> order;
+
+    zone->free_frames += 1 << order;
+
+    while (order < BUDDY_MAX_ORDER) {
+        uint32_t buddy = block ^ 1;
+
+        if (!freemap_test(&zone->free[order], buddy))
+            break;
+
+        freemap_clear(&zone->free[order], buddy);
+        zone->free_blocks[order]--;
+
+        block >>= 1;
+        order++;
+    }
+
+    freemap_set(&zone->free[order], block);
+    zone->free_blocks[order]++;
+}
+
+// Hand a run of free frames to the zones as maximal naturally aligned blocks
+static void buddy_add_range(uint32_t start, uint32_t end) {
+    while (start < end) {
+        mem_zone_t *zone = zone_of(start);
+        uint32_t zone_end = zone->base + zone->frames;
+        uint32_t order = BUDDY_MAX_ORDER;
+
+        while (order > 0 && (((start - zone->base) & ((1 << order) - 1)) ||
+                             start + (1 << order) > end ||
+                             start + (1 << order) > zone_end))
+            order--;
+
+        zone_free_block(zone, start, order);
+        start += 1 << order;
+    }
+}
+
+/**
+ * Build the zone free maps from the frame bitmap
+ * @param bitmap frame bitmap with reserved frames already marked
+ * @param frames number of frames described by the bitmap
+ */
+void buddy_init(uint32_t *bitmap, uint32_t frames) {
+    uint32_t dma_frames = ZONE_DMA_LIMIT / PAGE_SIZE;
+
+    frame_bitmap = bitmap;
+    total_frames = frames;
+
+    zone_init(&mem_zones[ZONE_DMA], "DMA", 0, frames < dma_frames ? frames : dma_frames);
+    zone_init(&mem_zones[ZONE_NORMAL], "Normal", dma_frames, frames > dma_frames ? frames - dma_frames : 0);
+
+    uint32_t frame = 0;
+    while (frame < frames) {
+        // Skip fully reserved words
+        if (frame % 32 == 0 && bitmap[frame / 32] == 0xFFFFFFFF) {
+            frame += 32;
+            continue;
+        }
+
+        if (bitmap_get(bitmap, frame)) {
+            frame++;
+            continue;
+        }
+
+        uint32_t end = frame;
+        while (end < frames && !bitmap_get(bitmap, end))
+            end++;
+
+        buddy_add_range(frame, end);
+        frame = end;
+    }
+}
+
+/**
+ * Allocate 2^order contiguous frames from a zone
+ * @param  id    zone to allocate from
+ * @param  order log2 of the number of frames
+ * @return       first frame of the block, or 0 if the zone is exhausted
+ */
+uint32_t buddy_allocate(enum mem_zone_id id, uint32_t order) {
+    mem_zone_t *zone = &mem_zones[id];
+    uint32_t o = order;
+
+    while (o <= BUDDY_MAX_ORDER && freemap_empty(&zone->free[o]))
+        o++;
+
+    if (o > BUDDY_MAX_ORDER)
+        return 0;
+
+    uint32_t block = freemap_first(&zone->free[o]);
+    freemap_clear(&zone->free[o], block);
+    zone->free_blocks[o]--;
+
+    // Split down to the requested order, keeping the lower half each time
+    while (o > order) {
+        o--;
+        block <<= 1;
+        freemap_set(&zone->free[o], block + 1);
+        zone->free_blocks[o]++;
+    }
+
+    zone->free_frames -= 1 << order;
+
+    uint32_t frame = zone->base + (block << order);
+    bitmap_set_range(frame_bitmap, frame, 1 << order);
+
+    return frame;
+}
+
+/**
+ * Free a block previously returned by buddy_allocate
+ * @param frame first frame of the block
+ * @param order order the block was allocated with
+ */
+void buddy_free(uint32_t frame, uint32_t order) {
+    // Ignore frames we don't manage or that are already free
+    if (frame == 0 || frame + (1 << order) > total_frames || !bitmap_get(frame_bitmap, frame))
+        return;
+
+    bitmap_clear_range(frame_bitmap, frame, 1 << order);
+
+    zone_free_block(zone_of(frame), frame, order);
+}
+
+/**
+ * Take a single free frame out of the allocator, splitting whichever free
+ * block currently contains it
+ * @param frame frame to reserve
+ */
+void buddy_reserve(uint32_t frame) {
+    if (frame >= total_frames || bitmap_get(frame_bitmap, frame))
+        return;
+
+    mem_zone_t *zone = zone_of(frame);
+    uint32_t rel = frame - zone->base;
+    uint32_t order = 0;
+
+    while (order <= BUDDY_MAX_ORDER && !freemap_test(&zone->free[order], rel >> order))
+        order++;
+
+    if (order > BUDDY_MAX_ORDER)
+        return;
+
+    freemap_clear(&zone->free[order], rel >> order);
+    zone->free_blocks[order]--;
+
+    // Free the half that doesn't contain the frame at every level down
+    while (order > 0) {
+        order--;
+        freemap_set(&zone->free[order], (rel >> order) ^ 1);
+        zone->free_blocks[order]++;
+    }
+
+    zone->free_frames--;
+    bitmap_set(frame_bitmap, frame);
+}
+
+/**
+ * Debug function to print out free memory per zone
+ */
+void buddy_print_zones() {
+    for (uint32_t i = 0; i < MEM_ZONES; i++) {
+        mem_zone_t *zone = &mem_zones[i];
+
+        printf("[mem] zone %s: %u/%u frames free, blocks:", zone->name, zone->free_frames, zone->frames);
+        for (uint32_t order = 0; order <= BUDDY_MAX_ORDER; order++)
+            printf(" %u", zone->free_blocks[order]);
+        printf("\n");
+    }
+}
@@ -1,200 +1,344 @@
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 
+#include <core/spinlock.h>
 #include <memory/memory.h>
 #include <memory/paging.h>
 #include <memory/heap.h>
 
+heap_t heap;
 
-void heap_init() {
-    heap_list.limit = MAX_HEAP_BLOCKS;
-    heap_list.size = 0;
+// Taken by kmalloc(), kvalloc() and kfree(), which may run on any CPU
+static spinlock_t heap_lock = SPINLOCK_INIT;
+
+
+static inline uint32_t block_size(heap_block_t *block) {
+    return block->size & ~HEAP_FLAGS;
 }
 
-// Insert heap block in sorted list
-static void heap_list_add(heap_block_t *block) {
-    uint32_t i = 0;
-    while (i < heap_list.size) {
-        if (heap_list.block[i]->size >= block->size)
-            break;
-        i++;
-    }
+static inline void *block_payload(heap_block_t *block) {
+    return (void *)((uint32_t)block + HEAP_HEADER);
+}
 
-    heap_block_t *tmp, *tmp2;
+static inline heap_block_t *block_from_payload(void *addr) {
+    return (heap_block_t *)((uint32_t)addr - HEAP_HEADER);
+}
 
-    tmp = heap_list.block[i];
-    heap_list.block[i] = block;
+static inline heap_block_t *block_next(heap_block_t *block) {
+    return (heap_block_t *)((uint32_t)block_payload(block) + block_size(block));
+}
 
-    while (i < heap_list.size) {
-        i++;
-        tmp2 = heap_list.block[i];
-        heap_list.block[i] = tmp;
-        tmp = tmp2;
+// Find the free list a block of this size belongs in
+static inline void mapping_insert(uint32_t size, uint32_t *fl, uint32_t *sl) {
+    if (size < HEAP_SMALL) {
+        *fl = 0;
+        *sl = size / (HEAP_SMALL / HEAP_SL_COUNT);
+    } else {
+        uint32_t msb = 31 - __builtin_clz(size);
+        *fl = msb - (HEAP_FL_SHIFT - 1);
+        *sl = (size >> (msb - HEAP_SL_BITS)) ^ HEAP_SL_COUNT;
     }
+}
 
-    heap_list.size++;
+// Find the first list whose blocks are all large enough for this size
+static inline void mapping_search(uint32_t size, uint32_t *fl, uint32_t *sl) {
+    if (size >= HEAP_SMALL)
+        size += (1 << (31 - __builtin_clz(size) - HEAP_SL_BITS)) - 1;
+
+    mapping_insert(size, fl, sl);
 }
 
-static void heap_list_remove(heap_block_t *block) {
-    block->size = 0;
-    heap_list.size--;
+static void free_list_insert(heap_block_t *block) {
+    uint32_t fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+
+    block->prev_free = 0;
+    block->next_free = heap.free[fl][sl];
+    if (block->next_free)
+        block->next_free->prev_free = block;
+
+    heap.free[fl][sl] = block;
+    heap.fl_bitmap |= 1 << fl;
+    heap.sl_bitmap[fl] |= 1 << sl;
+
+    heap.free_bytes += block_size(block);
+}
 
-    uint32_t i = 0;
-    while (heap_list.block[i] != block)
-        i++;
+static void free_list_remove(heap_block_t *block) {
+    uint32_t fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
 
-    while (i < heap_list.size) {
-        heap_list.block[i] = heap_list.block[i+1];
-        i++;
+    if (block->prev_free)
+        block->prev_free->next_free = block->next_free;
+    else
+        heap.free[fl][sl] = block->next_free;
+
+    if (block->next_free)
+        block->next_free->prev_free = block->prev_free;
+
+    if (!heap.free[fl][sl]) {
+        heap.sl_bitmap[fl] &= ~(1 << sl);
+        if (!heap.sl_bitmap[fl])
+            heap.fl_bitmap &= ~(1 << fl);
     }
+
+    heap.free_bytes -= block_size(block);
 }
 
-heap_block_t *heap_add(void *addr, uint32_t size) {
-    uint32_t i = 0;
-    while (block_pool[i].size != 0)
-        i++;
+// Take a free block of at least `size` bytes off its free list
+static heap_block_t *free_list_find(uint32_t size) {
+    uint32_t fl, sl;
+    mapping_search(size, &fl, &sl);
 
-    heap_block_t *new_block = &block_pool[i];
+    if (fl >= HEAP_FL_COUNT)
+        return 0;
 
-    new_block->addr = addr;
-    new_block->size = size;
-    new_block->free = true;
+    uint32_t sl_map = heap.sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+        // Nothing in this size class, move up to the next non-empty one
+        uint32_t fl_map = heap.fl_bitmap & (~0u << (fl + 1));
+        if (!fl_map)
+            return 0;
 
-    heap_list_add(new_block);
+        fl = __builtin_ctz(fl_map);
+        sl_map = heap.sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
 
-    return new_block;
+    heap_block_t *block = heap.free[fl][sl];
+    free_list_remove(block);
+    return block;
 }
 
-void kfree(void *addr) {
-    heap_block_t *block;
-    int i = 0;
+// Flag a block as free and let its neighbour know
+static inline void block_mark_free(heap_block_t *block) {
+    heap_block_t *next = block_next(block);
 
-    while (block = heap_list.block[i++])
-        if (block->addr == addr)
-            break;
+    block->size |= HEAP_FREE;
+    next->prev_phys = block;
+    next->size |= HEAP_PREV_FREE;
+}
 
-    // Prepare to create new block
-    void *new_addr = block->addr;
-    uint32_t new_size = block->size;
-    bool do_new_block = false;
+static inline void block_mark_used(heap_block_t *block) {
+    block->size &= ~HEAP_FREE;
+    block_next(block)->size &= ~HEAP_PREV_FREE;
+}
 
-    // Check if block to block->l is free
-    if (block->l->free) {
-        new_addr = block->l->addr;
-        new_size += block->l->size;
-        do_new_block = true;
+// Absorb the free block physically after `block`
+static inline void block_absorb_next(heap_block_t *block) {
+    heap_block_t *next = block_next(block);
 
-        heap_list_remove(block->l);
+    free_list_remove(next);
+    block->size += block_size(next) + HEAP_HEADER;
+    block_next(block)->prev_phys = block;
+}
+
+// Merge a block with whichever of its neighbours are free
+static heap_block_t *block_coalesce(heap_block_t *block) {
+    if (block_next(block)->size & HEAP_FREE)
+        block_absorb_next(block);
+
+    if (block->size & HEAP_PREV_FREE) {
+        heap_block_t *prev = block->prev_phys;
+        free_list_remove(prev);
+        prev->size += block_size(block) + HEAP_HEADER;
+        block_next(prev)->prev_phys = prev;
+        block = prev;
     }
 
-    // Check if block to block->r is free
-    if (block->r->free) {
-        new_size += block->r->size;
-        do_new_block = true;
+    return block;
+}
+
+// Cut `size` bytes from the front of a used block, returning the rest to the heap
+static void block_trim(heap_block_t *block, uint32_t size) {
+    if (block_size(block) < size + HEAP_MIN_BLOCK)
+        return;
+
+    heap_block_t *rest = (heap_block_t *)((uint32_t)block_payload(block) + size);
+    rest->size = block_size(block) - size - HEAP_HEADER;
+    rest->prev_phys = block;
+    block->size = size | (block->size & HEAP_FLAGS);
+
+    block_mark_free(rest);
+    free_list_insert(block_coalesce(rest));
+}
+
+// Extend the initial heap area so that it ends in a free block of at least `size` bytes
+static heap_block_t *heap_grow_area(uint32_t size) {
+    // The old end sentinel becomes the header of the new block
+    heap_block_t *block = heap.end;
+    block->size = size | (block->size & HEAP_PREV_FREE);
+
+    meminfo.kernel_heap_end += size + HEAP_HEADER;
+
+    heap.end = block_next(block);
+    heap.end->size = 0;
+    heap.end->prev_phys = block;
+
+    // Merge with a free block left at the old end of the heap
+    block_mark_free(block);
+    return block_coalesce(block);
+}
+
+// Add a free block of at least `size` bytes to the heap
+static heap_block_t *heap_grow(uint32_t size) {
+    // Room left in the initial heap area
+    if (meminfo.kernel_heap_end + size + HEAP_HEADER <= meminfo.kernel_heap_brk)
+        return heap_grow_area(size);
 
-        heap_list_remove(block->r);
+    // Frames are only reachable through the direct map once paging is set up
+    if (!current_pd) {
+        printf("Kernel heap exhausted before paging_init()\n");
+        abort();
     }
 
-    if (do_new_block) {
-        heap_list_remove(block);
-        // Create new, bigger block
-        heap_add(new_addr, new_size);
-    } else {
-        block->free = true;
+    // Take a block of frames, it's already mapped so nothing needs to be paged in
+    uint32_t order = HEAP_GROW_ORDER;
+    uint32_t bytes = PAGE_SIZE << order;
+    while (bytes < size + 2 * HEAP_HEADER) {
+        bytes <<= 1;
+        order++;
     }
+
+    uint32_t frame = mem_allocate_frames(order);
+    if (!frame)
+        return 0;
+
+    heap_block_t *block = heap_add(phys_to_virt(frame * PAGE_SIZE), bytes);
+    free_list_remove(block);
+    return block;
 }
 
-void *kmalloc(uint32_t size) {
-    heap_block_t *block;
-
-    for (uint32_t i=0; i<heap_list.size; i++) {
-        block = heap_list.block[i];
-        if (block->size >= size && block->free == true) {
-
-            block->free = false;        // Reserve block
-            if (block->size > size) {   // Split block if neccesary
-                heap_block_t *split = heap_add((void *)((uint32_t)block->addr + size), block->size - size);
-
-                // Modify neighbor pointers
-                split->l = block;
-                split->r = block->r;
-                block->r = split;
-                                
-                // Reorder block in list as size has changed
-                heap_list_remove(block);
-                block->size = size;
-                heap_list_add(block);
-            }
-            return block->addr;
-        }
-    }
+static inline uint32_t heap_adjust(uint32_t size) {
+    if (size < HEAP_MIN_SIZE)
+        return HEAP_MIN_SIZE;
 
-    // No block found, create new block
-    block = heap_add((void *)meminfo.kernel_heap_end, size);
-    block->free = false;
+    return (size + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+}
 
-    block->l = heap_list.high;
-    heap_list.high->r = block;
-    heap_list.high = block;
+void heap_init() {
+    // Empty heap area terminated by a used, zero sized sentinel
+    heap.end = (heap_block_t *)meminfo.kernel_heap_start;
+    heap.end->prev_phys = 0;
+    heap.end->size = 0;
 
+    meminfo.kernel_heap_end = meminfo.kernel_heap_start + HEAP_HEADER;
+}
 
-    // Expand kernel heap as needed
-    while (meminfo.kernel_heap_end + size > meminfo.kernel_heap_brk)
-        sbrk();
+// Donate an unused memory region to the heap
+heap_block_t *heap_add(void *addr, uint32_t size) {
+    uint32_t start = ((uint32_t)addr + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+    uint32_t end = ((uint32_t)addr + size) & ~(HEAP_ALIGN - 1);
 
-    // Increase the heap pointer
-    meminfo.kernel_heap_end += size;
+    if (end < start + HEAP_MIN_BLOCK + HEAP_HEADER)
+        return 0;
 
-    return block->addr;
+    // Region holds one free block and a sentinel that closes it off
+    heap_block_t *block = (heap_block_t *)start;
+    block->prev_phys = 0;
+    block->size = end - start - 2 * HEAP_HEADER;
+
+    heap_block_t *sentinel = block_next(block);
+    sentinel->size = 0;
+
+    block_mark_free(block);
+    free_list_insert(block);
+
+    return block;
 }
 
-void *kvalloc(uint32_t size) {
-    uint32_t addr = meminfo.kernel_heap_end;
+static void heap_free(void *addr) {
+
+    heap_block_t *block = block_from_payload(addr);
+
+    heap.used_bytes -= block_size(block);
+    heap.allocations--;
+
+    block_mark_free(block);
+    free_list_insert(block_coalesce(block));
+}
 
-    // Page align start address
-    if (addr % PAGE_SIZE != 0) {
-        addr &= 0x100000000 - PAGE_SIZE;
-        addr += PAGE_SIZE;
+static void *heap_alloc(uint32_t size) {
+    size = heap_adjust(size);
 
-        // Add gap created from alignment to heap blocks
-        heap_block_t *gap = heap_add((void *)meminfo.kernel_heap_end, addr - meminfo.kernel_heap_end);
+    heap_block_t *block = free_list_find(size);
 
-        gap->l = heap_list.high;
-        heap_list.high->r = gap;
-        heap_list.high = gap;
+    // No block found, grow the heap
+    if (!block)
+        block = heap_grow(size);
+    if (!block)
+        return 0;
+
+    block_mark_used(block);
+    block_trim(block, size);
+
+    heap.used_bytes += block_size(block);
+    heap.allocations++;
+
+    return block_payload(block);
+}
+
+static void *heap_valloc(uint32_t size) {
+    size = heap_adjust(size);
+
+    // Worst case gap needed in front of the page aligned payload
+    uint32_t padded = size + PAGE_SIZE + HEAP_MIN_BLOCK;
+
+    heap_block_t *block = free_list_find(padded);
+    if (!block)
+        block = heap_grow(padded);
+    if (!block)
+        return 0;
+
+    uint32_t payload = (uint32_t)block_payload(block);
+    uint32_t aligned = (payload + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    if (aligned != payload) {
+        // The gap in front must be able to stand on its own as a free block
+        if (aligned - payload < HEAP_MIN_BLOCK)
+            aligned += PAGE_SIZE;
+
+        heap_block_t *gap = block;
+        block = block_from_payload((void *)aligned);
+        block->size = block_size(gap) - (aligned - payload);
+        block->prev_phys = gap;
+        gap->size = (aligned - payload - HEAP_HEADER) | (gap->size & HEAP_PREV_FREE);
+
+        // Gap is free, so the aligned block is marked as following a free block
+        block_mark_free(gap);
+        free_list_insert(block_coalesce(gap));
     }
 
-    // Allocate block in heap
-    heap_block_t *new_block = heap_add((void *)addr, size);
-    new_block->free = false;
+    block_mark_used(block);
+    block_trim(block, size);
 
-    new_block->l = heap_list.high;
-    heap_list.high->r = new_block;
-    heap_list.high = new_block;
+    heap.used_bytes += block_size(block);
+    heap.allocations++;
 
-    // Increase the heap pointer
-    meminfo.kernel_heap_end = addr + size;
+    return (void *)aligned;
+}
 
-    // Expand kernel heap as needed
-    while (meminfo.kernel_heap_end > meminfo.kernel_heap_brk)
-        sbrk();
+void kfree(void *addr) {
+    if (!addr)
+        return;
 
-    return (void *)addr;
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    heap_free(addr);
+    spin_unlock_irqrestore(&heap_lock, flags);
 }
 
-// Increase kernel heap size by one page increments
-void sbrk() {
-    map_page(meminfo.kernel_heap_brk, PT_RW);
-    meminfo.kernel_heap_brk += 0x1000;
+void *kmalloc(uint32_t size) {
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    void *addr = heap_alloc(size);
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return addr;
 }
 
-// Increase kernel heap to specified address
-void brk(void *addr) {
-    uint32_t i = meminfo.kernel_heap_brk;
-    while (i < (uint32_t)addr) {
-        if (!is_page_mapped((void *)i)) {
-            map_page(i, PT_RW);
-            i += 0x1000;
-        }
-    }
-    meminfo.kernel_heap_brk = (uint32_t)addr;
-}
\ No newline at end of file
+// Page aligned allocation
+void *kvalloc(uint32_t size) {
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    void *addr = heap_valloc(size);
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return addr;
+}
@@ -5,8 +5,13 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+#include <core/cpu.h>
+#include <core/smp.h>
+#include <core/spinlock.h>
 #include <memory/bitmap.h>
 #include <memory/memory.h>
+#include <memory/buddy.h>
+#include <memory/slab.h>
 
 // Multiboot data
 multiboot_info_t *mbi;
@@ -15,8 +20,17 @@ uint32_t mboot_magic;
 // Bitmap containing reserved frames
 uint32_t *mem_bitmap;
 
+// Reference count of every frame
+uint8_t *mem_refcount;
+
+// Covers the buddy allocator and the reference counts, any CPU may allocate
+static spinlock_t mem_lock = SPINLOCK_INIT;
+
 // Information about memory for kernel use
 struct i386_mem_info meminfo;
+
+// Boot-time cost of building the frame allocator
+struct mem_init_stats mem_init_stats;
 uint32_t stack;
 
 void _load_mbi(uint32_t _mboot_magic, multiboot_info_t *_mbi) {
@@ -46,7 +60,7 @@ void mem_init(uint32_t _mboot_magic, multiboot_info_t *_mbi) {
     meminfo.mmap = (multiboot_memory_map_t *) (mbi->mmap_addr + VIRTUAL_BASE);
     meminfo.elf_sec = &(mbi->u.elf_sec);
     meminfo.multiboot_reserved_start = (uint32_t)mbi;
-    meminfo.multiboot_reserved_end = (uint32_t)(mbi + sizeof(multiboot_info_t));
+    meminfo.multiboot_reserved_end = (uint32_t)mbi + sizeof(multiboot_info_t);
     meminfo.mem_upper = mbi->mem_upper;
     meminfo.mem_lower = mbi->mem_lower;
 
@@ -60,14 +74,16 @@ void mem_init(uint32_t _mboot_magic, multiboot_info_t *_mbi) {
     // Parse ELF sections
     elf_sections_read();
 
-    // Find the highest free address
+    // Find the highest free address, only memory in the direct map is used
     meminfo.highest_free_address = meminfo.mem_upper * 1024;
+    if (meminfo.highest_free_address > DIRECT_MAP_SIZE)
+        meminfo.highest_free_address = DIRECT_MAP_SIZE;
 
     // Start the kernel heap on the first page-aligned address after the kernel
     meminfo.kernel_heap_start = (meminfo.initrd_end + 0x1000) & 0xFFFFF000;
     meminfo.kernel_heap_end = meminfo.kernel_heap_start;
 
-    //Initialize brk to 4MiB past virtual base address
+    // Until paging_init() the heap can only use the 4MiB mapped at boot
     meminfo.kernel_heap_brk = VIRTUAL_BASE + 0x400000;
 
     // Initialize heap allocator
@@ -78,60 +94,227 @@ void mem_init(uint32_t _mboot_magic, multiboot_info_t *_mbi) {
     if (meminfo.highest_free_address % (0x1000 * 32) != 0)
         bitmap_size++;
 
-    // Allocate bitmap
+    // Allocate bitmap, everything starts out reserved
     mem_bitmap = (uint32_t *)kvalloc(bitmap_size * sizeof(uint32_t));
-    memset((void *)mem_bitmap, 0, meminfo.highest_free_address/PAGE_SIZE);
+    memset((void *)mem_bitmap, 0xFF, bitmap_size * sizeof(uint32_t));
+
+    // One reference count per frame, frames start out unshared
+    mem_refcount = (uint8_t *)kmalloc(meminfo.highest_free_address / PAGE_SIZE);
+    memset((void *)mem_refcount, 0, meminfo.highest_free_address / PAGE_SIZE);
+
+    uint64_t tsc = rdtsc();
     mem_init_bitmap();
+    mem_init_stats.bitmap_cycles = rdtsc() - tsc;
+
+    // Build buddy free lists from the frames left free in the bitmap
+    tsc = rdtsc();
+    buddy_init(mem_bitmap, meminfo.highest_free_address / PAGE_SIZE);
+    mem_init_stats.buddy_cycles = rdtsc() - tsc;
 }
 
 /**
- * Initialize the bitmap containing reserved frames
+ * Mark the frames of a physical address range in the bitmap. Free ranges are
+ * rounded inwards and reserved ranges outwards, so a frame is only free if it
+ * lies entirely within available memory.
+ * @param start    first byte of the range
+ * @param end      first byte past the range
+ * @param reserved whether to reserve or free the frames
+ */
+static void mem_mark_range(uint64_t start, uint64_t end, bool reserved) {
+    uint64_t frames = meminfo.highest_free_address / PAGE_SIZE;
+    uint64_t first, last;
+
+    if (reserved) {
+        first = start / PAGE_SIZE;
+        last = (end + PAGE_SIZE - 1) / PAGE_SIZE;
+    } else {
+        first = (start + PAGE_SIZE - 1) / PAGE_SIZE;
+        last = end / PAGE_SIZE;
+    }
+
+    if (last > frames)
+        last = frames;
+    if (first >= last)
+        return;
+
+    mem_init_stats.ranges++;
+    if (reserved)
+        mem_init_stats.words += bitmap_set_range(mem_bitmap, first, last - first);
+    else
+        mem_init_stats.words += bitmap_clear_range(mem_bitmap, first, last - first);
+}
+
+/**
+ * Initialize the bitmap containing reserved frames from the memory map and
+ * the regions in use by the kernel, multiboot structures and initrd
  */
 void mem_init_bitmap() {
-    uint32_t i;
-
-    // Iterate through memory and mark reserved frames in bitmap
-    for (i = 0x0000; i + PAGE_SIZE < meminfo.highest_free_address; i += PAGE_SIZE) {
-        // Check if the current address is reserved
-        if (mem_check_reserved(i) == MEM_RESERVED) {
-            // Mark frame as reserved in the bitmap
-            bitmap_set(mem_bitmap, i / PAGE_SIZE);
-        }
+    uintptr_t cur_mmap_addr = (uintptr_t)meminfo.mmap;
+    uintptr_t mmap_end_addr = cur_mmap_addr + meminfo.mmap_length;
+
+    // Free whatever the memory map reports as available
+    while (cur_mmap_addr < mmap_end_addr) {
+        multiboot_memory_map_t *entry = (multiboot_memory_map_t *)cur_mmap_addr;
+
+        if (entry->type == MULTIBOOT_MEMORY_AVAILABLE)
+            mem_mark_range(entry->addr, entry->addr + entry->len, false);
+
+        mem_init_stats.mmap_entries++;
+        cur_mmap_addr += entry->size + sizeof(uintptr_t);
+    }
+
+    // Entries may overlap, anything not available wins
+    cur_mmap_addr = (uintptr_t)meminfo.mmap;
+    while (cur_mmap_addr < mmap_end_addr) {
+        multiboot_memory_map_t *entry = (multiboot_memory_map_t *)cur_mmap_addr;
+
+        if (entry->type != MULTIBOOT_MEMORY_AVAILABLE)
+            mem_mark_range(entry->addr, entry->addr + entry->len, true);
+
+        cur_mmap_addr += entry->size + sizeof(uintptr_t);
+    }
+
+    // Below 0x1000 is always reserved
+    mem_mark_range(0, PAGE_SIZE, true);
+
+    // Where smp_init() puts the application processors' startup code
+    mem_mark_range(TRAMPOLINE_BASE, TRAMPOLINE_BASE + PAGE_SIZE, true);
+
+    // Kernel binary
+    mem_mark_range(meminfo.kernel_reserved_start - VIRTUAL_BASE,
+                   meminfo.kernel_reserved_end - VIRTUAL_BASE, true);
+
+    // Multiboot information structure, memory map and module list
+    mem_mark_range(meminfo.multiboot_reserved_start - VIRTUAL_BASE,
+                   meminfo.multiboot_reserved_end - VIRTUAL_BASE, true);
+    mem_mark_range(meminfo.mbi->mmap_addr, meminfo.mbi->mmap_addr + meminfo.mmap_length, true);
+
+    if (meminfo.mbi->flags & (1<<3)) {
+        mem_mark_range(meminfo.mbi->mods_addr,
+                       meminfo.mbi->mods_addr + meminfo.mbi->mods_count * sizeof(multiboot_module_t), true);
+
+        // Initial ramdisk
+        mem_mark_range(meminfo.initrd_start - VIRTUAL_BASE, meminfo.initrd_end - VIRTUAL_BASE, true);
     }
 }
 
+/**
+ * Allocates 2^order contiguous frames, preferring memory outside the DMA zone
+ * @param  order log2 of the number of frames
+ * @return       index of first allocated frame, or 0 if out of memory
+ */
+uint32_t mem_allocate_frames(uint32_t order) {
+    uint32_t flags = spin_lock_irqsave(&mem_lock);
+    uint32_t frame = buddy_allocate(ZONE_NORMAL, order);
+
+    if (!frame)
+        frame = buddy_allocate(ZONE_DMA, order);
+
+    spin_unlock_irqrestore(&mem_lock, flags);
+    return frame;
+}
+
+/**
+ * Allocates 2^order contiguous frames below 16MiB for ISA DMA
+ * @param  order log2 of the number of frames
+ * @return       index of first allocated frame, or 0 if out of memory
+ */
+uint32_t mem_allocate_dma_frames(uint32_t order) {
+    uint32_t flags = spin_lock_irqsave(&mem_lock);
+    uint32_t frame = buddy_allocate(ZONE_DMA, order);
+    spin_unlock_irqrestore(&mem_lock, flags);
+    return frame;
+}
+
+/**
+ * Frees 2^order contiguous frames
+ * @param frame index of first frame
+ * @param order order the frames were allocated with
+ */
+void mem_free_frames(uint32_t frame, uint32_t order) {
+    uint32_t flags = spin_lock_irqsave(&mem_lock);
+    buddy_free(frame, order);
+    spin_unlock_irqrestore(&mem_lock, flags);
+}
+
 /**
  * Allocates a frame and returns it's index
  * @return index of allocated frame
  */
 uint32_t mem_allocate_frame() {
-    uint32_t i, j;
-
-    // Loop through bitmap until a free frame is found
-    for (i=0; i < INDEX_TO_BIT(meminfo.highest_free_address/PAGE_SIZE); i++) {
-        // Skip this entry if it is full
-        if (mem_bitmap[i] == 0xFFFFFFFF) continue;
-
-        // Check if this entry has a free frame
-        for (j=0; j < 32; j++) {
-            if (!(mem_bitmap[i] & (1 << j))) {
-                // This frame is free, return it
-                bitmap_set(mem_bitmap, i * 32 + j);
-                return i * 32 + j;
-            }
-        }
-    }
+    uint32_t frame = mem_allocate_frames(0);
 
-    // No free frames were found
-    return 0;
+    // Nobody else knows about it yet, no need to lock
+    if (frame)
+        mem_refcount[frame] = 1;
+    return frame;
 }
 
 /**
- * Frees a frame
+ * Drops a reference to a frame, freeing it once nothing maps it
  * @param frame index of frame to free
  */
-inline void mem_free_frame(uint32_t frame) {
-    bitmap_clear(mem_bitmap, frame);
+void mem_free_frame(uint32_t frame) {
+    if (frame >= meminfo.highest_free_address / PAGE_SIZE)
+        return;
+
+    uint32_t flags = spin_lock_irqsave(&mem_lock);
+
+    if (mem_refcount[frame] > 1) {
+        mem_refcount[frame]--;
+    } else {
+        mem_refcount[frame] = 0;
+        buddy_free(frame, 0);
+    }
+
+    spin_unlock_irqrestore(&mem_lock, flags);
+}
+
+/**
+ * Adds a reference to a frame that is about to be shared
+ * @param  frame index of frame
+ * @return       false if the count is saturated and the frame can't be shared
+ */
+bool mem_ref_frame(uint32_t frame) {
+    if (frame >= meminfo.highest_free_address / PAGE_SIZE)
+        return false;
+
+    uint32_t flags = spin_lock_irqsave(&mem_lock);
+    bool shared = false;
+
+    // Frames that never went through the allocator have an implicit reference
+    if (mem_refcount[frame] == 0)
+        mem_refcount[frame] = 1;
+
+    if (mem_refcount[frame] < MEM_REFCOUNT_MAX) {
+        mem_refcount[frame]++;
+        shared = true;
+    }
+
+    spin_unlock_irqrestore(&mem_lock, flags);
+    return shared;
+}
+
+/**
+ * Gets the number of mappings sharing a frame
+ * @param  frame index of frame
+ * @return       reference count
+ */
+uint8_t mem_frame_refs(uint32_t frame) {
+    if (frame >= meminfo.highest_free_address / PAGE_SIZE)
+        return 0;
+
+    return mem_refcount[frame];
+}
+
+/**
+ * Marks a frame as in use without going through the allocator
+ * @param frame index of frame to reserve
+ */
+void mem_reserve_frame(uint32_t frame) {
+    uint32_t flags = spin_lock_irqsave(&mem_lock);
+    buddy_reserve(frame);
+    spin_unlock_irqrestore(&mem_lock, flags);
 }
 
 
@@ -239,17 +422,38 @@ void mem_print_reserved() {
 
     printf("[mem] kernel heap start: 0x%x\n", meminfo.kernel_heap_start);
     printf("[mem] kernel heap end:   0x%x\n", meminfo.kernel_heap_end);
-    printf("[mem] kernel heap brk:   0x%x\n\n", meminfo.kernel_heap_brk);
+    printf("[mem] kernel heap brk:   0x%x\n", meminfo.kernel_heap_brk);
+    printf("[mem] kernel heap: %u allocations, %u bytes used, %u bytes free\n",
+            heap.allocations, heap.used_bytes, heap.free_bytes);
+
+    // Boot-time counters for frame allocator setup
+    printf("[mem] bitmap init: %u mmap entries, %u ranges, %u words, %u cycles\n",
+            mem_init_stats.mmap_entries, mem_init_stats.ranges, mem_init_stats.words,
+            (uint32_t)mem_init_stats.bitmap_cycles);
+    printf("[mem] buddy init: %u cycles\n", (uint32_t)mem_init_stats.buddy_cycles);
+
+    buddy_print_zones();
+    kmem_cache_print_stats();
+    printf("\n");
 }
 
 /**
  * Read ELF32 section headers and determine kernel reserved memory
  */
 void elf_sections_read() {
-    // Get first section headers
-    elf_section_header_t *cur_header = (elf_section_header_t *)(meminfo.elf_sec->addr + VIRTUAL_BASE);
+    elf_section_header_t *header = (elf_section_header_t *)(meminfo.elf_sec->addr + VIRTUAL_BASE);
+
+    meminfo.kernel_reserved_start = 0xFFFFFFFF;
+    meminfo.kernel_reserved_end = 0;
 
-    // Update local data to reflect reserved memory areas
-    meminfo.kernel_reserved_start = (cur_header + 1)->sh_addr;
-    meminfo.kernel_reserved_end = (cur_header + (meminfo.elf_sec->num) - 1)->sh_addr + VIRTUAL_BASE;
+    // Span every section that is loaded into the kernel's address space
+    for (uint32_t i = 0; i < meminfo.elf_sec->num; i++, header++) {
+        if (header->sh_addr < VIRTUAL_BASE)
+            continue;
+
+        if (header->sh_addr < meminfo.kernel_reserved_start)
+            meminfo.kernel_reserved_start = header->sh_addr;
+        if (header->sh_addr + header->sh_size > meminfo.kernel_reserved_end)
+            meminfo.kernel_reserved_end = header->sh_addr + header->sh_size;
+    }
 }
@@ -8,62 +8,103 @@
 #include <memory/memory.h>
 #include <memory/multiboot.h>
 #include <memory/paging.h>
+#include <memory/slab.h>
+#include <memory/vm.h>
+#include <core/cpu.h>
 #include <core/interrupt.h>
 #include <task/scheduler.h>
+#include <task/syscall.h>
+#include <task/thread.h>
+#include <task/uaccess.h>
 
-// Global pointer to page dir currently in use
-page_directory_t *current_pd;
+page_directory_t *kernel_pd;
 
-// Page tables are reserved in advance to avoid having no available mapped heap space
-static page_table_t *reserved_pt;
+// Object caches for paging structures
+static kmem_cache_t *pd_cache;
+static kmem_cache_t *pt_cache;
 
-// For copying pages
-static void *tmp_src_page;
-static void *tmp_dst_page;
 
+static void pd_ctor(void *pd) {
+    memset(pd, 0, sizeof(page_directory_t));
+}
+
+static void pt_ctor(void *pt) {
+    memset(pt, 0, sizeof(page_table_t));
+}
 
 /**
- * Constructs new paging structures to allow for 4KiB page sizes
- * and remaps kernel to the same virtual location
+ * Constructs new paging structures with all of physical memory mapped at the
+ * virtual base, on 4MiB pages where possible
  */
 void paging_init() {
     // Fault handler will provide useful debugging info
     isr_install_handler(14, page_fault_handler);
 
-    // Allocate the initial PDT
-    page_directory_t *pd = (page_directory_t *)kvalloc(sizeof(page_directory_t));
-    pd->phys = ((uint32_t) pd->table_phys) - VIRTUAL_BASE;
-    memset(pd->table, 0, 1024);
-    memset(pd->table_phys, 0, 1024);
-
-    // Rotating pointer to reserved page table
-    reserved_pt = (page_table_t *)kvalloc(sizeof(page_table_t));
-    memset(reserved_pt->page_phys, 0, 1024);
-
+    // Page aligned caches for paging structures, handed out zeroed
+    pd_cache = kmem_cache_create("page_directory_t", sizeof(page_directory_t), PAGE_SIZE, pd_ctor);
+    pt_cache = kmem_cache_create("page_table_t", sizeof(page_table_t), PAGE_SIZE, pt_ctor);
 
-    // Map kernel to higher half (0xC0000000 + kernel)
-    uint32_t i, t;
-    for (i=0; i<meminfo.kernel_heap_end - VIRTUAL_BASE; i += 0x1000) {
-        // Create new page tables as needed
-        if (!(i % 0x400000)) {  // Check if page is on boundary of next page table
-            t = (i + VIRTUAL_BASE) / 0x400000;
-            pd->table[t] = (page_table_t *)kvalloc(sizeof(page_table_t));
-            pd->table_phys[t] = ((uint32_t)pd->table[t] - VIRTUAL_BASE) | PT_PRESENT | PT_RW;
+    // Allocate the initial PDT
+    page_directory_t *pd = (page_directory_t *)kmem_cache_alloc(pd_cache);
+    pd->phys = virt_to_phys(pd->table_phys);
+    pd->refs = 1;
+
+    // Kernel mappings are the same in every address space, keep them in the TLB
+    bool pge = cpu_has_edx(CPUID_EDX_PGE);
+    uint32_t global = pge ? PT_GLOBAL : 0;
+
+    // Map physical memory to higher half (0xC0000000 + phys), kernel included
+    uint32_t i = 0;
+    while (i < meminfo.highest_free_address) {
+        uint32_t t = (i + VIRTUAL_BASE) >> 22;
+
+        // Whole 4MiB page
+        if (!(i & 0x3FFFFF) && i + 0x400000 <= meminfo.highest_free_address) {
+            pd->table_phys[t] = i | PT_PRESENT | PT_RW | PD_LARGE | global;
+            i += 0x400000;
+            continue;
+        }
 
+        // Create new page tables as needed for the remainder
+        if (!(pd->table_phys[t] & PT_PRESENT)) {
+            page_table_t *pt = (page_table_t *)kmem_cache_alloc(pt_cache);
+            pd->table_phys[t] = virt_to_phys(pt) | PT_PRESENT | PT_RW;
         }
 
-        // Reserve and add page
-        pd->table[t]->page_phys[i / 0x1000] = i | PT_RW | PT_PRESENT;
-        bitmap_set(mem_bitmap, i / 0x1000);
+        pd_table(pd, t)->page_phys[i >> 12 & 0x03FF] = i | PT_RW | PT_PRESENT | global;
+        i += 0x1000;
     }
 
-    // Highest mapped address of heap area
+    // Last entry points back at the directory, exposing its page tables
+    pd->table_phys[PD_RECURSIVE] = pd->phys | PT_PRESENT | PT_RW;
+
+    // Reserve everything up to the end of the kernel heap so far
+    for (i=0; i<meminfo.kernel_heap_end - VIRTUAL_BASE; i += 0x1000)
+        mem_reserve_frame(i / 0x1000);
+
+    // Heap grows from the frame allocator past this point
     meminfo.kernel_heap_brk = i + VIRTUAL_BASE;
 
     // Load new page directory
+    kernel_pd = pd;
     switch_pd(pd);
-    // Enable 4KiB pages
-    disable_pse();
+
+    if (pge)
+        write_cr4(read_cr4() | CR4_PGE);
+
+    // Every page table of the kernel half exists from here on and is shared
+    // by all address spaces, so kernel mappings never have to be propagated
+    for (uint32_t t = KERNEL_MAP_BASE >> 22; t < PD_RECURSIVE; t++) {
+        page_table_t *pt = (page_table_t *)kmem_cache_alloc(pt_cache);
+        pd->table_phys[t] = virt_to_phys(pt) | PT_PRESENT | PT_RW;
+    }
+
+    // Make the kernel respect read-only pages too, so copy-on-write pages
+    // can't be modified behind a process's back
+    write_cr0(read_cr0() | CR0_WP);
+
+    // Demand paging
+    vm_init();
 }
 
 void switch_pd(page_directory_t *pd) {
@@ -71,9 +112,100 @@ void switch_pd(page_directory_t *pd) {
     load_page_dir(pd->phys);
 }
 
+// Copy the contents of a physical frame into a newly allocated frame, 0 if
+// out of memory
+static uint32_t copy_frame(uint32_t phys) {
+    uint32_t new_phys = mem_allocate_frame() * 0x1000;
+    if (!new_phys)
+        return 0;
+
+    memcpy(phys_to_virt(new_phys), phys_to_virt(phys & ~0xFFF), 0x1000);
+    return new_phys;
+}
+
+/**
+ * Resolve a write to a copy-on-write page. The last process sharing a frame
+ * gets it back writable, everyone else gets a private copy.
+ * @param  virt faulting address
+ * @return      true if the fault was handled
+ */
+static bool cow_fault(uint32_t virt) {
+    if (!(*pde_of(virt) & PT_PRESENT))
+        return false;
+
+    uint32_t *pte = pte_of(virt);
+    if (!(*pte & PT_PRESENT))
+        return false;
+
+    // Another thread of the process got here first, this CPU's TLB was stale
+    if (*pte & PT_RW) {
+        invlpg((void *)virt);
+        return true;
+    }
+
+    if (!(*pte & PT_COW))
+        return false;
+
+    uint32_t frame = *pte / 0x1000;
+    uint32_t flags = (*pte & 0xFFF & ~PT_COW) | PT_RW;
+
+    if (frame == vm_zero_frame) {
+        // Nothing worth copying from the zero page
+        uint32_t new_phys = mem_allocate_frame() * 0x1000;
+        if (!new_phys)
+            return false;
+
+        memset(phys_to_virt(new_phys), 0, 0x1000);
+        *pte = new_phys | flags;
+        mem_free_frame(frame);
+    } else if (mem_frame_refs(frame) > 1) {
+        uint32_t new_phys = copy_frame(*pte);
+        if (!new_phys)
+            return false;
+
+        *pte = new_phys | flags;
+        mem_free_frame(frame);
+    } else {
+        *pte = (*pte & ~0xFFF) | flags;
+    }
+
+    tlb_shootdown(current_pd, virt);
+    return true;
+}
+
 void page_fault_handler(registers_t *r) {
+    uint32_t virt = get_faulting_address();
+    page_directory_t *pd = current_pd;
+    bool handled;
+
+    // Threads of the process on other CPUs may fault on the same page
+    uint32_t flags = spin_lock_irqsave(&pd->lock);
+
+    if (r->err_code & PF_PRESENT) {
+        // Write to a page shared by fork() or the zero page
+        handled = (r->err_code & PF_RW) && cow_fault(virt);
+    } else {
+        // First touch of a page in a mapped region
+        handled = vm_fault(virt, r->err_code);
+    }
+
+    spin_unlock_irqrestore(&pd->lock, flags);
+
+    if (handled)
+        return;
+
+    // Kernel mode accessing what user mode passed it
+    if (!(r->err_code & PF_USER) && uaccess_fixup(r))
+        return;
+
+    // Bad access, or no memory left to resolve it, takes only the thread down
+    if (r->err_code & PF_USER) {
+        printf("pid %u: page fault at 0x%x, killed\n", current_thread->pid, virt);
+        thread_exit(-1);
+    }
+
     // Dump information about fault to screen
-    printf("\nPAGE FAULT at 0x%x\nFlags:", get_faulting_address());
+    printf("\nPAGE FAULT at 0x%x\nFlags:", virt);
     if (!(r->err_code & PF_PRESENT)) printf(" [NONEXISTENT]");
     if (r->err_code & PF_RW)         printf(" [READONLY]");
     if (r->err_code & PF_USER)       printf(" [PRIVILEGE]");
@@ -86,165 +218,243 @@ void page_fault_handler(registers_t *r) {
 }
 
 uint32_t get_phys(void *virt) {
-    uint32_t itable = (uint32_t)virt >> 22;
-    uint32_t ipage = (uint32_t)virt >> 12 & 0x03FF;
+    uint32_t pde = *pde_of((uint32_t)virt);
 
     // Check presence of PDE
-    if (!(current_pd->table_phys[itable] & PT_PRESENT))
+    if (!(pde & PT_PRESENT))
         return -1;
 
+    // 4MiB page, there's no page table
+    if (pde & PD_LARGE)
+        return ((pde & 0xFFC00000) + ((uint32_t)virt & 0x3FFFFF));
+
     // Check presence of PTE
-    if (!(current_pd->table[itable]->page_phys[ipage]))
+    uint32_t page = *pte_of((uint32_t)virt);
+    if (!(page & PT_PRESENT))
         return -1;
 
-    return ((current_pd->table[itable]->page_phys[ipage] & ~0xFFF) + ((uint32_t)virt & 0xFFF));
+    return ((page & ~0xFFF) + ((uint32_t)virt & 0xFFF));
 }
 
 // Simply maps virtual to physical
 uint32_t map_page_to_phys(uint32_t virt, uint32_t phys, uint32_t flags) {
-    uint32_t itable = virt >> 22;
-    uint32_t ipage = virt >> 12 & 0x03FF;
+    uint32_t *pde = pde_of(virt);
 
-    // Page directory entry not present
-    if (!(current_pd->table_phys[itable] & PT_PRESENT)) {
-        printf("need new pt for 0x%x\n", virt);
+    // Page directory entry not present, kernel tables always are so this is user memory
+    if (!(*pde & PT_PRESENT)) {
+        page_table_t *pt = (page_table_t *)kmem_cache_alloc(pt_cache);
 
-        // Add reserved table to directory
-        current_pd->table_phys[itable] = get_phys(reserved_pt) | PT_PRESENT  | (flags & 0xFFF);
-        current_pd->table[itable] = reserved_pt;
-
-        printf("using 0x%x - ", reserved_pt);
+        // Access is restricted per page, so the table itself stays writable
+        *pde = virt_to_phys(pt) | PT_PRESENT | PT_RW;
+    }
 
-        // Set aside memory for another page table for next time
-        reserved_pt = (page_table_t *)kvalloc(sizeof(page_table_t));
+    // User pages are only reachable if the table is, whatever came first
+    if (flags & PT_USER)
+        *pde |= PD_USER;
 
-        printf("reserving 0x%x\n", reserved_pt);
-    }
-    
     // Add page to corresponding the new page table
-    current_pd->table[itable]->page_phys[ipage] = phys | PT_PRESENT | (flags & 0xFFF);
+    *pte_of(virt) = phys | PT_PRESENT | (flags & 0xFFF);
 
     return virt;
 }
 
 
-// Map virtual address to first available physical page
+// Map virtual address to first available physical page, 0 if out of memory
 uint32_t map_page(uint32_t virt, uint32_t flags) {
-    return map_page_to_phys(virt, mem_allocate_frame() * 0x1000, flags);
+    uint32_t frame = mem_allocate_frame();
+    if (!frame)
+        return 0;
+
+    return map_page_to_phys(virt, frame * 0x1000, flags);
 }
 
 
 void unmap_page(uint32_t virt) {
-    uint32_t itable = virt >> 22;
-    uint32_t ipage = virt >> 12 & 0x03FF;
+    if ((*pde_of(virt) & (PD_PRESENT | PD_LARGE)) == PD_PRESENT) {
+        uint32_t *pte = pte_of(virt);
 
-    if (current_pd->table_phys[itable] & PD_PRESENT) {
         // Deallocate physical frame
-        mem_free_frame((uint32_t)current_pd->table[itable]->page_phys[ipage] / 0x1000);
+        if (*pte & PT_PRESENT)
+            mem_free_frame(*pte / 0x1000);
 
         // Remove mapping to page table
-        current_pd->table[itable]->page_phys[ipage] &= !PT_PRESENT;
-        
-        // Notify MMU
-        invlpg((void *)virt);
+        *pte = 0;
+
+        // Notify MMU, of every CPU that may have it cached
+        tlb_shootdown(current_pd, virt);
     }
 }
 
-void move_stack(uint32_t stack, uint32_t limit) {
-    extern void _init_stack_start();
-    extern void _init_stack_end();
+/**
+ * Map device memory into every address space, uncached
+ * @param  phys physical address of the registers
+ * @param  size length of the register block
+ * @return      virtual address of `phys`, or 0 if the MMIO region is full
+ */
+void *mmio_map(uint32_t phys, uint32_t size) {
+    static uint32_t mmio_next = MMIO_BASE;
+
+    uint32_t offset = phys & 0xFFF;
+    uint32_t pages = (offset + size + 0xFFF) & ~0xFFF;
 
-    uint32_t init_ebp, init_esp;
-    asm volatile("mov %%esp, %0" : "=r" (init_esp));
-    asm volatile("mov %%ebp, %0" : "=r" (init_ebp));
+    if (mmio_next + pages > MMIO_END)
+        return 0;
 
-    // New pointers
-    uint32_t ebp = stack - ((uint32_t)_init_stack_end - init_ebp);
-    uint32_t esp = stack - ((uint32_t)_init_stack_end - init_esp);
+    uint32_t virt = mmio_next;
+    mmio_next += pages;
 
-    uint32_t *old = (uint32_t *)init_esp;
-    uint32_t *new = (uint32_t *)esp;
+    for (uint32_t i = 0; i < pages; i += PAGE_SIZE)
+        map_page_to_phys(virt + i, (phys & ~0xFFF) + i, PT_RW | PT_NOCACHE | PT_GLOBAL);
 
-    for (uint32_t i=stack; i>= (stack-limit); i-=0x1000)
-        map_page(i, PT_RW);
+    return (void *)(virt + offset);
+}
 
-    for (uint32_t i=0; i<stack - esp; i++) {
+// Create an empty VAS sharing the kernel half of the current one
+page_directory_t *create_pd() {
 
-        // Offset anything that COULD be a stack frame pointer
-        if (old[i] >= init_esp && old[i] <= _init_stack_end)
-            new[i] = stack - ((uint32_t)_init_stack_end - old[i]);
-        else
-            new[i] = old[i];
-    }
-    
-    // New stack location open for business
-    asm volatile("cli");
-    asm volatile("mov %0, %%esp;" : : "r" (esp));
-    asm volatile("mov %0, %%ebp;" : : "r" (ebp));
-    asm volatile("sti");
+    page_directory_t *new_pd = (page_directory_t *)kmem_cache_alloc(pd_cache);
+    new_pd->phys = virt_to_phys(new_pd->table_phys);
+    new_pd->refs = 1;
+
+    memcpy(&new_pd->table_phys[PD_KERNEL], &current_pd->table_phys[PD_KERNEL],
+           (PD_RECURSIVE - PD_KERNEL) * sizeof(uint32_t));
+    new_pd->table_phys[PD_RECURSIVE] = new_pd->phys | PT_PRESENT | PT_RW;
+
+    return new_pd;
+}
+
+// Free a VAS from create_pd() that has nothing mapped in its user half
+void free_pd(page_directory_t *pd) {
+    kmem_cache_free(pd_cache, pd);
+}
+
+// Take a reference for another thread running in a VAS
+page_directory_t *pd_get(page_directory_t *pd) {
+    __sync_fetch_and_add(&pd->refs, 1);
+    return pd;
+}
+
+/**
+ * Drop a thread's reference to a VAS. The last one frees its user half and
+ * the directory, which by then mustn't be loaded on any CPU.
+ * @param pd address space
+ */
+void pd_put(page_directory_t *pd) {
+    if (__sync_sub_and_fetch(&pd->refs, 1))
+        return;
+
+    vm_unmap_all(pd);
+
+    for (uint32_t i = 0; i < PD_KERNEL; i++)
+        if (pd->table_phys[i] & PT_PRESENT)
+            kmem_cache_free(pt_cache, pd_table(pd, i));
+
+    memset(pd, 0, sizeof(page_directory_t));
+    free_pd(pd);
+}
 
-    // Reuse and recycle (the old stack)
-    memset(_init_stack_start, 0, _init_stack_end - _init_stack_start);
-    heap_add(_init_stack_start, _init_stack_end - _init_stack_start);
+// Drop the frames a page table maps and free it
+static void free_pt(page_table_t *pt) {
+    for (uint32_t i = 0; i < 1024; i++)
+        if (pt->page_phys[i] & PT_PRESENT)
+            mem_free_frame(pt->page_phys[i] / 0x1000);
+
+    kmem_cache_free(pt_cache, pt);
 }
 
-// Clone an entire VAS
+/**
+ * Clone an entire VAS
+ * @param  src address space to copy, the current one
+ * @return     new address space, or 0 if out of memory
+ */
 page_directory_t *clone_pd(page_directory_t* src) {
 
-    page_directory_t *new_pd = (page_directory_t *)kvalloc(sizeof(page_directory_t));
+    page_directory_t *new_pd = (page_directory_t *)kmem_cache_alloc(pd_cache);
+    if (!new_pd)
+        return 0;
 
     // Set physical address of page directory
-    new_pd->phys = get_phys((void *)(new_pd->table_phys));
-
-    // Set aside space for pointers without wasting actual RAM
-    if (!tmp_dst_page) {
-        tmp_dst_page = (void *)kvalloc(PAGE_SIZE);
-        tmp_src_page = (void *)kvalloc(PAGE_SIZE);
-        mem_free_frame(get_phys(tmp_dst_page) / 0x1000);
-        mem_free_frame(get_phys(tmp_src_page) / 0x1000);
-    }
+    new_pd->phys = virt_to_phys(new_pd->table_phys);
+    new_pd->refs = 1;
 
-    for (int i=0; i<1024; i++) {
-        if (!src->table[i]) {
-            new_pd->table_phys[i] = 0;
-            continue;
-        }
+    // Kernel page tables are shared
+    memcpy(&new_pd->table_phys[PD_KERNEL], &src->table_phys[PD_KERNEL],
+           (PD_RECURSIVE - PD_KERNEL) * sizeof(uint32_t));
+    new_pd->table_phys[PD_RECURSIVE] = new_pd->phys | PT_PRESENT | PT_RW;
 
+    // Other threads of the source may unmap or fault pages in meanwhile
+    uint32_t flags = spin_lock_irqsave(&src->lock);
 
-        if (i >= (VIRTUAL_BASE / 0x400000) && i <= (meminfo.kernel_heap_brk / 0x400000)) {
-            // If page includes kernel data, point to same page tables
-            new_pd->table[i] = src->table[i];
-            new_pd->table_phys[i] = src->table_phys[i];
+    // Share user data until either side writes to it
+    for (int i=0; i<PD_KERNEL; i++) {
+        if (src->table_phys[i] & PT_PRESENT) {
+            page_table_t *pt = cow_pt(pd_table(src, i));
 
-        } else {
-            // Or make a copy for user data
-            if (src->table_phys[i] & PT_PRESENT) {
-                new_pd->table[i] = copy_pt(src->table[i]);
-                new_pd->table_phys[i] = get_phys(new_pd->table[i]) | (src->table_phys[i] & 0xFFF);
+            // Pages the source already lost write access to stay that way
+            if (!pt) {
+                spin_unlock_irqrestore(&src->lock, flags);
+
+                for (int j = 0; j < i; j++)
+                    if (new_pd->table_phys[j] & PT_PRESENT)
+                        free_pt(pd_table(new_pd, j));
+
+                free_pd(new_pd);
+                tlb_shootdown(src, TLB_FLUSH_ALL);
+                return 0;
             }
+
+            new_pd->table_phys[i] = virt_to_phys(pt) | (src->table_phys[i] & 0xFFF);
         }
     }
 
+    // Pages not yet touched are paged in on demand by the child as well
+    vm_clone(new_pd, src);
+
+    spin_unlock_irqrestore(&src->lock, flags);
+
+    // Pages of the source that were just made read-only may still be cached
+    tlb_shootdown(src, TLB_FLUSH_ALL);
+
     return new_pd;
 }
 
-// Copy a page table and each of its present pages
-page_table_t *copy_pt(page_table_t *src) {
+/**
+ * Share the present pages of a page table, making writable ones copy-on-write
+ * @param  src page table to share
+ * @return     new page table, or 0 if out of memory
+ */
+page_table_t *cow_pt(page_table_t *src) {
 
-    page_table_t *new_pt = (page_table_t *)kvalloc(sizeof(page_table_t));
+    page_table_t *new_pt = (page_table_t *)kmem_cache_alloc(pt_cache);
+    if (!new_pt)
+        return 0;
 
     for (uint32_t i=0; i<1024; i++) {
+        uint32_t page = src->page_phys[i];
+
+        if (!(page & PT_PRESENT))
+            continue;
 
-        // Copy physical page
-        if (src->page_phys[i] & PT_PRESENT) {
-            map_page(tmp_dst_page, PT_RW);
-            map_page_to_phys(tmp_src_page, src->page_phys[i], PT_RW);
-            invlpg(tmp_src_page);
-            invlpg(tmp_dst_page);
+        // Frame is shared by too many processes, fall back to copying it
+        if (!mem_ref_frame(page / 0x1000)) {
+            uint32_t copy = copy_frame(page);
+            if (!copy) {
+                free_pt(new_pt);
+                return 0;
+            }
 
-            new_pt->page_phys[i] = get_phys(tmp_dst_page) | (src->page_phys[i] & 0xFFF);
-            memcpy(tmp_dst_page, tmp_src_page, 0x1000);
+            new_pt->page_phys[i] = copy | (page & 0xFFF);
+            continue;
         }
+
+        // Both sides lose write access until they fault a private copy, unless
+        // the page is meant to be shared
+        if ((page & PT_RW) && !(page & PT_SHARED)) {
+            page = (page & ~PT_RW) | PT_COW;
+            src->page_phys[i] = page;
+        }
+
+        new_pt->page_phys[i] = page;
     }
 
     return new_pt;
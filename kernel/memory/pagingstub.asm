@@ -1,7 +1,6 @@
 section .text
 
 global load_page_dir
-global disable_pse
 global get_faulting_address
 
 load_page_dir:
@@ -15,12 +14,6 @@ load_page_dir:
     pop ebp ; Restore ebp's original state from the stack
     ret
 
-disable_pse:
-    mov eax, cr4
-    xor eax, 0x00000010 ; PSE bit
-    mov cr4, eax        ; disable 4MiB pages
-
-
 ; Get value of cr2
 get_faulting_address:
     mov eax, cr2
@@ -0,0 +1,117 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <memory/memory.h>
+#include <memory/heap.h>
+#include <memory/slab.h>
+
+// Every cache created, for statistics
+static kmem_cache_t *caches;
+
+
+/**
+ * Create a cache for objects of a fixed size
+ * @param  name  name shown in statistics
+ * @param  size  object size in bytes
+ * @param  align required object alignment, at most PAGE_SIZE
+ * @param  ctor  optional function run on every object handed out
+ * @return       new cache
+ */
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align, kmem_ctor_t ctor) {
+    kmem_cache_t *cache = (kmem_cache_t *)kmalloc(sizeof(kmem_cache_t));
+
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+    if (size < sizeof(void *))
+        size = sizeof(void *);
+
+    cache->name = name;
+    cache->size = size;
+    cache->stride = (size + align - 1) & ~(align - 1);
+    cache->ctor = ctor;
+    cache->lock = (spinlock_t)SPINLOCK_INIT;
+    cache->free = 0;
+
+    // Small objects get a page per slab, large ones at least SLAB_MIN_OBJECTS
+    cache->slab_size = PAGE_SIZE;
+    if (cache->stride * SLAB_MIN_OBJECTS > PAGE_SIZE)
+        cache->slab_size = (cache->stride * SLAB_MIN_OBJECTS + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    cache->slabs = cache->objects = cache->in_use = 0;
+    cache->allocs = cache->frees = 0;
+
+    cache->next = caches;
+    caches = cache;
+
+    return cache;
+}
+
+// Carve a new slab into objects and put them on the free list, false if
+// the heap is out of memory
+static bool kmem_cache_grow(kmem_cache_t *cache) {
+    uint32_t slab = (uint32_t)kvalloc(cache->slab_size);
+    if (!slab)
+        return false;
+
+    uint32_t count = cache->slab_size / cache->stride;
+
+    // Link objects so the lowest address is handed out first
+    for (uint32_t i = count; i > 0; i--) {
+        void **obj = (void **)(slab + (i - 1) * cache->stride);
+        *obj = cache->free;
+        cache->free = obj;
+    }
+
+    cache->slabs++;
+    cache->objects += count;
+    return true;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    uint32_t flags = spin_lock_irqsave(&cache->lock);
+
+    if (!cache->free && !kmem_cache_grow(cache)) {
+        spin_unlock_irqrestore(&cache->lock, flags);
+        return 0;
+    }
+
+    void **obj = (void **)cache->free;
+    cache->free = *obj;
+
+    cache->in_use++;
+    cache->allocs++;
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    if (cache->ctor)
+        cache->ctor(obj);
+
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (!obj)
+        return;
+
+    uint32_t flags = spin_lock_irqsave(&cache->lock);
+
+    *(void **)obj = cache->free;
+    cache->free = obj;
+
+    cache->in_use--;
+    cache->frees++;
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+/**
+ * Debug function to print out usage of every object cache
+ */
+void kmem_cache_print_stats() {
+    for (kmem_cache_t *cache = caches; cache; cache = cache->next) {
+        printf("[slab] %s: %u/%u objects in use, %u slabs of %uB, %u allocs, %u frees\n",
+                cache->name, cache->in_use, cache->objects, cache->slabs,
+                cache->slab_size, cache->allocs, cache->frees);
+    }
+}
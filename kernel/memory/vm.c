@@ -0,0 +1,347 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <memory/memory.h>
+#include <memory/paging.h>
+#include <memory/slab.h>
+#include <memory/vm.h>
+#include <driver/fs.h>
+#include <task/shm.h>
+
+uint32_t vm_zero_frame;
+
+static kmem_cache_t *vm_region_cache;
+
+
+/**
+ * Set up the region cache and the shared zero page
+ */
+void vm_init() {
+    vm_region_cache = kmem_cache_create("vm_region_t", sizeof(vm_region_t), 4, 0);
+
+    // The kernel keeps its own reference, so the zero page is never freed
+    vm_zero_frame = mem_allocate_frame();
+    memset(phys_to_virt(vm_zero_frame * PAGE_SIZE), 0, PAGE_SIZE);
+}
+
+static void vm_unmap_pages(page_directory_t *pd, vm_region_t *region);
+
+// Add a region at the head of the list, with the address space locked
+static vm_region_t *vm_insert(page_directory_t *pd, uint32_t start, uint32_t end, uint32_t flags,
+                              shm_t *shm) {
+    if (start >= end || (start | end) & (PAGE_SIZE - 1))
+        return 0;
+
+    // Regions may not overlap
+    for (vm_region_t *r = pd->regions; r; r = r->next)
+        if (start < r->end && r->start < end)
+            return 0;
+
+    vm_region_t *region = (vm_region_t *)kmem_cache_alloc(vm_region_cache);
+    region->start = start;
+    region->end = end;
+    region->flags = flags;
+    region->node = 0;
+    region->offset = 0;
+    region->file_size = 0;
+    region->shm = shm;
+
+    region->next = pd->regions;
+    pd->regions = region;
+
+    return region;
+}
+
+static vm_region_t *vm_add(page_directory_t *pd, uint32_t start, uint32_t end, uint32_t flags,
+                           shm_t *shm) {
+    uint32_t irq = spin_lock_irqsave(&pd->lock);
+    vm_region_t *region = vm_insert(pd, start, end, flags, shm);
+    spin_unlock_irqrestore(&pd->lock, irq);
+
+    return region;
+}
+
+/**
+ * Reserve a range of zero-filled memory
+ * @param  pd    address space
+ * @param  start page aligned start address
+ * @param  end   page aligned end address
+ * @param  flags page table flags of the region
+ * @return       new region, or 0 if the range is invalid or in use
+ */
+vm_region_t *vm_map_anon(page_directory_t *pd, uint32_t start, uint32_t end, uint32_t flags) {
+    return vm_add(pd, start, end, flags, 0);
+}
+
+/**
+ * Reserve a range of memory backed by a private copy of a file
+ * @param  pd        address space
+ * @param  start     page aligned start address
+ * @param  end       page aligned end address
+ * @param  flags     page table flags of the region
+ * @param  node      backing file
+ * @param  offset    file offset that appears at start
+ * @param  file_size bytes of the range read from the file, the rest is zeroed
+ * @return           new region, or 0 if the range is invalid or in use
+ */
+vm_region_t *vm_map_file(page_directory_t *pd, uint32_t start, uint32_t end, uint32_t flags,
+                         fs_node_t *node, uint32_t offset, uint32_t file_size) {
+    vm_region_t *region = vm_add(pd, start, end, flags, 0);
+
+    if (region) {
+        region->node = node;
+        region->offset = offset;
+        region->file_size = file_size < end - start ? file_size : end - start;
+    }
+
+    return region;
+}
+
+/**
+ * Map contiguous frames that stay shared, with the kernel or across fork(),
+ * instead of becoming copy-on-write. Each mapping holds a frame reference.
+ * @param  pd    address space, the current one
+ * @param  start page aligned start address
+ * @param  phys  physical address of the first frame
+ * @param  pages number of frames
+ * @param  flags page table flags of the region
+ * @param  shm   segment the frames belong to, whose reference the region
+ *               takes over if it's mapped, or 0
+ * @return       new region, or 0 if the range is invalid or in use, or a
+ *               frame has too many references
+ */
+vm_region_t *vm_map_shared(page_directory_t *pd, uint32_t start, uint32_t phys, uint32_t pages,
+                           uint32_t flags, shm_t *shm) {
+    // Other threads see all of the pages or none, whether they fork() or
+    // unmap the region
+    uint32_t irq = spin_lock_irqsave(&pd->lock);
+    vm_region_t *region = vm_insert(pd, start, start + pages * PAGE_SIZE, flags | PT_SHARED, shm);
+    bool mapped = region;
+
+    for (uint32_t i = 0; i < pages && mapped; i++) {
+        // A frame whose count is saturated can't take another mapping
+        mapped = mem_ref_frame(phys / PAGE_SIZE + i);
+
+        if (mapped) {
+            map_page_to_phys(start + i * PAGE_SIZE, phys + i * PAGE_SIZE, region->flags);
+            invlpg((void *)(start + i * PAGE_SIZE));
+        }
+    }
+
+    // Still at the head of the list, nobody else had the lock
+    if (region && !mapped) {
+        pd->regions = region->next;
+        vm_unmap_pages(pd, region);
+        kmem_cache_free(vm_region_cache, region);
+        region = 0;
+    }
+
+    spin_unlock_irqrestore(&pd->lock, irq);
+    return region;
+}
+
+/**
+ * Find the region containing an address
+ * @param  pd   address space
+ * @param  addr address to look up
+ * @return      region, or 0 if the address isn't in one
+ */
+vm_region_t *vm_find(page_directory_t *pd, uint32_t addr) {
+    for (vm_region_t *r = pd->regions; r; r = r->next)
+        if (addr >= r->start && addr < r->end)
+            return r;
+
+    return 0;
+}
+
+// Unmap the pages of a region, dropping the frames paged in
+static void vm_unmap_pages(page_directory_t *pd, vm_region_t *region) {
+    for (uint32_t page = region->start; page < region->end; page += PAGE_SIZE) {
+        uint32_t itable = page >> 22;
+        uint32_t ipage = page >> 12 & 0x03FF;
+
+        // Skip the rest of a missing page table
+        if (!(pd->table_phys[itable] & PT_PRESENT)) {
+            page |= 0x3FF000;
+            continue;
+        }
+
+        uint32_t *pte = &pd_table(pd, itable)->page_phys[ipage];
+        if (*pte & PT_PRESENT) {
+            mem_free_frame(*pte / PAGE_SIZE);
+            *pte = 0;
+
+            tlb_shootdown(pd, page);
+        }
+    }
+}
+
+// Unmap the region starting at an address, if there is one and it maps a
+// shared memory segment when `segment` is set
+static bool vm_remove(page_directory_t *pd, uint32_t start, bool segment) {
+    uint32_t flags = spin_lock_irqsave(&pd->lock);
+    vm_region_t **link = &pd->regions;
+
+    while (*link && (*link)->start != start)
+        link = &(*link)->next;
+
+    vm_region_t *region = *link;
+    shm_t *shm = 0;
+
+    if (region && segment && !region->shm)
+        region = 0;
+
+    if (region) {
+        *link = region->next;
+        vm_unmap_pages(pd, region);
+
+        shm = region->shm;
+        kmem_cache_free(vm_region_cache, region);
+    }
+
+    spin_unlock_irqrestore(&pd->lock, flags);
+
+    // The segment may go with it
+    if (shm)
+        shm_put(shm);
+
+    return region;
+}
+
+/**
+ * Unmap the region starting at an address
+ * @param  pd    address space
+ * @param  start start of the region
+ * @return       false if no region starts there
+ */
+bool vm_unmap(page_directory_t *pd, uint32_t start) {
+    return vm_remove(pd, start, false);
+}
+
+/**
+ * Unmap the shared memory segment mapped at an address
+ * @param  pd    address space
+ * @param  start start of the region
+ * @return       false if no segment is mapped there
+ */
+bool vm_unmap_shm(page_directory_t *pd, uint32_t start) {
+    return vm_remove(pd, start, true);
+}
+
+/**
+ * Unmap every region of an address space, dropping the frames paged in and
+ * the segments it mapped or created
+ * @param pd address space
+ */
+void vm_unmap_all(page_directory_t *pd) {
+    uint32_t flags = spin_lock_irqsave(&pd->lock);
+    vm_region_t *region = pd->regions;
+
+    for (vm_region_t *r = region; r; r = r->next)
+        vm_unmap_pages(pd, r);
+
+    pd->regions = 0;
+    spin_unlock_irqrestore(&pd->lock, flags);
+
+    while (region) {
+        vm_region_t *next = region->next;
+
+        if (region->shm)
+            shm_put(region->shm);
+
+        kmem_cache_free(vm_region_cache, region);
+        region = next;
+    }
+
+    shm_exit(pd);
+}
+
+/**
+ * Give an address space a copy of another's regions
+ * @param dst address space to add regions to
+ * @param src address space to copy from, locked
+ */
+void vm_clone(page_directory_t *dst, page_directory_t *src) {
+    for (vm_region_t *r = src->regions; r; r = r->next) {
+        vm_region_t *region = vm_add(dst, r->start, r->end, r->flags, r->shm);
+
+        if (region) {
+            region->node = r->node;
+            region->offset = r->offset;
+            region->file_size = r->file_size;
+
+            // Can't go away meanwhile, src still maps it
+            if (r->shm)
+                shm_get(r->shm);
+        }
+    }
+}
+
+// Map a fresh frame at `page` filled from the region's file or with zeroes,
+// false if out of memory
+static bool vm_fill_page(vm_region_t *region, uint32_t page) {
+    uint32_t phys = mem_allocate_frame() * PAGE_SIZE;
+    if (!phys)
+        return false;
+
+    uint8_t *data = (uint8_t *)phys_to_virt(phys);
+    uint32_t offset = page - region->start;
+    uint32_t size = 0;
+
+    // Filled through the direct map before the page becomes visible
+    if (offset < region->file_size) {
+        size = region->file_size - offset;
+        if (size > PAGE_SIZE)
+            size = PAGE_SIZE;
+
+        fs_read(region->node, region->offset + offset, size, data);
+    }
+
+    memset(data + size, 0, PAGE_SIZE - size);
+
+    map_page_to_phys(page, phys, region->flags);
+    invlpg((void *)page);
+    return true;
+}
+
+/**
+ * Resolve a fault on a page that isn't present, with the address space locked
+ * @param  virt faulting address
+ * @param  err  page fault error code
+ * @return      true if the address belongs to a region and was paged in,
+ *              false for a bad access or if out of memory
+ */
+bool vm_fault(uint32_t virt, uint32_t err) {
+    vm_region_t *region = vm_find(current_pd, virt);
+
+    if (!region)
+        return false;
+
+    // Access the region doesn't allow
+    if (((err & PF_RW) && !(region->flags & PT_RW)) ||
+        ((err & PF_USER) && !(region->flags & PT_USER)))
+        return false;
+
+    uint32_t page = virt & ~0xFFF;
+
+    // Another thread of the process paged it in meanwhile
+    if ((*pde_of(page) & PT_PRESENT) && (*pte_of(page) & PT_PRESENT)) {
+        invlpg((void *)page);
+        return true;
+    }
+
+    // Reads of untouched memory see the zero page until the first write
+    if (!(err & PF_RW) && page - region->start >= region->file_size &&
+        mem_ref_frame(vm_zero_frame)) {
+        uint32_t flags = region->flags & ~PT_RW;
+        if (region->flags & PT_RW)
+            flags |= PT_COW;
+
+        map_page_to_phys(page, vm_zero_frame * PAGE_SIZE, flags);
+        invlpg((void *)page);
+        return true;
+    }
+
+    return vm_fill_page(region, page);
+}
@@ -3,6 +3,9 @@
 global get_eip
 global become_user
 global switch_context
+global thread_bootstrap
+
+extern finish_switch
 
 get_eip:
 	pop eax
@@ -44,10 +47,20 @@ switch_context:
 	mov ebp, [ecx]		; ebp
 	mov esp, [ecx+4]	; esp
 	mov eax, [ecx+12]	; cr3
+	mov edx, cr3
+	cmp eax, edx		; Threads of one process keep their TLB entries
+	je .same_pd
 	mov cr3, eax
+.same_pd:
 	mov eax, [ecx+8]	; eax
 
 	push DWORD [ecx+16]	; return address
 
+	ret					; interrupts stay off, the caller restores them
+
+; First instructions of every new thread. The switch away from the previous
+; thread is finished, then the address left on the stack takes over.
+thread_bootstrap:
+	call finish_switch
 	sti
 	ret
\ No newline at end of file
@@ -0,0 +1,296 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <driver/fs.h>
+#include <driver/vga.h>
+#include <memory/memory.h>
+#include <memory/slab.h>
+#include <task/file.h>
+#include <task/pipe.h>
+#include <task/thread.h>
+#include <task/uaccess.h>
+
+static kmem_cache_t *files_cache;
+
+static uint32_t console_write(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
+    (void)node;
+    (void)offset;
+
+    for (uint32_t i = 0; i < size; i++)
+        vga_putch(buffer[i]);
+
+    return size;
+}
+
+// Character device writing to the screen, the offset is ignored
+static fs_node_t console_node = {
+    .name = "console", .flags = FS_CHARDEVICE, .write = console_write
+};
+
+static void files_ctor(void *files) {
+    memset(files, 0, sizeof(files_t));
+    ((files_t *)files)->refs = 1;
+}
+
+void file_init() {
+    files_cache = kmem_cache_create("files_t", sizeof(files_t), 4, files_ctor);
+    pipe_init();
+}
+
+/**
+ * Descriptor table of a new process, with the console open
+ * @return table with one reference
+ */
+files_t *files_create() {
+    files_t *files = (files_t *)kmem_cache_alloc(files_cache);
+    files->node[FD_CONSOLE] = &console_node;
+    return files;
+}
+
+/**
+ * Copy a descriptor table, as fork() does
+ * @param  files table to copy
+ * @return       new table with one reference
+ */
+files_t *files_clone(files_t *files) {
+    files_t *clone = (files_t *)kmem_cache_alloc(files_cache);
+
+    // Each copy is closed on its own later. Opened with the table locked, so
+    // a sibling's close can't free a node in between.
+    uint32_t flags = spin_lock_irqsave(&files->lock);
+    memcpy(clone->node, files->node, sizeof(clone->node));
+
+    for (uint32_t fd = 0; fd < FILES_MAX; fd++)
+        if (clone->node[fd])
+            fs_open(clone->node[fd], 1, 0);
+
+    spin_unlock_irqrestore(&files->lock, flags);
+    return clone;
+}
+
+// Share a table with another thread
+files_t *files_get(files_t *files) {
+    __sync_fetch_and_add(&files->refs, 1);
+    return files;
+}
+
+// Drop a thread's reference, closing everything once nobody has the table
+void files_put(files_t *files) {
+    if (__sync_sub_and_fetch(&files->refs, 1))
+        return;
+
+    for (uint32_t fd = 0; fd < FILES_MAX; fd++)
+        if (files->node[fd])
+            fs_close(files->node[fd]);
+
+    kmem_cache_free(files_cache, files);
+}
+
+/**
+ * Open the node behind a descriptor once more, so it stays around while in
+ * use even if another thread closes the descriptor
+ * @param  fd descriptor
+ * @return    node, to be released with file_put(), or 0
+ */
+static fs_node_t *file_get(uint32_t fd) {
+    files_t *files = current_thread->files;
+    if (!files || fd >= FILES_MAX)
+        return 0;
+
+    uint32_t flags = spin_lock_irqsave(&files->lock);
+    fs_node_t *node = files->node[fd];
+
+    if (node)
+        fs_open(node, 1, 0);
+
+    spin_unlock_irqrestore(&files->lock, flags);
+    return node;
+}
+
+static inline void file_put(fs_node_t *node) {
+    fs_close(node);
+}
+
+// Give a node the lowest free descriptor, or -1 if there's none
+static int32_t file_install(files_t *files, fs_node_t *node) {
+    int32_t fd = -1;
+    uint32_t flags = spin_lock_irqsave(&files->lock);
+
+    for (uint32_t i = 0; i < FILES_MAX; i++) {
+        if (!files->node[i]) {
+            files->node[i] = node;
+            fd = i;
+            break;
+        }
+    }
+
+    spin_unlock_irqrestore(&files->lock, flags);
+    return fd;
+}
+
+/**
+ * Open a file in the root directory, as a system call
+ * @param  name file name
+ * @return      lowest free descriptor, or -1
+ */
+int32_t file_open(const char *name) {
+    files_t *files = current_thread->files;
+    char path[FILE_NAME_MAX];
+
+    if (!files || strncpy_from_user(path, name, sizeof(path)) < 0)
+        return -1;
+
+    fs_node_t *node = fs_finddir(fs_root, path);
+    if (!node)
+        return -1;
+
+    int32_t fd = file_install(files, node);
+    if (fd >= 0)
+        fs_open(node, 1, 0);
+
+    return fd;
+}
+
+/**
+ * Create a pipe, as a system call
+ * @param  fds where the descriptors of the read and write end are stored
+ * @return     0, or -1
+ */
+int32_t file_pipe(int32_t *fds) {
+    files_t *files = current_thread->files;
+    if (!files || !user_range(fds, 2 * sizeof(int32_t)))
+        return -1;
+
+    fs_node_t *read, *write;
+    if (pipe_create(&read, &write) < 0)
+        return -1;
+
+    // Already open once at each end
+    int32_t rfd = file_install(files, read);
+    int32_t wfd = file_install(files, write);
+
+    if (rfd < 0 || wfd < 0) {
+        if (rfd >= 0)
+            file_close(rfd);
+        else
+            fs_close(read);
+
+        if (wfd >= 0)
+            file_close(wfd);
+        else
+            fs_close(write);
+
+        return -1;
+    }
+
+    int32_t pair[2] = { rfd, wfd };
+    if (!copy_to_user(fds, pair, sizeof(pair))) {
+        file_close(rfd);
+        file_close(wfd);
+        return -1;
+    }
+
+    return 0;
+}
+
+int32_t file_close(uint32_t fd) {
+    files_t *files = current_thread->files;
+    if (!files || fd >= FILES_MAX)
+        return -1;
+
+    uint32_t flags = spin_lock_irqsave(&files->lock);
+    fs_node_t *node = files->node[fd];
+    files->node[fd] = 0;
+    spin_unlock_irqrestore(&files->lock, flags);
+
+    if (!node)
+        return -1;
+
+    fs_close(node);
+    return 0;
+}
+
+// Read a node that works on kernel memory into a user buffer
+static int32_t file_bounce_read(fs_node_t *node, uint8_t *buf, uint32_t len, uint32_t offset) {
+    uint8_t bounce[FILE_BOUNCE];
+    uint32_t done = 0;
+
+    while (done < len) {
+        uint32_t chunk = len - done < FILE_BOUNCE ? len - done : FILE_BOUNCE;
+        uint32_t n = fs_read(node, offset + done, chunk, bounce);
+
+        if (n == (uint32_t)-1 || n > chunk)
+            return done ? (int32_t)done : -1;
+        if (!copy_to_user(buf + done, bounce, n))
+            return -1;
+
+        done += n;
+        if (n < chunk)
+            break;
+    }
+
+    return done;
+}
+
+// Write a user buffer to a node that works on kernel memory
+static int32_t file_bounce_write(fs_node_t *node, uint8_t *buf, uint32_t len, uint32_t offset) {
+    uint8_t bounce[FILE_BOUNCE];
+    uint32_t done = 0;
+
+    while (done < len) {
+        uint32_t chunk = len - done < FILE_BOUNCE ? len - done : FILE_BOUNCE;
+        if (!copy_from_user(bounce, buf + done, chunk))
+            return done ? (int32_t)done : -1;
+
+        uint32_t n = fs_write(node, offset + done, chunk, bounce);
+        if (n == (uint32_t)-1 || n > chunk)
+            return done ? (int32_t)done : -1;
+
+        done += n;
+        if (n < chunk)
+            break;
+    }
+
+    return done;
+}
+
+/**
+ * Read from an open file, as a system call or ring operation. Pipes move
+ * data to user mode themselves, other nodes read into a kernel buffer that
+ * is copied out.
+ * @param  fd     descriptor
+ * @param  buf    user buffer
+ * @param  len    bytes to read at most
+ * @param  offset file offset to start at
+ * @return        bytes read, or -1
+ */
+int32_t file_read(uint32_t fd, uint8_t *buf, uint32_t len, uint32_t offset) {
+    fs_node_t *node = file_get(fd);
+    if (!node)
+        return -1;
+
+    int32_t ret = -1;
+
+    if (user_range(buf, len))
+        ret = node->flags == FS_PIPE ? (int32_t)fs_read(node, offset, len, buf)
+                                     : file_bounce_read(node, buf, len, offset);
+
+    file_put(node);
+    return ret;
+}
+
+int32_t file_write(uint32_t fd, uint8_t *buf, uint32_t len, uint32_t offset) {
+    fs_node_t *node = file_get(fd);
+    if (!node)
+        return -1;
+
+    int32_t ret = -1;
+
+    if (user_range(buf, len))
+        ret = node->flags == FS_PIPE ? (int32_t)fs_write(node, offset, len, buf)
+                                     : file_bounce_write(node, buf, len, offset);
+
+    file_put(node);
+    return ret;
+}
@@ -0,0 +1,228 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <core/cpu.h>
+#include <memory/memory.h>
+#include <memory/paging.h>
+#include <memory/vm.h>
+#include <task/futex.h>
+#include <task/scheduler.h>
+#include <task/thread.h>
+#include <task/uaccess.h>
+
+static futex_bucket_t buckets[FUTEX_BUCKETS];
+
+
+// A user word has to be aligned and in the user half
+static inline bool futex_valid(uint32_t *uaddr) {
+    return !((uint32_t)uaddr & 3) && (uint32_t)uaddr < VIRTUAL_BASE;
+}
+
+/**
+ * Find the key of a user word, the physical address it's at. Shared
+ * mappings give the same key in every process. The word is written first,
+ * so a copy-on-write page is copied now and not after a waiter went to sleep
+ * on the old frame.
+ * @param  uaddr user word
+ * @return       key, or 0 if the word isn't in writable user memory
+ */
+static uint32_t futex_key(uint32_t *uaddr) {
+    page_directory_t *pd = current_pd;
+
+    if (!touch_user(uaddr))
+        return 0;
+
+    // Another thread may have unmapped it since
+    uint32_t flags = spin_lock_irqsave(&pd->lock);
+    vm_region_t *region = vm_find(pd, (uint32_t)uaddr);
+    uint32_t phys = (uint32_t)-1;
+
+    if (region && (region->flags & (PT_RW | PT_USER)) == (PT_RW | PT_USER))
+        phys = get_phys(uaddr);
+
+    spin_unlock_irqrestore(&pd->lock, flags);
+    return phys == (uint32_t)-1 ? 0 : phys;
+}
+
+static inline futex_bucket_t *futex_bucket(uint32_t key) {
+    return &buckets[(key >> 2) * 0x9E3779B1u >> (32 - FUTEX_HASH_BITS)];
+}
+
+/**
+ * Sleep until woken, unless the word no longer holds the expected value.
+ * The value is checked with the bucket locked, so a waker changing it first
+ * can't be missed.
+ * @param  uaddr user word
+ * @param  val   value the caller saw
+ * @return       0 once woken, -1 if the value had changed
+ */
+static int32_t futex_wait(uint32_t *uaddr, uint32_t val) {
+    uint32_t key = futex_key(uaddr);
+    if (!key)
+        return -1;
+
+    futex_bucket_t *bucket = futex_bucket(key);
+    futex_waiter_t waiter = { .key = key, .thread = current_thread };
+
+    uint32_t flags = spin_lock_irqsave(&bucket->lock);
+    uint32_t now;
+
+    if (!copy_from_user(&now, uaddr, sizeof(now)) || now != val) {
+        spin_unlock_irqrestore(&bucket->lock, flags);
+        return -1;
+    }
+
+    waiter.next = bucket->head;
+    bucket->head = &waiter;
+
+    // Blocked before the lock is dropped, so a waker finds it that way
+    current_thread->state = THREAD_BLOCKED;
+
+    spin_unlock(&bucket->lock);
+    schedule();
+
+    irq_restore(flags);
+    return 0;
+}
+
+/**
+ * Take up to `max` waiters for a key off a bucket, which is locked
+ * @param  bucket bucket of the key
+ * @param  key    key
+ * @param  max    waiters to take at most
+ * @param  list   where the ones taken are linked
+ * @return        number taken
+ */
+static uint32_t futex_take(futex_bucket_t *bucket, uint32_t key, uint32_t max,
+                           futex_waiter_t **list) {
+    futex_waiter_t **link = &bucket->head;
+    uint32_t taken = 0;
+
+    while (*link && taken < max) {
+        futex_waiter_t *waiter = *link;
+
+        if (waiter->key != key) {
+            link = &waiter->next;
+            continue;
+        }
+
+        *link = waiter->next;
+        waiter->next = *list;
+        *list = waiter;
+        taken++;
+    }
+
+    return taken;
+}
+
+// Wake waiters taken off their bucket, whose entries vanish once they run
+static void futex_wake_list(futex_waiter_t *waiter) {
+    while (waiter) {
+        futex_waiter_t *next = waiter->next;
+        scheduler_wake(waiter->thread);
+        waiter = next;
+    }
+}
+
+/**
+ * Wake waiters on a user word
+ * @param  uaddr user word
+ * @param  max   waiters to wake at most
+ * @return       number woken
+ */
+static int32_t futex_wake(uint32_t *uaddr, uint32_t max) {
+    uint32_t key = futex_key(uaddr);
+    if (!key)
+        return -1;
+
+    futex_bucket_t *bucket = futex_bucket(key);
+    futex_waiter_t *woken = 0;
+
+    uint32_t flags = spin_lock_irqsave(&bucket->lock);
+    uint32_t count = futex_take(bucket, key, max, &woken);
+    spin_unlock(&bucket->lock);
+
+    futex_wake_list(woken);
+
+    irq_restore(flags);
+    return count;
+}
+
+/**
+ * Wake some waiters on a word and move others to wait on a second one, e.g.
+ * a condition variable's waiters to its mutex instead of waking them all
+ * @param  uaddr   user word waited on
+ * @param  wake    waiters to wake at most
+ * @param  uaddr2  user word to wait on instead
+ * @param  requeue waiters to move at most
+ * @return         number woken and moved
+ */
+static int32_t futex_requeue(uint32_t *uaddr, uint32_t wake, uint32_t *uaddr2, uint32_t requeue) {
+    uint32_t key = futex_key(uaddr);
+    uint32_t key2 = futex_key(uaddr2);
+    if (!key || !key2)
+        return -1;
+
+    futex_bucket_t *from = futex_bucket(key);
+    futex_bucket_t *to = futex_bucket(key2);
+    futex_waiter_t *woken = 0, *moved = 0;
+
+    // Two buckets are always locked in the same order
+    uint32_t flags = irq_save();
+    futex_bucket_t *first = from < to ? from : to;
+    futex_bucket_t *second = from < to ? to : from;
+
+    spin_lock(&first->lock);
+    if (from != to)
+        spin_lock(&second->lock);
+
+    uint32_t count = futex_take(from, key, wake, &woken);
+    uint32_t count2 = futex_take(from, key, requeue, &moved);
+
+    while (moved) {
+        futex_waiter_t *next = moved->next;
+        moved->key = key2;
+        moved->next = to->head;
+        to->head = moved;
+        moved = next;
+    }
+
+    if (from != to)
+        spin_unlock(&second->lock);
+    spin_unlock(&first->lock);
+
+    futex_wake_list(woken);
+
+    irq_restore(flags);
+    return count + count2;
+}
+
+/**
+ * Block on and wake threads through words in user memory, as a system call
+ * @param  uaddr  user word
+ * @param  op     FUTEX_WAIT, FUTEX_WAKE or FUTEX_REQUEUE
+ * @param  val    expected value for FUTEX_WAIT, waiters to wake otherwise
+ * @param  uaddr2 second word for FUTEX_REQUEUE
+ * @param  val2   waiters to move for FUTEX_REQUEUE
+ * @return        see the operation, -1 on error
+ */
+int32_t futex(uint32_t *uaddr, uint32_t op, uint32_t val, uint32_t *uaddr2, uint32_t val2) {
+    if (!futex_valid(uaddr))
+        return -1;
+
+    switch (op) {
+    case FUTEX_WAIT:
+        return futex_wait(uaddr, val);
+
+    case FUTEX_WAKE:
+        return futex_wake(uaddr, val);
+
+    case FUTEX_REQUEUE:
+        if (!futex_valid(uaddr2))
+            return -1;
+        return futex_requeue(uaddr, val, uaddr2, val2);
+
+    default:
+        return -1;
+    }
+}
@@ -0,0 +1,314 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <core/clock.h>
+#include <memory/memory.h>
+#include <memory/slab.h>
+#include <memory/vm.h>
+#include <task/file.h>
+#include <task/ioring.h>
+#include <task/scheduler.h>
+#include <task/thread.h>
+
+static kmem_cache_t *ring_cache;
+static kmem_cache_t *timeout_cache;
+
+// Entry arrays start this far into the ring's memory
+#define IORING_SQES_OFFSET  64
+
+
+void ioring_init() {
+    ring_cache = kmem_cache_create("ioring_t", sizeof(ioring_t), 4, 0);
+    timeout_cache = kmem_cache_create("ioring_timeout_t", sizeof(ioring_timeout_t), 4, 0);
+}
+
+// Give back the ring's memory, which nothing maps any more by now
+static void ioring_free(ioring_t *ring) {
+    // Allocator's reference to each frame, the mappings held their own
+    for (uint32_t i = 0; i < ring->pages; i++)
+        mem_free_frame(ring->frame + i);
+
+    kmem_cache_free(ring_cache, ring);
+}
+
+// Share a ring with another thread, or keep it for a pending operation
+ioring_t *ioring_get(ioring_t *ring) {
+    __sync_fetch_and_add(&ring->refs, 1);
+    return ring;
+}
+
+/**
+ * Drop a reference. The last one frees the ring, or leaves that to its
+ * polling thread, which may still be looking at it.
+ * @param ring ring
+ */
+void ioring_put(ioring_t *ring) {
+    if (__sync_sub_and_fetch(&ring->refs, 1))
+        return;
+
+    if (ring->poller) {
+        ring->dying = true;
+        wake_up(&ring->sq_wait);
+    } else {
+        ioring_free(ring);
+    }
+}
+
+// Completions user mode hasn't consumed yet
+static inline uint32_t cq_ready(ioring_t *ring) {
+    return ring->shared->cq_tail - ring->shared->cq_head;
+}
+
+// Submissions can be taken as long as their completions are sure to fit
+static inline bool sq_ready(ioring_t *ring) {
+    uint32_t queued = ring->shared->sq_tail - ring->sq_head;
+    return queued && queued <= ring->sq_entries &&
+           cq_ready(ring) + ring->inflight < ring->cq_entries;
+}
+
+/**
+ * Post a completion and wake whoever waits for one. Room for it was made
+ * sure of when the submission was taken.
+ * @param ring      ring
+ * @param user_data value from the submission
+ * @param res       result of the operation
+ */
+static void ioring_complete(ioring_t *ring, uint32_t user_data, int32_t res) {
+    uint32_t flags = spin_lock_irqsave(&ring->lock);
+
+    uint32_t tail = ring->shared->cq_tail;
+    ioring_cqe_t *cqe = &ring->cqes[tail & (ring->cq_entries - 1)];
+    cqe->user_data = user_data;
+    cqe->res = res;
+
+    // Entry has to be visible before the index that publishes it
+    asm volatile("" : : : "memory");
+    ring->shared->cq_tail = tail + 1;
+
+    spin_unlock_irqrestore(&ring->lock, flags);
+
+    wake_up(&ring->cq_wait);
+}
+
+static void ioring_timeout_fire(void *arg) {
+    ioring_timeout_t *timeout = (ioring_timeout_t *)arg;
+    ioring_t *ring = timeout->ring;
+
+    // Posted before the promise is dropped, so nobody takes its room meanwhile
+    ioring_complete(ring, timeout->user_data, 0);
+    __sync_fetch_and_sub(&ring->inflight, 1);
+
+    kmem_cache_free(timeout_cache, timeout);
+    ioring_put(ring);
+}
+
+// Carry out one submission taken off the ring. Timeouts complete later,
+// from their timer, the rest right away.
+static void ioring_issue(ioring_t *ring, ioring_sqe_t *sqe) {
+    int32_t res;
+
+    switch (sqe->opcode) {
+    case IORING_OP_NOP:
+        res = 0;
+        break;
+
+    case IORING_OP_READ:
+        res = file_read(sqe->fd, (uint8_t *)sqe->addr, sqe->len, sqe->off);
+        break;
+
+    case IORING_OP_WRITE:
+        res = file_write(sqe->fd, (uint8_t *)sqe->addr, sqe->len, sqe->off);
+        break;
+
+    case IORING_OP_TIMEOUT: {
+        ioring_timeout_t *timeout = (ioring_timeout_t *)kmem_cache_alloc(timeout_cache);
+        if (!timeout) {
+            res = -1;
+            break;
+        }
+
+        timeout->ring = ioring_get(ring);
+        timeout->user_data = sqe->user_data;
+
+        timer_setup(&timeout->timer, ioring_timeout_fire, timeout);
+        timer_mod(&timeout->timer, ktime_get_ns() + sqe->off);
+        return;
+    }
+
+    default:
+        res = -1;
+        break;
+    }
+
+    ioring_complete(ring, sqe->user_data, res);
+    __sync_fetch_and_sub(&ring->inflight, 1);
+}
+
+/**
+ * Take queued submissions off the ring and carry them out. The ring is
+ * only locked while an entry is taken, reads and writes may block.
+ * @param  ring ring
+ * @param  max  most submissions to take
+ * @return      number taken
+ */
+static uint32_t ioring_submit(ioring_t *ring, uint32_t max) {
+    uint32_t submitted = 0;
+
+    while (submitted < max) {
+        spin_lock(&ring->sq_lock);
+
+        if (!sq_ready(ring)) {
+            spin_unlock(&ring->sq_lock);
+            break;
+        }
+
+        // Entry is read only after the tail that published it, and copied
+        // as user mode may change it meanwhile
+        asm volatile("" : : : "memory");
+        ioring_sqe_t sqe = ring->sqes[ring->sq_head & (ring->sq_entries - 1)];
+
+        // Room for its completion is promised until it's posted
+        __sync_fetch_and_add(&ring->inflight, 1);
+
+        // Entry may be reused from here on
+        ring->shared->sq_head = ++ring->sq_head;
+        spin_unlock(&ring->sq_lock);
+
+        ioring_issue(ring, &sqe);
+        submitted++;
+    }
+
+    return submitted;
+}
+
+/**
+ * Polling thread of an IORING_SETUP_SQPOLL ring, running in the process's
+ * address space. Once there's been nothing to do for a while it sleeps,
+ * and sets IORING_SQ_NEED_WAKEUP for user mode to see. It frees the ring
+ * and exits after the last user is gone.
+ * @param arg ring
+ */
+static void ioring_poll(void *arg) {
+    ioring_t *ring = (ioring_t *)arg;
+    uint64_t idle_since = ktime_get_ns();
+
+    while (!ring->dying) {
+        if (ioring_submit(ring, ~0u)) {
+            idle_since = ktime_get_ns();
+            continue;
+        }
+
+        if (ktime_get_ns() - idle_since < IORING_POLL_IDLE) {
+            scheduler_yield();
+            continue;
+        }
+
+        // Locked operations are full barriers, user mode does the same
+        // between publishing a submission and looking at the flags
+        __sync_fetch_and_or(&ring->shared->flags, IORING_SQ_NEED_WAKEUP);
+        wait_event(&ring->sq_wait, sq_ready(ring) || ring->dying);
+        __sync_fetch_and_and(&ring->shared->flags, ~IORING_SQ_NEED_WAKEUP);
+
+        idle_since = ktime_get_ns();
+    }
+
+    ioring_free(ring);
+}
+
+/**
+ * Set up the calling process's submission and completion rings, mapped at
+ * IORING_BASE, as a system call
+ * @param  entries submission queue size, rounded up to a power of 2
+ * @param  flags   IORING_SETUP_* flags
+ * @return         user address of the ring's ioring_shared_t, or -1
+ */
+int32_t ioring_setup(uint32_t entries, uint32_t flags) {
+    thread_t *thread = current_thread;
+
+    if (thread->ioring || !entries || entries > IORING_MAX_ENTRIES)
+        return -1;
+
+    uint32_t sq_entries = 1;
+    while (sq_entries < entries)
+        sq_entries <<= 1;
+
+    uint32_t cqes = IORING_SQES_OFFSET + sq_entries * sizeof(ioring_sqe_t);
+    uint32_t size = cqes + 2 * sq_entries * sizeof(ioring_cqe_t);
+
+    uint32_t order = 0;
+    while ((uint32_t)PAGE_SIZE << order < size)
+        order++;
+
+    // The ring keeps the allocator's reference to each frame, the mappings
+    // take their own
+    uint32_t frame = mem_allocate_frames(order);
+    if (!frame)
+        return -1;
+
+    uint32_t pages = 1 << order;
+    uint8_t *mem = (uint8_t *)phys_to_virt(frame * PAGE_SIZE);
+    memset(mem, 0, pages * PAGE_SIZE);
+
+    if (!vm_map_shared(thread->pd, IORING_BASE, frame * PAGE_SIZE, pages, PT_RW | PT_USER, 0)) {
+        mem_free_frames(frame, order);
+        return -1;
+    }
+
+    ioring_t *ring = (ioring_t *)kmem_cache_alloc(ring_cache);
+    memset(ring, 0, sizeof(ioring_t));
+
+    ring->shared = (ioring_shared_t *)mem;
+    ring->sqes = (ioring_sqe_t *)(mem + IORING_SQES_OFFSET);
+    ring->cqes = (ioring_cqe_t *)(mem + cqes);
+    ring->frame = frame;
+    ring->pages = pages;
+    ring->sq_entries = sq_entries;
+    ring->cq_entries = 2 * sq_entries;
+    ring->refs = 1;
+
+    // User mode's copy of the layout, the kernel only trusts its own
+    ring->shared->sq_entries = ring->sq_entries;
+    ring->shared->cq_entries = ring->cq_entries;
+    ring->shared->sqes = IORING_SQES_OFFSET;
+    ring->shared->cqes = cqes;
+
+    thread->ioring = ring;
+
+    if (flags & IORING_SETUP_SQPOLL) {
+        ring->poller = construct_thread(ioring_poll, ring);
+        ring->poller->files = files_get(thread->files);
+        scheduler_add(ring->poller);
+    }
+
+    return IORING_BASE;
+}
+
+/**
+ * Submit queued entries and wait for completions, as a system call. With a
+ * polling thread nothing is submitted here, it can only be woken.
+ * @param  to_submit    most submissions to take
+ * @param  min_complete completions to wait for, counting ones not yet consumed
+ * @param  flags        IORING_ENTER_* flags
+ * @return              number of submissions taken, or -1
+ */
+int32_t ioring_enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+    ioring_t *ring = current_thread->ioring;
+    if (!ring)
+        return -1;
+
+    uint32_t submitted = 0;
+
+    if (!ring->poller)
+        submitted = ioring_submit(ring, to_submit);
+    else if (flags & IORING_ENTER_SQ_WAKEUP)
+        wake_up(&ring->sq_wait);
+
+    if (min_complete > ring->cq_entries)
+        min_complete = ring->cq_entries;
+
+    if (min_complete)
+        wait_event(&ring->cq_wait, cq_ready(ring) >= min_complete);
+
+    return submitted;
+}
@@ -0,0 +1,173 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <core/cpu.h>
+#include <core/spinlock.h>
+#include <task/ipc.h>
+#include <task/scheduler.h>
+#include <task/thread.h>
+
+// Every thread's message passing state
+static spinlock_t ipc_lock = SPINLOCK_INIT;
+
+
+// Append a thread to a list linked through ipc_next
+static void ipc_append(thread_t **list, thread_t *thread) {
+    while (*list)
+        list = &(*list)->ipc_next;
+
+    thread->ipc_next = 0;
+    *list = thread;
+}
+
+// Take a thread with a pid off a list, returning it or 0
+static thread_t *ipc_take(thread_t **list, uint32_t pid) {
+    for (; *list; list = &(*list)->ipc_next) {
+        thread_t *thread = *list;
+
+        if (thread->pid == pid) {
+            *list = thread->ipc_next;
+            thread->ipc_next = 0;
+            return thread;
+        }
+    }
+
+    return 0;
+}
+
+// Receive a queued caller's message, it then waits for the reply
+static void ipc_receive(thread_t *server, thread_t *client) {
+    memcpy(server->ipc_msg, client->ipc_msg, sizeof(server->ipc_msg));
+    server->ipc_from = client->pid;
+    ipc_append(&server->ipc_clients, client);
+}
+
+/**
+ * Send a message and wait for the reply, as a system call. If the receiver
+ * is waiting the CPU goes straight to it, the run queues aren't involved.
+ * @param  dest pid of the receiver
+ * @param  msg  IPC_WORDS words, replaced by the reply
+ * @return      0 once replied to, -1 if there's no receiver or it exited
+ */
+int32_t ipc_call(uint32_t dest, uint32_t *msg) {
+    thread_t *thread = current_thread;
+    uint32_t flags = spin_lock_irqsave(&ipc_lock);
+
+    // Exiting takes ipc_lock to set ipc_dead before the thread can be
+    // reaped, so one that isn't dead yet stays until the lock is dropped
+    thread_t *server = thread_find(dest);
+    bool alive = server && server != thread && !server->ipc_dead;
+    thread_find_done();
+
+    if (!alive) {
+        spin_unlock_irqrestore(&ipc_lock, flags);
+        return -1;
+    }
+
+    memcpy(thread->ipc_msg, msg, sizeof(thread->ipc_msg));
+    thread->ipc_status = -1;
+
+    // Blocked before the lock is dropped, so the reply can't be missed
+    thread->state = THREAD_BLOCKED;
+
+    if (server->ipc_receiving) {
+        server->ipc_receiving = false;
+        ipc_receive(server, thread);
+
+        spin_unlock(&ipc_lock);
+        scheduler_handoff(server);
+    } else {
+        ipc_append(&server->ipc_senders, thread);
+
+        spin_unlock(&ipc_lock);
+        schedule();
+    }
+
+    irq_restore(flags);
+
+    memcpy(msg, thread->ipc_msg, sizeof(thread->ipc_msg));
+    return thread->ipc_status;
+}
+
+/**
+ * Reply to a caller and wait for the next message, as a system call. If no
+ * message is queued the CPU goes straight back to the caller.
+ * @param  to  pid of the caller to reply to, 0 to only wait
+ * @param  msg IPC_WORDS words of the reply, replaced by the next message
+ * @return     pid of the next caller, -1 if there was no caller `to`
+ */
+int32_t ipc_reply_wait(uint32_t to, uint32_t *msg) {
+    thread_t *thread = current_thread;
+    uint32_t flags = spin_lock_irqsave(&ipc_lock);
+    thread_t *client = 0;
+
+    if (to) {
+        client = ipc_take(&thread->ipc_clients, to);
+        if (!client) {
+            spin_unlock_irqrestore(&ipc_lock, flags);
+            return -1;
+        }
+
+        memcpy(client->ipc_msg, msg, sizeof(client->ipc_msg));
+        client->ipc_status = 0;
+    }
+
+    thread_t *next = thread->ipc_senders;
+
+    if (next) {
+        thread->ipc_senders = next->ipc_next;
+        ipc_receive(thread, next);
+
+        spin_unlock(&ipc_lock);
+
+        if (client)
+            scheduler_wake(client);
+    } else {
+        thread->ipc_receiving = true;
+        thread->state = THREAD_BLOCKED;
+
+        spin_unlock(&ipc_lock);
+
+        if (client)
+            scheduler_handoff(client);
+        else
+            schedule();
+    }
+
+    irq_restore(flags);
+
+    memcpy(msg, thread->ipc_msg, sizeof(thread->ipc_msg));
+    return thread->ipc_from;
+}
+
+/**
+ * Fail every call waiting on an exiting thread and stop taking new ones
+ * @param thread current thread
+ */
+void ipc_exit(thread_t *thread) {
+    uint32_t flags = spin_lock_irqsave(&ipc_lock);
+
+    thread->ipc_dead = true;
+    thread->ipc_receiving = false;
+
+    thread_t *lists[] = { thread->ipc_senders, thread->ipc_clients };
+    thread->ipc_senders = 0;
+    thread->ipc_clients = 0;
+
+    spin_unlock(&ipc_lock);
+
+    // Their status is still -1
+    for (uint32_t i = 0; i < 2; i++) {
+        thread_t *client = lists[i];
+
+        while (client) {
+            thread_t *next = client->ipc_next;
+            client->ipc_next = 0;
+            scheduler_wake(client);
+            client = next;
+        }
+    }
+
+    irq_restore(flags);
+}
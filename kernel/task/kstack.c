@@ -0,0 +1,69 @@
+#include <stdint.h>
+
+#include <core/cpu.h>
+#include <core/spinlock.h>
+#include <memory/bitmap.h>
+#include <memory/memory.h>
+#include <memory/paging.h>
+#include <task/kstack.h>
+
+// Slots in use
+static uint32_t kstack_slots[KSTACK_SLOTS / 32];
+static spinlock_t kstack_lock = SPINLOCK_INIT;
+
+
+/**
+ * Allocate and map a kernel stack
+ * @return top of the new stack, or 0 if every slot is taken or out of memory
+ */
+uint32_t kstack_alloc() {
+    uint32_t flags = spin_lock_irqsave(&kstack_lock);
+    uint32_t slot = KSTACK_SLOTS;
+
+    for (uint32_t i = 0; i < KSTACK_SLOTS / 32; i++) {
+        if (kstack_slots[i] != 0xFFFFFFFF) {
+            slot = i * 32 + __builtin_ctz(~kstack_slots[i]);
+            break;
+        }
+    }
+
+    if (slot == KSTACK_SLOTS) {
+        spin_unlock_irqrestore(&kstack_lock, flags);
+        return 0;
+    }
+
+    bitmap_set(kstack_slots, slot);
+
+    // Page tables of the region are shared, so the stack is mapped everywhere
+    uint32_t base = KSTACK_BASE + slot * KSTACK_SLOT + PAGE_SIZE;
+    for (uint32_t page = base; page < base + KSTACK_SIZE; page += PAGE_SIZE) {
+        if (!map_page(page, PT_RW | PT_GLOBAL)) {
+            while (page > base) {
+                page -= PAGE_SIZE;
+                unmap_page(page);
+            }
+
+            bitmap_clear(kstack_slots, slot);
+            spin_unlock_irqrestore(&kstack_lock, flags);
+            return 0;
+        }
+    }
+
+    spin_unlock_irqrestore(&kstack_lock, flags);
+    return base + KSTACK_SIZE;
+}
+
+/**
+ * Unmap a kernel stack and return its slot
+ * @param top top of the stack, as returned by kstack_alloc()
+ */
+void kstack_free(uint32_t top) {
+    uint32_t flags = spin_lock_irqsave(&kstack_lock);
+    uint32_t base = top - KSTACK_SIZE;
+
+    for (uint32_t page = base; page < top; page += PAGE_SIZE)
+        unmap_page(page);
+
+    bitmap_clear(kstack_slots, (base - PAGE_SIZE - KSTACK_BASE) / KSTACK_SLOT);
+    spin_unlock_irqrestore(&kstack_lock, flags);
+}
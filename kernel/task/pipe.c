@@ -0,0 +1,365 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <memory/memory.h>
+#include <memory/paging.h>
+#include <memory/slab.h>
+#include <memory/vm.h>
+#include <task/pipe.h>
+#include <task/thread.h>
+#include <task/uaccess.h>
+
+static kmem_cache_t *pipe_cache;
+
+
+static void pipe_ctor(void *pipe) {
+    memset(pipe, 0, sizeof(pipe_t));
+}
+
+void pipe_init() {
+    pipe_cache = kmem_cache_create("pipe_t", sizeof(pipe_t), 4, pipe_ctor);
+}
+
+static inline bool page_aligned(const uint8_t *buf) {
+    return !((uint32_t)buf & (PAGE_SIZE - 1));
+}
+
+static inline uint8_t *slot_data(pipe_slot_t *slot) {
+    return (uint8_t *)phys_to_virt(slot->frame * PAGE_SIZE);
+}
+
+// Slot data can be appended to, if there is one
+static inline pipe_slot_t *pipe_last(pipe_t *pipe) {
+    if (pipe->tail == pipe->head)
+        return 0;
+
+    pipe_slot_t *slot = &pipe->slots[(pipe->tail - 1) % PIPE_SLOTS];
+    return slot->owned && slot->end < PAGE_SIZE ? slot : 0;
+}
+
+static inline bool pipe_full(pipe_t *pipe) {
+    return pipe->tail - pipe->head == PIPE_SLOTS;
+}
+
+/**
+ * Take a frame from the writer's address space instead of copying it. The
+ * writer's mapping turns copy-on-write, so it can't change what the pipe
+ * holds, and only pays for a copy if it writes to the page again.
+ * @param  virt page aligned user address
+ * @return      frame with a reference for the pipe, or 0 to copy instead
+ */
+static uint32_t pipe_gift(uint32_t virt) {
+    page_directory_t *pd = current_pd;
+    uint8_t byte;
+
+    // Paged in, so its page table exists
+    if (!copy_from_user(&byte, (void *)virt, 1))
+        return 0;
+
+    // Another thread may have unmapped it since
+    uint32_t flags = spin_lock_irqsave(&pd->lock);
+    vm_region_t *region = vm_find(pd, virt);
+    uint32_t frame = 0;
+
+    // Shared memory would still change under the pipe
+    if (!region || !(region->flags & PT_USER) || (region->flags & PT_SHARED) ||
+        !(*pde_of(virt) & PT_PRESENT)) {
+        spin_unlock_irqrestore(&pd->lock, flags);
+        return 0;
+    }
+
+    uint32_t *pte = pte_of(virt);
+
+    if ((*pte & PT_PRESENT) && mem_ref_frame(*pte / PAGE_SIZE)) {
+        frame = *pte / PAGE_SIZE;
+
+        if (*pte & PT_RW) {
+            *pte = (*pte & ~PT_RW) | PT_COW;
+            tlb_shootdown(pd, virt);
+        }
+    }
+
+    spin_unlock_irqrestore(&pd->lock, flags);
+    return frame;
+}
+
+/**
+ * Map a full page of the pipe into the reader's buffer instead of copying
+ * it. The frame's reference goes to the mapping, which is copy-on-write as
+ * the writer may still have it too.
+ * @param  virt  page aligned user address
+ * @param  frame frame to map
+ * @return       false to copy instead
+ */
+static bool pipe_flip(uint32_t virt, uint32_t frame) {
+    page_directory_t *pd = current_pd;
+    uint8_t byte;
+
+    if (!copy_from_user(&byte, (void *)virt, 1))
+        return false;
+
+    uint32_t flags = spin_lock_irqsave(&pd->lock);
+    vm_region_t *region = vm_find(pd, virt);
+
+    if (!region || (region->flags & (PT_RW | PT_USER)) != (PT_RW | PT_USER) ||
+        (region->flags & PT_SHARED) || !(*pde_of(virt) & PT_PRESENT)) {
+        spin_unlock_irqrestore(&pd->lock, flags);
+        return false;
+    }
+
+    uint32_t *pte = pte_of(virt);
+    uint32_t old = *pte;
+
+    *pte = frame * PAGE_SIZE | (region->flags & 0xFFF & ~PT_RW) | PT_PRESENT | PT_COW;
+    tlb_shootdown(pd, virt);
+
+    spin_unlock_irqrestore(&pd->lock, flags);
+
+    if (old & PT_PRESENT)
+        mem_free_frame(old / PAGE_SIZE);
+
+    return true;
+}
+
+/**
+ * Put as much of a user buffer in the pipe as fits, with the pipe locked.
+ * Whole aligned pages are taken from the writer, the rest is copied.
+ * @param  pipe  pipe
+ * @param  buf   user buffer
+ * @param  size  bytes left to write
+ * @param  fault set if the buffer isn't all there
+ * @return       bytes taken
+ */
+static uint32_t pipe_fill(pipe_t *pipe, uint8_t *buf, uint32_t size, bool *fault) {
+    uint32_t done = 0;
+
+    while (done < size) {
+        uint32_t frame;
+        pipe_slot_t *slot = pipe_last(pipe);
+
+        if (!slot && pipe_full(pipe))
+            break;
+
+        if (!slot && page_aligned(buf + done) && size - done >= PAGE_SIZE &&
+            (frame = pipe_gift((uint32_t)(buf + done)))) {
+            slot = &pipe->slots[pipe->tail++ % PIPE_SLOTS];
+            slot->frame = frame;
+            slot->start = 0;
+            slot->end = PAGE_SIZE;
+            slot->owned = false;
+
+            done += PAGE_SIZE;
+            continue;
+        }
+
+        if (!slot) {
+            frame = mem_allocate_frame();
+            if (!frame)
+                break;
+
+            slot = &pipe->slots[pipe->tail++ % PIPE_SLOTS];
+            slot->frame = frame;
+            slot->start = 0;
+            slot->end = 0;
+            slot->owned = true;
+        }
+
+        uint32_t n = PAGE_SIZE - slot->end;
+        if (n > size - done)
+            n = size - done;
+
+        if (!copy_from_user(slot_data(slot) + slot->end, buf + done, n)) {
+            *fault = true;
+            break;
+        }
+
+        slot->end += n;
+        done += n;
+    }
+
+    return done;
+}
+
+/**
+ * Move as much of the pipe to a user buffer as there is, with the pipe
+ * locked. Full pages are mapped into aligned buffers, the rest is copied.
+ * @param  pipe  pipe
+ * @param  buf   user buffer
+ * @param  size  bytes wanted
+ * @param  fault set if the buffer isn't all there
+ * @return       bytes read
+ */
+static uint32_t pipe_drain(pipe_t *pipe, uint8_t *buf, uint32_t size, bool *fault) {
+    uint32_t done = 0;
+
+    while (done < size && pipe->head != pipe->tail) {
+        pipe_slot_t *slot = &pipe->slots[pipe->head % PIPE_SLOTS];
+
+        if (slot->start == 0 && slot->end == PAGE_SIZE && page_aligned(buf + done) &&
+            size - done >= PAGE_SIZE && pipe_flip((uint32_t)(buf + done), slot->frame)) {
+            pipe->head++;
+            done += PAGE_SIZE;
+            continue;
+        }
+
+        uint32_t n = slot->end - slot->start;
+        if (n > size - done)
+            n = size - done;
+
+        if (!copy_to_user(buf + done, slot_data(slot) + slot->start, n)) {
+            *fault = true;
+            break;
+        }
+
+        slot->start += n;
+        done += n;
+
+        // Used up, even if the writer could still have appended to it
+        if (slot->start == slot->end) {
+            mem_free_frame(slot->frame);
+            pipe->head++;
+        }
+    }
+
+    return done;
+}
+
+static inline bool pipe_writable(pipe_t *pipe) {
+    return !pipe->readers || !pipe_full(pipe) || pipe_last(pipe);
+}
+
+static inline bool pipe_readable(pipe_t *pipe) {
+    return !pipe->writers || pipe->head != pipe->tail;
+}
+
+/**
+ * Write the whole buffer, blocking while the pipe is full
+ * @return bytes written, or -1 if nobody can read them or the buffer is bad
+ */
+static uint32_t pipe_write(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
+    (void)offset;
+    pipe_t *pipe = (pipe_t *)node->impl;
+    uint32_t done = 0;
+    bool fault = false;
+
+    while (done < size && !fault) {
+        wait_event(&pipe->write_wait, pipe_writable(pipe));
+
+        uint32_t flags = spin_lock_irqsave(&pipe->lock);
+
+        if (!pipe->readers) {
+            spin_unlock_irqrestore(&pipe->lock, flags);
+            return done ? done : (uint32_t)-1;
+        }
+
+        done += pipe_fill(pipe, buffer + done, size - done, &fault);
+
+        spin_unlock_irqrestore(&pipe->lock, flags);
+        wake_up(&pipe->read_wait);
+    }
+
+    return fault && !done ? (uint32_t)-1 : done;
+}
+
+/**
+ * Read what's there, blocking until there is something
+ * @return bytes read, 0 once every writer is gone and the pipe is empty, or
+ *         -1 if the buffer is bad
+ */
+static uint32_t pipe_read(fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer) {
+    (void)offset;
+    pipe_t *pipe = (pipe_t *)node->impl;
+    uint32_t done;
+    bool writers, fault = false;
+
+    // Another reader, e.g. after fork(), may empty the pipe after the wakeup
+    do {
+        wait_event(&pipe->read_wait, pipe_readable(pipe));
+
+        uint32_t flags = spin_lock_irqsave(&pipe->lock);
+        done = pipe_drain(pipe, buffer, size, &fault);
+        writers = pipe->writers;
+        spin_unlock_irqrestore(&pipe->lock, flags);
+    } while (!done && size && writers && !fault);
+
+    wake_up(&pipe->write_wait);
+    return fault && !done ? (uint32_t)-1 : done;
+}
+
+// Another descriptor refers to an end, e.g. after fork(), or a read or write
+// is about to use it
+static void pipe_open(fs_node_t *node) {
+    pipe_t *pipe = (pipe_t *)node->impl;
+    uint32_t flags = spin_lock_irqsave(&pipe->lock);
+
+    if (node == &pipe->read_node)
+        pipe->readers++;
+    else
+        pipe->writers++;
+
+    spin_unlock_irqrestore(&pipe->lock, flags);
+}
+
+// A descriptor of an end is closed or a read or write is done with it, the
+// pipe goes with the last one
+static void pipe_close(fs_node_t *node) {
+    pipe_t *pipe = (pipe_t *)node->impl;
+    uint32_t flags = spin_lock_irqsave(&pipe->lock);
+
+    if (node == &pipe->read_node)
+        pipe->readers--;
+    else
+        pipe->writers--;
+
+    bool last = !pipe->readers && !pipe->writers;
+
+    // The other side stops waiting for this one. Woken with the pipe locked,
+    // as the last close may free it as soon as the lock is dropped.
+    if (!last) {
+        wake_up(&pipe->read_wait);
+        wake_up(&pipe->write_wait);
+    }
+
+    spin_unlock_irqrestore(&pipe->lock, flags);
+
+    if (!last)
+        return;
+
+    for (; pipe->head != pipe->tail; pipe->head++)
+        mem_free_frame(pipe->slots[pipe->head % PIPE_SLOTS].frame);
+
+    pipe_ctor(pipe);
+    kmem_cache_free(pipe_cache, pipe);
+}
+
+/**
+ * Create a pipe, open once at each end
+ * @param  read  where the end to read from is returned
+ * @param  write where the end to write to is returned
+ * @return       0, or -1 if out of memory
+ */
+int32_t pipe_create(fs_node_t **read, fs_node_t **write) {
+    pipe_t *pipe = (pipe_t *)kmem_cache_alloc(pipe_cache);
+    if (!pipe)
+        return -1;
+
+    pipe->readers = 1;
+    pipe->writers = 1;
+
+    fs_node_t *nodes[] = { &pipe->read_node, &pipe->write_node };
+    for (uint32_t i = 0; i < 2; i++) {
+        strcpy(nodes[i]->name, "pipe");
+        nodes[i]->flags = FS_PIPE;
+        nodes[i]->impl = (uint32_t)pipe;
+        nodes[i]->open = pipe_open;
+        nodes[i]->close = pipe_close;
+    }
+
+    pipe->read_node.read = pipe_read;
+    pipe->write_node.write = pipe_write;
+
+    *read = &pipe->read_node;
+    *write = &pipe->write_node;
+    return 0;
+}
@@ -1,78 +1,579 @@
 #include <memory/paging.h>
+#include <core/apic.h>
+#include <core/clock.h>
+#include <core/cpu.h>
+#include <core/smp.h>
+#include <core/timer.h>
 #include <task/scheduler.h>
 
-scheduler_queue_t *queue;
+// Scheduling state of every CPU, indexed by cpu_t.id
+static sched_cpu_t rqs[SMP_MAX_CPUS];
+
+// Bit `c` is set while CPU c has nothing to run but its idle thread
+static volatile uint32_t idle_cpus;
+
+static void boost(void *arg);
+static void run(sched_cpu_t *rq, thread_t *next);
+static thread_t *pick(sched_cpu_t *rq);
+
+static inline sched_cpu_t *this_rq() {
+	return &rqs[this_cpu()->id];
+}
+
+/**
+ * Halt the CPU until an interrupt makes some thread runnable, here or on a
+ * CPU with threads to spare
+ */
+void scheduler_idle() {
+	sched_cpu_t *rq = this_rq();
+
+	asm volatile("cli");
+	__sync_fetch_and_or(&idle_cpus, 1 << this_cpu()->id);
+
+	for (;;) {
+		spin_lock(&rq->lock);
+
+		thread_t *next = pick(rq);
+		if (next != rq->idle) {
+			run(rq, next);
+			continue;
+		}
+
+		spin_unlock(&rq->lock);
+
+		// An interrupt arriving after the check is delayed until hlt by sti
+		uint64_t start = rdtsc();
+		asm volatile("sti; hlt; cli");
+		rq->idle_cycles += rdtsc() - start;
+	}
+}
+
+static void quantum_expired(void *rq) {
+	((sched_cpu_t *)rq)->need_resched = true;
+}
+
+static void init_rq(sched_cpu_t *rq) {
+	timer_setup(&rq->quantum_timer, quantum_expired, rq);
+	timer_setup(&rq->boost_timer, boost, rq);
+}
+
+static void resched_ipi(registers_t *r);
 
 void multitask_init() {
-	// Move kernel stack to uniform location
-	move_stack(KSTACK, KSTACK_LIM);
+	sched_cpu_t *rq = this_rq();
 
-	// Initialize and schedule first thread
-	//queue = (scheduler_queue_t *)kmalloc(sizeof(scheduler_queue_t));
-	scheduler_add(thread_init());
+	// Initialize first thread, it's already running
+	thread_init();
+	current_thread->slice_start = ktime_get_ns();
 
-	// Initialize PIT for task switching
-	irq_install_handler(0, preempt);
+	rq->idle = construct_thread(scheduler_idle, 0);
+	rq->idle->cpu = this_cpu()->id;
 
-	uint32_t divisor = 1193180 / 50;
-	
-	outportb(0x43, 0x36);					// Command byte.
+	init_rq(rq);
+	isr_install_handler(IPI_RESCHED_VECTOR, resched_ipi);
 
-	outportb(0x40, divisor & 0xFF);			// Low byte
-	outportb(0x40, (divisor>>8) & 0xFF);	// High byte
+	reaper_init();
 }
 
-void scheduler_add(thread_t *thread) {
-	// queue->thread[queue->total++] = thread;
-	// printf("scheduler_add total: %d\n", queue->total);
-	
-	if (thread_queue == 0) {
-		thread_queue = thread;
-		thread->next = 0;
+/**
+ * Make the code running on an application processor its idle thread and
+ * start scheduling threads on it
+ * @param esp0 top of the stack the processor runs on
+ */
+void scheduler_start_cpu(uint32_t esp0) {
+	sched_cpu_t *rq = this_rq();
+
+	init_rq(rq);
+	rq->idle = thread_adopt(esp0);
+	rq->idle->slice_start = ktime_get_ns();
+
+	// Threads may be placed here from now on
+	this_cpu()->online = true;
+
+	scheduler_idle();
+}
+
+static inline bool is_queued(sched_cpu_t *rq, thread_t *thread) {
+	return thread->prev || rq->queue[thread->priority].head == thread;
+}
+
+// Queue a thread behind others of the same priority
+static void enqueue(sched_cpu_t *rq, thread_t *thread) {
+	run_queue_t *q = &rq->queue[thread->priority];
+
+	thread->next = 0;
+	thread->prev = q->tail;
+
+	if (q->tail)
+		q->tail->next = thread;
+	else
+		q->head = thread;
+
+	q->tail = thread;
+	rq->bitmap |= 1 << thread->priority;
+	rq->nr_queued++;
+}
+
+// Unlink a thread from the run queue of its level
+static void dequeue(sched_cpu_t *rq, thread_t *thread) {
+	run_queue_t *q = &rq->queue[thread->priority];
+
+	if (thread->prev)
+		thread->prev->next = thread->next;
+	else
+		q->head = thread->next;
+
+	if (thread->next)
+		thread->next->prev = thread->prev;
+	else
+		q->tail = thread->prev;
+
+	if (!q->head)
+		rq->bitmap &= ~(1 << thread->priority);
+
+	rq->nr_queued--;
+
+	thread->next = 0;
+	thread->prev = 0;
+}
+
+/**
+ * Take the most important waiting thread off the busiest other CPU. Its lock
+ * is only tried, so two CPUs stealing from each other can't deadlock.
+ * @return thread now belonging to this CPU, 0 if there was none to take
+ */
+static thread_t *steal() {
+	uint32_t me = this_cpu()->id;
+	sched_cpu_t *victim = 0;
+
+	for (uint32_t c = 0; c < cpu_count; c++) {
+		if (c == me || !rqs[c].nr_queued)
+			continue;
+
+		if (!victim || rqs[c].nr_queued > victim->nr_queued)
+			victim = &rqs[c];
+	}
+
+	if (!victim || !spin_trylock(&victim->lock))
+		return 0;
+
+	// Threads still being switched away from can't move yet, nor can the
+	// one whose registers are live in the victim's FPU
+	thread_t *thread = 0;
+	thread_t *fpu_owner = cpus[victim - rqs].fpu_owner;
+	for (uint32_t map = victim->bitmap; map && !thread; map &= map - 1) {
+		for (thread = victim->queue[__builtin_ctz(map)].head; thread; thread = thread->next) {
+			if (!thread->on_cpu && thread != fpu_owner)
+				break;
+		}
+	}
+
+	if (thread) {
+		dequeue(victim, thread);
+		thread->cpu = me;
+	}
+
+	spin_unlock(&victim->lock);
+	return thread;
+}
+
+/**
+ * Take the most important runnable thread off this CPU's run queues, or
+ * steal one if they're empty
+ * @param  rq run queues of the current CPU, locked
+ * @return    thread to run next, the idle thread if nothing else is runnable
+ */
+static thread_t *pick(sched_cpu_t *rq) {
+	if (rq->bitmap) {
+		thread_t *next = rq->queue[__builtin_ctz(rq->bitmap)].head;
+		dequeue(rq, next);
+		return next;
+	}
+
+	thread_t *next = steal();
+	return next ? next : rq->idle;
+}
+
+// Charge the running thread for the time since it got the CPU
+static void account(thread_t *thread, uint64_t now) {
+	thread->runtime += now - thread->slice_start;
+	thread->slice_start = now;
+}
+
+// End the running thread's quantum when it's used up, if anyone is waiting
+static void arm_quantum(sched_cpu_t *rq, thread_t *thread, uint64_t now) {
+	if (thread == rq->idle || !rq->bitmap) {
+		timer_del(&rq->quantum_timer);
 		return;
 	}
 
-	thread_t *iterator = thread_queue;
-	while (iterator->next != 0)
-		iterator = iterator->next;
+	uint64_t quantum = SCHED_QUANTUM(thread->priority);
+	uint64_t left = thread->runtime < quantum ? quantum - thread->runtime : 0;
+	timer_mod(&rq->quantum_timer, now + left);
+}
 
-	iterator->next = thread;
-	thread->next = 0;
+// Give the CPU to `next`, the current thread has been accounted for. The
+// run queues are unlocked before switching.
+static void run(sched_cpu_t *rq, thread_t *next) {
+	uint64_t now = ktime_get_ns();
+	uint32_t bit = 1 << this_cpu()->id;
+
+	spin_unlock(&rq->lock);
+
+	if (next == rq->idle)
+		__sync_fetch_and_or(&idle_cpus, bit);
+	else
+		__sync_fetch_and_and(&idle_cpus, ~bit);
 
-	// thread->next = thread_queue;
-	// thread_queue = thread;
+	next->slice_start = now;
+	arm_quantum(rq, next, now);
+	switch_thread(next);
 }
 
-void scheduler_remove(thread_t *thread) {
-	// If thread if the first in queue
-	if (thread == thread_queue) {
-		thread_queue = thread_queue->next;
+// A thread was queued on this CPU. The running one gets to finish its
+// quantum unless the new one is more important, and an idle CPU is woken
+// to take the new one if there is one.
+static void check_preempt(sched_cpu_t *rq, uint8_t priority) {
+	thread_t *running = current_thread;
+	if (!running || running == rq->idle)
 		return;
+
+	uint64_t now = ktime_get_ns();
+
+	if (priority < running->priority)
+		timer_mod(&rq->quantum_timer, now);
+	else if (!timer_pending(&rq->quantum_timer))
+		arm_quantum(rq, running, now);
+
+	if (!timer_pending(&rq->boost_timer))
+		timer_mod(&rq->boost_timer, now + SCHED_BOOST);
+
+	uint32_t idle = idle_cpus;
+	if (idle)
+		smp_send_resched(&cpus[__builtin_ctz(idle)]);
+}
+
+// Another CPU queued a thread here, or has threads to spare
+static void resched_ipi(registers_t *r) {
+	(void)r;
+	apic_eoi();
+
+	sched_cpu_t *rq = this_rq();
+	if (rq->bitmap)
+		check_preempt(rq, __builtin_ctz(rq->bitmap));
+}
+
+// Move every waiting thread to the top level, so long running ones get to run
+static void boost(void *arg) {
+	sched_cpu_t *rq = (sched_cpu_t *)arg;
+
+	spin_lock(&rq->lock);
+
+	for (uint32_t l = 1; l < SCHED_LEVELS; l++) {
+		while (rq->queue[l].head) {
+			thread_t *thread = rq->queue[l].head;
+			dequeue(rq, thread);
+			thread->priority = 0;
+			thread->runtime = 0;
+			enqueue(rq, thread);
+		}
 	}
 
-	thread_t *iterator = thread_queue;
-	while (iterator) {
-		if (iterator->next == thread)
-			iterator->next = iterator->next->next;
-		else
-			iterator = iterator->next;
+	spin_unlock(&rq->lock);
+
+	if (current_thread != rq->idle) {
+		current_thread->priority = 0;
+		current_thread->runtime = 0;
+	}
+
+	if (rq->bitmap)
+		timer_mod(&rq->boost_timer, ktime_get_ns() + SCHED_BOOST);
+}
+
+// CPU for a thread that hasn't run yet, an idle one or else the least busy
+static uint8_t place() {
+	uint32_t idle = idle_cpus;
+	if (idle)
+		return __builtin_ctz(idle);
+
+	uint8_t best = this_cpu()->id;
+	for (uint32_t c = 0; c < cpu_count; c++) {
+		if (cpus[c].online && rqs[c].nr_queued < rqs[best].nr_queued)
+			best = c;
+	}
+
+	return best;
+}
+
+// Queue a runnable thread on its CPU and let that CPU know
+static void activate(thread_t *thread) {
+	if (thread->cpu == SCHED_ANY_CPU)
+		thread->cpu = place();
+
+	sched_cpu_t *rq = &rqs[thread->cpu];
+
+	spin_lock(&rq->lock);
+	enqueue(rq, thread);
+	spin_unlock(&rq->lock);
+
+	if (rq == this_rq())
+		check_preempt(rq, thread->priority);
+	else
+		smp_send_resched(&cpus[thread->cpu]);
+}
+
+/**
+ * Make a thread runnable, it's queued behind others of the same priority
+ * on the CPU it last ran on
+ * @param thread thread that's not running and not queued
+ */
+void scheduler_add(thread_t *thread) {
+	uint32_t flags = irq_save();
+
+	if (thread->cpu == SCHED_ANY_CPU || thread != rqs[thread->cpu].idle)
+		activate(thread);
+
+	irq_restore(flags);
+}
+
+void scheduler_remove(thread_t *thread) {
+	uint32_t flags = irq_save();
+	sched_cpu_t *rq;
+
+	if (thread->cpu != SCHED_ANY_CPU) {
+		rq = &rqs[thread->cpu];
+		spin_lock(&rq->lock);
+		if (is_queued(rq, thread))
+			dequeue(rq, thread);
+		spin_unlock(&rq->lock);
 	}
 
 	// Skip thread immediately if running
-	if (thread == current_thread)
-		preempt();
+	if (thread == current_thread) {
+		rq = this_rq();
+		spin_lock(&rq->lock);
+		run(rq, pick(rq));
+	}
+
+	irq_restore(flags);
+}
+
+/**
+ * Switch threads on the way out of the timer interrupt if the quantum timer
+ * fired. A thread that used up its quantum is moved down a level, since it's
+ * most likely not interactive.
+ */
+void preempt() {
+	sched_cpu_t *rq = this_rq();
+	thread_t *thread = current_thread;
+
+	if (!rq->need_resched || !thread)
+		return;
+
+	rq->need_resched = false;
+	spin_lock(&rq->lock);
+
+	if (thread == rq->idle) {
+		if (rq->bitmap)
+			run(rq, pick(rq));
+		else
+			spin_unlock(&rq->lock);
+		return;
+	}
+
+	uint64_t now = ktime_get_ns();
+	account(thread, now);
+
+	if (thread->runtime >= SCHED_QUANTUM(thread->priority)) {
+		if (thread->priority < SCHED_LEVELS - 1)
+			thread->priority++;
+
+		thread->runtime = 0;
+	} else if (!(rq->bitmap & ((1 << thread->priority) - 1))) {
+		// Nothing more important is waiting after all
+		spin_unlock(&rq->lock);
+		arm_quantum(rq, thread, now);
+		return;
+	}
+
+	enqueue(rq, thread);
+	run(rq, pick(rq));
+}
+
+// Threads that get off the CPU before using half their quantum move up a level
+static void reward_early(thread_t *thread) {
+	account(thread, ktime_get_ns());
+
+	if (thread->runtime < SCHED_QUANTUM(thread->priority) / 2 && thread->priority > 0)
+		thread->priority--;
+
+	thread->runtime = 0;
 }
 
-thread_t *scheduler_next() {
-	// if (++queue->current >= queue->total)
-	// 	queue->current = 0;
+/**
+ * Give up the CPU. A thread that's no longer runnable stays off the run
+ * queues until it's woken, which may already have happened on another CPU.
+ */
+void schedule() {
+	uint32_t flags = irq_save();
+	sched_cpu_t *rq = this_rq();
+	thread_t *thread = current_thread;
+
+	spin_lock(&rq->lock);
 
-	// return queue->thread[queue->current];
+	// Threads that mostly wait, e.g. for input, are interactive. One that's
+	// queued again keeps its level, the queue is sorted by it.
+	if (!is_queued(rq, thread))
+		reward_early(thread);
 
-	thread_t *next;
-	next = current_thread->next;
-	if (next == 0)
-		next = thread_queue;
+	if (thread->state == THREAD_RUNNABLE && !is_queued(rq, thread))
+		enqueue(rq, thread);
 
-	return next;
-}
\ No newline at end of file
+	run(rq, pick(rq));
+
+	irq_restore(flags);
+}
+
+/**
+ * Give up the rest of the quantum. Yielding early moves the thread up a
+ * level, so it gets in quicker next time.
+ */
+void scheduler_yield() {
+	schedule();
+}
+
+/**
+ * Take the current thread off the CPU until scheduler_wake() is called on it
+ * @param state why the thread stops running
+ */
+void scheduler_block(uint8_t state) {
+	uint32_t flags = irq_save();
+
+	current_thread->state = state;
+	schedule();
+
+	irq_restore(flags);
+}
+
+/**
+ * Make a blocked or sleeping thread runnable again, on the CPU it ran on
+ * @param thread thread to wake, nothing happens if it's runnable already
+ */
+void scheduler_wake(thread_t *thread) {
+	uint32_t flags = irq_save();
+	sched_cpu_t *rq = &rqs[thread->cpu];
+	uint8_t cpu = thread->cpu;
+	uint8_t priority = thread->priority;
+	bool woken = false;
+
+	spin_lock(&rq->lock);
+
+	if (thread->state == THREAD_BLOCKED || thread->state == THREAD_SLEEPING) {
+		thread->state = THREAD_RUNNABLE;
+		enqueue(rq, thread);
+		woken = true;
+	}
+
+	spin_unlock(&rq->lock);
+
+	// It may be running already, don't look at it again
+	if (woken && rq == this_rq())
+		check_preempt(rq, priority);
+	else if (woken)
+		smp_send_resched(&cpus[cpu]);
+
+	irq_restore(flags);
+}
+
+/**
+ * Switch straight to a blocked thread, e.g. the receiver of a message,
+ * without going through the run queues. It gets the rest of the current
+ * thread's quantum and level, as if the current one went on running. If
+ * something else woke it meanwhile, it's only woken and the current thread
+ * gives up the CPU the usual way.
+ * @param next blocked thread, not queued anywhere
+ */
+void scheduler_handoff(thread_t *next) {
+	uint32_t flags = irq_save();
+	cpu_t *cpu = this_cpu();
+	thread_t *thread = current_thread;
+	uint8_t target = next->cpu;
+	bool claimed = false;
+
+	// Its FPU registers may still be in another CPU, let that one run it
+	if (target != SCHED_ANY_CPU &&
+	    (target == cpu->id || cpus[target].fpu_owner != next)) {
+		// It may only just have blocked on another CPU, which needs no lock
+		// to finish switching away from it
+		while (next->on_cpu) {
+			tlb_poll();
+			cpu_relax();
+		}
+
+		// Taken under the lock scheduler_wake() takes, so only one of them
+		// gets it
+		sched_cpu_t *rq = &rqs[target];
+		spin_lock(&rq->lock);
+
+		if (next->state == THREAD_BLOCKED && !next->on_cpu) {
+			next->state = THREAD_RUNNABLE;
+			next->cpu = cpu->id;
+			claimed = true;
+		}
+
+		spin_unlock(&rq->lock);
+	}
+
+	if (!claimed) {
+		scheduler_wake(next);
+		schedule();
+		irq_restore(flags);
+		return;
+	}
+
+	account(thread, ktime_get_ns());
+
+	next->priority = thread->priority;
+	next->runtime = thread->runtime;
+	thread->runtime = 0;
+
+	// Like any other switch, so the idle mask and quantum timer follow
+	sched_cpu_t *rq = this_rq();
+	spin_lock(&rq->lock);
+	run(rq, next);
+
+	irq_restore(flags);
+}
+
+static void sleep_expired(void *thread) {
+	scheduler_wake((thread_t *)thread);
+}
+
+/**
+ * Put the current thread to sleep
+ * @param ns time to sleep for at least
+ */
+void scheduler_sleep(uint64_t ns) {
+	uint32_t flags = irq_save();
+	thread_t *thread = current_thread;
+
+	timer_setup(&thread->sleep_timer, sleep_expired, thread);
+	timer_mod(&thread->sleep_timer, ktime_get_ns() + ns);
+
+	scheduler_block(THREAD_SLEEPING);
+
+	irq_restore(flags);
+}
+
+/**
+ * Time every CPU spent halted with nothing to run
+ * @return TSC cycles
+ */
+uint64_t scheduler_idle_cycles() {
+	uint64_t cycles = 0;
+
+	for (uint32_t c = 0; c < cpu_count; c++)
+		cycles += rqs[c].idle_cycles;
+
+	return cycles;
+}
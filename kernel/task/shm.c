@@ -0,0 +1,206 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <core/spinlock.h>
+#include <memory/memory.h>
+#include <memory/paging.h>
+#include <memory/vm.h>
+#include <task/shm.h>
+#include <task/thread.h>
+#include <task/uaccess.h>
+
+static shm_t segments[SHM_MAX];
+static spinlock_t shm_lock = SPINLOCK_INIT;
+
+
+// Drop a reference with the segments locked, freeing the segment with the
+// last one. The frames stay as long as a page table still maps them.
+static void shm_release(shm_t *shm) {
+    if (--shm->refs)
+        return;
+
+    for (uint32_t i = 0; i < 1u << shm->order; i++)
+        mem_free_frame(shm->frame + i);
+
+    memset(shm, 0, sizeof(shm_t));
+}
+
+/**
+ * Take another reference to a segment, for a region mapping it
+ * @param shm segment, held by the caller already
+ */
+void shm_get(shm_t *shm) {
+    uint32_t flags = spin_lock_irqsave(&shm_lock);
+    shm->refs++;
+    spin_unlock_irqrestore(&shm_lock, flags);
+}
+
+/**
+ * Drop a reference to a segment, e.g. once a region mapping it is gone
+ * @param shm segment
+ */
+void shm_put(shm_t *shm) {
+    uint32_t flags = spin_lock_irqsave(&shm_lock);
+    shm_release(shm);
+    spin_unlock_irqrestore(&shm_lock, flags);
+}
+
+/**
+ * Drop the references of the segments an address space created, as its
+ * mappings are torn down
+ * @param pd address space
+ */
+void shm_exit(page_directory_t *pd) {
+    uint32_t flags = spin_lock_irqsave(&shm_lock);
+
+    for (uint32_t id = 0; id < SHM_MAX; id++) {
+        shm_t *shm = &segments[id];
+
+        if (shm->used && shm->creator == pd) {
+            shm->creator = 0;
+            shm_release(shm);
+        }
+    }
+
+    spin_unlock_irqrestore(&shm_lock, flags);
+}
+
+// Copy a name from user mode, false if it's not a valid one
+static bool shm_name(char *dst, const char *name) {
+    return strncpy_from_user(dst, name, SHM_NAME_MAX) > 0;
+}
+
+static int32_t shm_lookup(const char *name) {
+    for (uint32_t id = 0; id < SHM_MAX; id++)
+        if (segments[id].used && !strcmp(segments[id].name, name))
+            return id;
+
+    return -1;
+}
+
+/**
+ * Open the segment with a name, creating it zero-filled if there's none, as
+ * a system call. A segment created here stays at least until the calling
+ * process exits or execs.
+ * @param  name name of the segment
+ * @param  size size in bytes if it's created
+ * @return      id of the segment, or -1
+ */
+int32_t shm_create(const char *name, uint32_t size) {
+    char key[SHM_NAME_MAX];
+    if (!shm_name(key, name))
+        return -1;
+
+    uint32_t flags = spin_lock_irqsave(&shm_lock);
+    int32_t id = shm_lookup(key);
+    spin_unlock_irqrestore(&shm_lock, flags);
+
+    if (id >= 0)
+        return id;
+
+    if (!size || size > (uint32_t)PAGE_SIZE << SHM_MAX_ORDER)
+        return -1;
+
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t order = 0;
+    while (1u << order < pages)
+        order++;
+
+    // Zeroed before anyone can see it
+    uint32_t frame = mem_allocate_frames(order);
+    if (!frame)
+        return -1;
+
+    memset(phys_to_virt(frame * PAGE_SIZE), 0, PAGE_SIZE << order);
+
+    flags = spin_lock_irqsave(&shm_lock);
+
+    // Someone may have been quicker
+    id = shm_lookup(key);
+    if (id < 0) {
+        for (uint32_t i = 0; i < SHM_MAX && id < 0; i++)
+            if (!segments[i].used)
+                id = i;
+    }
+
+    if (id >= 0 && !segments[id].used) {
+        shm_t *shm = &segments[id];
+        strcpy(shm->name, key);
+        shm->frame = frame;
+        shm->order = order;
+        shm->pages = pages;
+        shm->refs = 1;
+        shm->creator = current_pd;
+        shm->used = true;
+        frame = 0;
+    }
+
+    spin_unlock_irqrestore(&shm_lock, flags);
+
+    if (frame)
+        mem_free_frames(frame, order);
+
+    return id;
+}
+
+/**
+ * Map a segment into the calling process, as a system call. The mapping is
+ * shared with forked children too.
+ * @param  id   segment
+ * @param  addr page aligned user address, or 0 to pick one
+ * @return      address mapped at, or (uint32_t)-1
+ */
+uint32_t shm_map(uint32_t id, uint32_t addr) {
+    if (id >= SHM_MAX || addr & (PAGE_SIZE - 1))
+        return -1;
+
+    page_directory_t *pd = current_pd;
+    shm_t *shm = &segments[id];
+
+    // Held while it's mapped, the region then keeps the reference. Address
+    // space locks are taken before this one, never while holding it.
+    uint32_t flags = spin_lock_irqsave(&shm_lock);
+    bool used = shm->used;
+    uint32_t phys = shm->frame * PAGE_SIZE;
+    uint32_t pages = shm->pages;
+
+    if (used)
+        shm->refs++;
+
+    spin_unlock_irqrestore(&shm_lock, flags);
+
+    if (!used)
+        return -1;
+
+    uint32_t size = pages * PAGE_SIZE;
+    bool found = false;
+
+    if (addr) {
+        found = addr < VIRTUAL_BASE && size <= VIRTUAL_BASE - addr &&
+                vm_map_shared(pd, addr, phys, pages, PT_RW | PT_USER, shm);
+    } else {
+        // First gap big enough, regions can't overlap
+        for (addr = SHM_BASE; addr + size <= SHM_LIMIT; addr += size) {
+            if (vm_map_shared(pd, addr, phys, pages, PT_RW | PT_USER, shm)) {
+                found = true;
+                break;
+            }
+        }
+    }
+
+    if (!found)
+        shm_put(shm);
+
+    return found ? addr : (uint32_t)-1;
+}
+
+/**
+ * Unmap a segment from the calling process, as a system call. The segment
+ * is freed once nobody has it mapped any more and its creator is gone.
+ * @param  addr address it was mapped at
+ * @return      0, or -1 if no segment is mapped there
+ */
+int32_t shm_unmap(uint32_t addr) {
+    return vm_unmap_shm(current_pd, addr) ? 0 : -1;
+}
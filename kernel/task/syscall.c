@@ -1,47 +1,205 @@
+#include <core/clock.h>
+#include <core/cpu.h>
 #include <core/interrupt.h>
+#include <core/smp.h>
 #include <driver/vga.h>
+#include <task/file.h>
+#include <task/futex.h>
+#include <task/ioring.h>
+#include <task/ipc.h>
+#include <task/shm.h>
+#include <task/syscall.h>
 #include <task/thread.h>
+#include <task/uaccess.h>
+#include <task/vdso.h>
 
-static void syscall_handler(registers_t *regs);
+static uint32_t SYSCALL sys_puts(const char *str) {
+   char c;
 
-static void *syscalls[2] =
+   for (; copy_from_user(&c, str, 1) && c; str++)
+      vga_putch(c);
+
+   return 0;
+}
+
+static uint32_t SYSCALL sys_fork() {
+   return fork();
+}
+
+static uint32_t SYSCALL sys_clock_gettime(uint32_t clock, struct timespec *ts) {
+   return clock_gettime(clock, ts);
+}
+
+// Does nothing, for measuring the cost of getting in and out of the kernel
+static uint32_t SYSCALL sys_null() {
+   return 0;
+}
+
+static uint32_t SYSCALL sys_getpid() {
+   return current_thread->pid;
+}
+
+static uint32_t SYSCALL sys_thread_create(uint32_t entry, uint32_t stack) {
+   return thread_create(entry, stack);
+}
+
+static uint32_t SYSCALL sys_exit(int32_t code) {
+   thread_exit(code);
+}
+
+static uint32_t SYSCALL sys_waitpid(int32_t pid, int32_t *status) {
+   return waitpid(pid, status);
+}
+
+static uint32_t SYSCALL sys_futex(uint32_t *uaddr, uint32_t op, uint32_t val, uint32_t *uaddr2,
+                                  uint32_t val2) {
+   return futex(uaddr, op, val, uaddr2, val2);
+}
+
+// Trap frame of the current system call, to return more than eax in
+static inline registers_t *user_regs() {
+   return (registers_t *)(current_thread->esp0 - sizeof(registers_t));
+}
+
+// Messages travel in ebx, esi and edi, which SYSENTER preserves too
+static uint32_t SYSCALL sys_ipc_call(uint32_t w0, uint32_t dest, uint32_t unused, uint32_t w1,
+                                     uint32_t w2) {
+   (void)unused;
+   uint32_t msg[IPC_WORDS] = { w0, w1, w2 };
+
+   int32_t ret = ipc_call(dest, msg);
+
+   registers_t *regs = user_regs();
+   regs->ebx = msg[0];
+   regs->esi = msg[1];
+   regs->edi = msg[2];
+   return ret;
+}
+
+static uint32_t SYSCALL sys_ipc_reply_wait(uint32_t w0, uint32_t to, uint32_t unused, uint32_t w1,
+                                           uint32_t w2) {
+   (void)unused;
+   uint32_t msg[IPC_WORDS] = { w0, w1, w2 };
+
+   int32_t ret = ipc_reply_wait(to, msg);
+
+   registers_t *regs = user_regs();
+   regs->ebx = msg[0];
+   regs->esi = msg[1];
+   regs->edi = msg[2];
+   return ret;
+}
+
+static uint32_t SYSCALL sys_shm_create(const char *name, uint32_t size) {
+   return shm_create(name, size);
+}
+
+static uint32_t SYSCALL sys_shm_map(uint32_t id, uint32_t addr) {
+   return shm_map(id, addr);
+}
+
+static uint32_t SYSCALL sys_shm_unmap(uint32_t addr) {
+   return shm_unmap(addr);
+}
+
+static uint32_t SYSCALL sys_open(const char *name) {
+   return file_open(name);
+}
+
+static uint32_t SYSCALL sys_close(uint32_t fd) {
+   return file_close(fd);
+}
+
+static uint32_t SYSCALL sys_pipe(int32_t *fds) {
+   return file_pipe(fds);
+}
+
+static uint32_t SYSCALL sys_read(uint32_t fd, uint8_t *buf, uint32_t len, uint32_t offset) {
+   return file_read(fd, buf, len, offset);
+}
+
+static uint32_t SYSCALL sys_write(uint32_t fd, uint8_t *buf, uint32_t len, uint32_t offset) {
+   return file_write(fd, buf, len, offset);
+}
+
+static uint32_t SYSCALL sys_ioring_setup(uint32_t entries, uint32_t flags) {
+   return ioring_setup(entries, flags);
+}
+
+static uint32_t SYSCALL sys_ioring_enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+   return ioring_enter(to_submit, min_complete, flags);
+}
+
+static const syscall_t syscalls[NUM_SYSCALLS] =
 {
-   &vga_puts,
-   &fork
+   [SYS_PUTS]          = sys_puts,
+   [SYS_FORK]          = sys_fork,
+   [SYS_CLOCK_GETTIME] = sys_clock_gettime,
+   [SYS_NULL]          = sys_null,
+   [SYS_GETPID]        = sys_getpid,
+   [SYS_OPEN]          = sys_open,
+   [SYS_CLOSE]         = sys_close,
+   [SYS_READ]          = sys_read,
+   [SYS_WRITE]         = sys_write,
+   [SYS_IORING_SETUP]  = sys_ioring_setup,
+   [SYS_IORING_ENTER]  = sys_ioring_enter,
+   [SYS_THREAD_CREATE] = sys_thread_create,
+   [SYS_EXIT]          = sys_exit,
+   [SYS_WAITPID]       = sys_waitpid,
+   [SYS_FUTEX]         = sys_futex,
+   [SYS_PIPE]          = sys_pipe,
+   [SYS_IPC_CALL]      = sys_ipc_call,
+   [SYS_IPC_REPLY_WAIT] = sys_ipc_reply_wait,
+   [SYS_SHM_CREATE]    = sys_shm_create,
+   [SYS_SHM_MAP]       = sys_shm_map,
+   [SYS_SHM_UNMAP]     = sys_shm_unmap,
 };
-uint32_t num_syscalls = 2;
+
+// SYSENTER is missing on some processors and broken on the first Pentium Pros
+static bool sysenter_supported() {
+   uint32_t eax, ebx, ecx, edx;
+   cpuid(1, &eax, &ebx, &ecx, &edx);
+
+   uint32_t family = (eax >> 8) & 0xF, model = (eax >> 4) & 0xF, stepping = eax & 0xF;
+   if (family == 6 && model < 3 && stepping < 3)
+      return false;
+
+   return edx & CPUID_EDX_SEP;
+}
+
+static bool sysenter;
 
 void syscall_init() {
    // Register our syscall handler.
    isr_install_handler(0x80, &syscall_handler);
+
+   // User mode enters through the vDSO, which uses SYSENTER where it can
+   sysenter = sysenter_supported();
+   vdso_init(sysenter);
+   syscall_init_cpu();
+
+   ioring_init();
 }
 
-void syscall_handler(registers_t *regs) {
-   // Firstly, check if the requested syscall number is valid.
-   // The syscall number is found in EAX.
+// Point the current CPU's SYSENTER at the kernel, on the stack of whichever
+// thread is running when it's executed
+void syscall_init_cpu() {
+   if (!sysenter)
+      return;
 
-   if (regs->eax >= num_syscalls)
+   wrmsr(MSR_SYSENTER_CS, 0x08);
+   wrmsr(MSR_SYSENTER_ESP, (uint32_t)&this_cpu()->tss.esp0);
+   wrmsr(MSR_SYSENTER_EIP, (uint32_t)sysenter_entry);
+}
+
+/**
+ * Run a system call, from int 0x80 or SYSENTER. Arguments are passed on
+ * in registers, the result is returned in the caller's eax.
+ * @param regs trap frame of the caller
+ */
+void syscall_handler(registers_t *regs) {
+   if (regs->eax >= NUM_SYSCALLS)
        return;
 
-   // Get the required syscall location.
-   void *location = syscalls[regs->eax];
-
-   // We don't know how many parameters the function wants, so we just
-   // push them all onto the stack in the correct order. The function will
-   // use all the parameters it wants, and we can pop them all back off afterwards.
-   int ret;
-   asm volatile (" \ 
-     push %1; \ 
-     push %2; \ 
-     push %3; \ 
-     push %4; \ 
-     push %5; \ 
-     call *%6; \ 
-     pop %%ebx; \ 
-     pop %%ebx; \ 
-     pop %%ebx; \ 
-     pop %%ebx; \ 
-     pop %%ebx; \ 
-   " : "=a" (ret) : "r" (regs->edi), "r" (regs->esi), "r" (regs->edx), "r" (regs->ecx), "r" (regs->ebx), "r" (location));
-   regs->eax = ret;
-}
\ No newline at end of file
+   regs->eax = syscalls[regs->eax](regs->ebx, regs->ecx, regs->edx, regs->esi, regs->edi);
+}
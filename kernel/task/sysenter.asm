@@ -0,0 +1,248 @@
+; Fast system calls and the vDSO. vdso_start..vdso_end is copied to the
+; vDSO page, whose functions user mode calls with the same registers as a
+; system call: number in eax where there is one, arguments in ebx, ecx,
+; edx, esi and edi, result in eax. Other registers and the flags are
+; preserved.
+
+VDSO_BASE equ 0xFF400000			; Must match vdso.h
+VDSO_DATA equ VDSO_BASE + 0x1000
+%define V(x) ((x) - vdso_start + VDSO_BASE)
+
+; vdso_data_t
+D_SEQ			equ VDSO_DATA + 0
+D_TSC			equ VDSO_DATA + 4
+D_CYCLE_LAST	equ VDSO_DATA + 8
+D_NS			equ VDSO_DATA + 16
+D_FRAC			equ VDSO_DATA + 24
+D_MULT			equ VDSO_DATA + 28
+D_SHIFT			equ VDSO_DATA + 32
+D_CPUS			equ VDSO_DATA + 64	; seq and pid of each CPU
+
+SEL_CPU_ID		equ 0x3B			; Limit is the CPU number, see gdt.c
+SYS_CLOCK_GETTIME	equ 2
+CLOCK_MONOTONIC	equ 1
+
+[SECTION .text]
+
+global vdso_start
+global vdso_end
+global vdso_int80
+global vdso_int80_end
+global sysenter_entry
+global sysenter_args
+global sysenter_args_end
+global sysenter_args_fault
+
+extern syscall_handler
+
+; Entry points are at fixed offsets in the page
+%macro VDSO_ENTRY 1
+	jmp strict near %1
+	times 3 int3
+%endmacro
+
+vdso_start:
+
+; VDSO_SYSCALL. SYSEXIT returns to edx with ecx as the stack, so the stub
+; saves the arguments in those two on the user stack and passes the kernel
+; its stack pointer in ebp. The flags are saved there too, the kernel only
+; keeps IF of them. It puts vdso_int80 here instead if the processor can't
+; do SYSENTER.
+vdso_syscall:
+	pushfd
+	push ebp
+	push ecx
+	push edx
+	mov ebp, esp
+	sysenter
+vdso_sysenter_return:
+	pop edx
+	pop ecx
+	pop ebp
+	popfd
+	ret
+	times 16 - ($ - vdso_start) int3
+
+VDSO_ENTRY vdso_getpid				; VDSO_GETPID
+VDSO_ENTRY vdso_clock_gettime		; VDSO_CLOCK_GETTIME
+VDSO_ENTRY vdso_getcpu				; VDSO_GETCPU
+
+; CPU the caller was running on, which may have changed by the time it looks
+vdso_getcpu:
+	mov eax, SEL_CPU_ID
+	lsl eax, eax
+	ret
+
+; Pid of the running thread, from the slot of the CPU it runs on. The
+; slot's sequence number changes whenever a thread is switched in, so the
+; pid read is its own if both the CPU and the sequence number are the same
+; afterwards.
+vdso_getpid:
+	push ebx
+	push ecx
+	push edx
+.retry:
+	mov ebx, SEL_CPU_ID
+	lsl ebx, ebx
+	shl ebx, 3
+	mov ecx, [D_CPUS + ebx]			; seq
+	mov eax, [D_CPUS + ebx + 4]		; pid
+
+	mov edx, SEL_CPU_ID
+	lsl edx, edx
+	shl edx, 3
+	cmp edx, ebx
+	jne .retry
+	cmp ecx, [D_CPUS + ebx]
+	jne .retry
+
+	pop edx
+	pop ecx
+	pop ebx
+	ret
+
+; clock_gettime(ebx = clock, ecx = struct timespec *). Monotonic time is
+; computed from the TSC and what the kernel last read from it, anything
+; else goes to the kernel.
+vdso_clock_gettime:
+	cmp ebx, CLOCK_MONOTONIC
+	jne .syscall
+
+	push ecx
+	push edx
+	push esi
+	push edi
+	push ebp
+	mov edi, ecx
+
+.retry:
+	mov ebp, [D_SEQ]
+	test ebp, 1						; Kernel is updating it
+	jnz .pause
+	cmp dword [D_TSC], 0
+	je .fallback
+
+	rdtsc
+	sub eax, [D_CYCLE_LAST]
+	sbb edx, [D_CYCLE_LAST + 4]
+	jns .positive					; Another CPU's TSC may be a little ahead
+	xor eax, eax
+	xor edx, edx
+.positive:
+	test edx, edx					; Too long since the kernel last looked
+	jnz .fallback
+
+	; ns + (delta * mult + frac) >> shift
+	mul dword [D_MULT]
+	add eax, [D_FRAC]
+	adc edx, 0
+	mov ecx, [D_SHIFT]
+	cmp ecx, 32
+	jb .shift
+	mov eax, edx
+	xor edx, edx
+	jmp .add
+.shift:
+	shrd eax, edx, cl
+	shr edx, cl
+.add:
+	add eax, [D_NS]
+	adc edx, [D_NS + 4]
+
+	cmp ebp, [D_SEQ]
+	jne .retry
+
+	mov ecx, 1000000000
+	div ecx
+	mov [edi], eax					; tv_sec
+	mov [edi + 4], edx				; tv_nsec
+	xor eax, eax
+
+	pop ebp
+	pop edi
+	pop esi
+	pop edx
+	pop ecx
+	ret
+
+.pause:
+	pause
+	jmp .retry
+
+.fallback:
+	pop ebp
+	pop edi
+	pop esi
+	pop edx
+	pop ecx
+.syscall:
+	mov eax, SYS_CLOCK_GETTIME
+	jmp vdso_syscall
+
+vdso_end:
+
+; Replaces the start of vdso_syscall on processors without SYSENTER
+vdso_int80:
+	int 0x80
+	ret
+vdso_int80_end:
+
+
+; SYSENTER_ESP points at the CPU's tss.esp0, the running thread's stack top.
+; The frame built there is the one int 0x80 leaves, so fork() and everything
+; else working on trap frames can't tell the difference.
+sysenter_entry:
+	mov esp, [esp]
+	cld							; User mode may have left DF set
+
+	push dword 0x23				; ss
+	push ebp					; useresp
+	push dword 0x202			; eflags, interrupts on
+	push dword 0x1B				; cs
+	push dword V(vdso_sysenter_return)	; eip
+	push dword 0				; err_code
+	push dword 0x80				; int_no
+
+	; ecx and edx are on the user stack, no system call with a kernel stack.
+	; A fault reading them resumes at sysenter_args_fault, see uaccess_fixup().
+	cmp ebp, 0xC0000000 - 8
+	ja sysenter_args_fault
+sysenter_args:
+	mov ecx, [ebp + 4]
+	mov edx, [ebp]
+sysenter_args_end:
+sysenter_save:
+	pusha
+
+	mov ax, ds
+	push eax
+
+	mov ax, 0x10				; Kernel data segment
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov ax, 0x30				; GS points at this CPU's data, see this_cpu()
+	mov gs, ax
+
+	push esp
+	call syscall_handler
+	add esp, 4
+
+	pop ebx
+	mov ds, bx
+	mov es, bx
+	mov fs, bx
+	mov gs, bx					; Don't leave the per-CPU segment to user mode
+
+	popa
+	add esp, 8					; int_no and err_code
+
+	mov edx, [esp]				; eip
+	mov ecx, [esp + 12]			; useresp
+	sti							; Takes effect after SYSEXIT
+	sysexit
+
+; The arguments can't be read, eax = -1 fails the system call
+sysenter_args_fault:
+	mov eax, -1
+	jmp sysenter_save
@@ -2,39 +2,141 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <core/cpu.h>
+#include <core/fpu.h>
 #include <core/gdt.h>
+#include <core/interrupt.h>
 #include <memory/memory.h>
+#include <memory/slab.h>
+#include <memory/vm.h>
 #include <driver/fs.h>
+#include <task/ioring.h>
+#include <task/ipc.h>
 #include <task/thread.h>
+#include <task/kstack.h>
 #include <task/scheduler.h>
+#include <task/uaccess.h>
+#include <task/vdso.h>
+#include <task/wait.h>
 
-thread_t *current_thread;
+static kmem_cache_t *thread_cache;
+
+// Every thread that exists, zombies included
+static thread_t *all_threads;
+static spinlock_t threads_lock = SPINLOCK_INIT;
+
+// Exited threads the reaper hasn't freed yet, linked through wait_next
+static thread_t *reap_list;
+static wait_queue_t reap_wait;
+
+// Threads in waitpid(), woken whenever a zombie is reaped
+static wait_queue_t exit_wait;
+
+// Threads start on the top priority level, off every run queue, and the
+// scheduler decides which CPU they go to
+static void thread_ctor(void *thread) {
+	memset(thread, 0, sizeof(thread_t));
+	((thread_t *)thread)->cpu = SCHED_ANY_CPU;
+}
+
+static inline uint32_t new_pid() {
+	return __sync_fetch_and_add(&pids, 1);
+}
+
+// New thread with a pid, known to waitpid() from here on
+static thread_t *thread_alloc() {
+	thread_t *thread = (thread_t *)kmem_cache_alloc(thread_cache);
+	thread->pid = new_pid();
+
+	uint32_t flags = spin_lock_irqsave(&threads_lock);
+	thread->all_next = all_threads;
+	all_threads = thread;
+	spin_unlock_irqrestore(&threads_lock, flags);
+
+	return thread;
+}
+
+// Take a thread off the list of all threads, with the list locked
+static void thread_unlink(thread_t *thread) {
+	thread_t **link = &all_threads;
+
+	while (*link != thread)
+		link = &(*link)->all_next;
+
+	*link = thread->all_next;
+}
+
+// Give a thread that's been unlinked back to the cache, constructed again
+static void thread_free(thread_t *thread) {
+	thread_ctor(thread);
+	kmem_cache_free(thread_cache, thread);
+}
 
 thread_t *thread_init() {
+	extern void _init_stack_end();
+
 	// Init pid counter
 	pids = 0;
 
-	// Create initial thread
-	current_thread = (thread_t *)kmalloc(sizeof(thread_t));
-	current_thread->pid = pids++;
-	current_thread->pd = current_pd;
-	current_thread->ring = 0;
-	current_thread->cr3 = current_thread->pd->phys;
+	thread_cache = kmem_cache_create("thread_t", sizeof(thread_t), 4, thread_ctor);
+	file_init();
 
-	return current_thread;
+	// Create initial thread, it keeps running on the boot stack
+	return thread_adopt((uint32_t)_init_stack_end);
 }
 
-thread_t *construct_thread(void *start) {
-	thread_t *new_thread = (thread_t *)kmalloc(sizeof(thread_t));
+/**
+ * Turn whatever runs on the current CPU into its current thread
+ * @param  esp0 top of the stack it runs on
+ * @return      thread, already running
+ */
+thread_t *thread_adopt(uint32_t esp0) {
+	cpu_t *cpu = this_cpu();
+	thread_t *thread = thread_alloc();
+
+	thread->pd = pd_get(cpu->pd);
+	thread->ring = 0;
+	thread->esp0 = esp0;
+	thread->cr3 = thread->pd->phys;
+	thread->cpu = cpu->id;
+	thread->on_cpu = true;
+
+	cpu->current = thread;
+	cpu->tss.esp0 = esp0;
+
+	return thread;
+}
+
+// Where kernel threads go once their start function returns
+static void thread_return() {
+	thread_exit(0);
+}
 
-	new_thread->pid = pids++;
-	new_thread->pd = clone_pd(current_thread->pd);
+/**
+ * Create a kernel thread in the current address space
+ * @param  start function the thread starts executing
+ * @param  arg   argument passed to start
+ * @return       new thread, not yet scheduled
+ */
+thread_t *construct_thread(void *start, void *arg) {
+	thread_t *new_thread = thread_alloc();
+
+	new_thread->pd = pd_get(current_thread->pd);
 	new_thread->ring = 0;
+	new_thread->esp0 = kstack_alloc();
+
+	// Stack looks as if thread_return() had called start(arg), which is
+	// where thread_bootstrap() returns to
+	uint32_t *stack = (uint32_t *)new_thread->esp0;
+	*--stack = (uint32_t)arg;
+	*--stack = (uint32_t)thread_return;
+	*--stack = (uint32_t)start;
 
-	new_thread->esp = KSTACK;
-	new_thread->ebp = KSTACK;
-	new_thread->eip = (uint32_t)start;
+	new_thread->esp = (uint32_t)stack;
+	new_thread->ebp = 0;
+	new_thread->eip = (uint32_t)thread_bootstrap;
 
 	new_thread->eax = 0;
 	new_thread->cr3 = new_thread->pd->phys;
@@ -42,60 +144,362 @@ thread_t *construct_thread(void *start) {
 	return new_thread;
 }
 
-void preempt() {
-	if (current_thread == 0)
-		return;
+/**
+ * Start a program in a new process
+ * @param  name file in the root directory
+ * @return      thread running the program
+ */
+thread_t *spawn(char *name) {
+	thread_t *thread = construct_thread(exec, name);
+
+	// Empty address space, exec() maps the program into it
+	pd_put(thread->pd);
+	thread->pd = create_pd();
+	thread->cr3 = thread->pd->phys;
+
+	thread->files = files_create();
 
-	thread_t *old = current_thread;
+	scheduler_add(thread);
+	return thread;
+}
+
+/**
+ * Stop running the current thread and continue where `next` left off. The
+ * caller decides whether the current thread goes back on a run queue, but
+ * no other CPU runs it before its registers are saved.
+ * @param next thread taken off the run queues
+ */
+void switch_thread(thread_t *next) {
+	cpu_t *cpu = this_cpu();
+	thread_t *old = cpu->current;
+
+	if (next == old)
+		return;
 
-	current_thread = scheduler_next();
+	next->on_cpu = true;
+	cpu->prev = old;
+	cpu->current = next;
 
 	// Set current page directory
-	current_pd = current_thread->pd;
+	cpu->pd = next->pd;
 
-	// Set kernel stack pointer in tss
-	if (current_thread->ring)
-		tss.esp0 = current_thread->esp0;
+	// Traps from user mode land on the thread's own kernel stack
+	cpu->tss.esp0 = next->esp0;
 
-	switch_context(old, current_thread);
+	// FPU registers aren't touched until next uses them
+	fpu_switch(cpu, next);
+
+	// User mode reads its pid from the vDSO
+	vdso_switch(cpu->id, next->pid);
+
+	switch_context(old, next);
+
+	// Back on this thread, maybe on another CPU, interrupts still off
+	finish_switch();
 }
 
+// The thread switched away from is saved, other CPUs may pick it up now
+void finish_switch() {
+	this_cpu()->prev->on_cpu = false;
+}
 
+/**
+ * Duplicate the calling user process. Only valid as a system call, the child
+ * returns to user mode through a copy of the caller's trap frame.
+ * @return pid of the child, the child itself sees 0, or -1 if out of memory
+ */
 uint32_t fork() {
-	// Forked thread execution starts at eip
-	uint32_t eip = get_eip();
+	uint32_t flags = irq_save();
 
-	// Forked thread has started
-	if (eip == 0)
-		return current_thread->pid;
+	// Out of memory fails the fork before the child exists
+	page_directory_t *pd = clone_pd(current_thread->pd);
+	uint32_t esp0 = pd ? kstack_alloc() : 0;
 
-	asm volatile("cli");
+	if (!esp0) {
+		if (pd)
+			pd_put(pd);
 
-	// Stack pointers for new thread
-	uint32_t esp, ebp;
-	asm volatile("mov %%esp, %0" : "=r" (esp));
-	asm volatile("mov %%ebp, %0" : "=r" (ebp));
+		irq_restore(flags);
+		return -1;
+	}
 
-	thread_t *fork_thread = (thread_t *)kmalloc(sizeof(thread_t));
-	scheduler_add(fork_thread);
+	thread_t *fork_thread = thread_alloc();
 
 	// Set up new thread with unique id and vas
-	fork_thread->pid = pids++;
-	fork_thread->pd = clone_pd(current_thread->pd);
+	fork_thread->ppid = current_thread->pid;
+	fork_thread->pd = pd;
 	fork_thread->ring = current_thread->ring;
-	fork_thread->esp0 = current_thread->esp0;
-
-	fork_thread->esp = esp;
-	fork_thread->ebp = ebp;
-	fork_thread->eip = eip;
+	fork_thread->esp0 = esp0;
+	fork_thread->files = current_thread->files ? files_clone(current_thread->files) : 0;
+	// The ring's submissions run against the parent's address space, so the
+	// child starts without one and may set up its own
+	fork_thread->ioring = 0;
+	if (current_thread->ioring)
+		vm_unmap(pd, IORING_BASE);
+
+	// Trap frame of a system call from user mode is at the top of the kernel stack
+	registers_t *frame = (registers_t *)(fork_thread->esp0 - sizeof(registers_t));
+	memcpy(frame, (void *)(current_thread->esp0 - sizeof(registers_t)), sizeof(registers_t));
+	frame->eax = 0;
+
+	// Child continues with the FPU registers the parent has right now
+	fpu_copy(fork_thread, current_thread);
+
+	// thread_bootstrap() returns into isr_return with the frame on top
+	uint32_t *stack = (uint32_t *)frame;
+	*--stack = (uint32_t)isr_return;
+
+	fork_thread->esp = (uint32_t)stack;
+	fork_thread->ebp = 0;
+	fork_thread->eip = (uint32_t)thread_bootstrap;
 
 	fork_thread->eax = 0;
 	fork_thread->cr3 = fork_thread->pd->phys;
 
-	asm volatile("sti");
+	scheduler_add(fork_thread);
+
+	irq_restore(flags);
 	return fork_thread->pid;
 }
 
+/**
+ * Start another thread in the calling user process, sharing its address
+ * space and open files. Only valid as a system call, the thread starts in
+ * user mode with the caller's registers, but eax 0 and its own eip and esp.
+ * @param  entry user address the thread starts executing
+ * @param  stack top of the thread's user stack
+ * @return       pid of the new thread
+ */
+uint32_t thread_create(uint32_t entry, uint32_t stack) {
+	uint32_t flags = irq_save();
+
+	thread_t *new_thread = thread_alloc();
+
+	new_thread->ppid = current_thread->pid;
+	new_thread->pd = pd_get(current_thread->pd);
+	new_thread->ring = current_thread->ring;
+	new_thread->esp0 = kstack_alloc();
+	new_thread->files = current_thread->files ? files_get(current_thread->files) : 0;
+	new_thread->ioring = current_thread->ioring ? ioring_get(current_thread->ioring) : 0;
+
+	registers_t *frame = (registers_t *)(new_thread->esp0 - sizeof(registers_t));
+	memcpy(frame, (void *)(current_thread->esp0 - sizeof(registers_t)), sizeof(registers_t));
+	frame->eax = 0;
+	frame->eip = entry;
+	frame->useresp = stack;
+
+	// Goes to user mode through isr_return like a forked child
+	uint32_t *kstack = (uint32_t *)frame;
+	*--kstack = (uint32_t)isr_return;
+
+	new_thread->esp = (uint32_t)kstack;
+	new_thread->ebp = 0;
+	new_thread->eip = (uint32_t)thread_bootstrap;
+
+	new_thread->eax = 0;
+	new_thread->cr3 = new_thread->pd->phys;
+
+	scheduler_add(new_thread);
+
+	irq_restore(flags);
+	return new_thread->pid;
+}
+
+/**
+ * End the current thread. What it may share with others is let go of right
+ * away, its address space and kernel stack are freed by the reaper once it's
+ * off the CPU for good.
+ * @param code exit status, handed to waitpid()
+ */
+void thread_exit(int32_t code) {
+	thread_t *thread = current_thread;
+
+	if (thread->files)
+		files_put(thread->files);
+	if (thread->ioring)
+		ioring_put(thread->ioring);
+
+	thread->files = 0;
+	thread->ioring = 0;
+
+	// Callers waiting on it fail
+	ipc_exit(thread);
+
+	// Never comes back to restore them
+	irq_save();
+
+	fpu_release(thread);
+	thread->exit_code = code;
+
+	// Children nobody waits for any more are freed once reaped, zombies
+	// already reaped right now
+	spin_lock(&threads_lock);
+
+	thread_t *child = all_threads;
+	while (child) {
+		thread_t *next = child->all_next;
+
+		if (child->ppid == thread->pid) {
+			child->ppid = 0;
+
+			if (child->reaped) {
+				thread_unlink(child);
+				thread_free(child);
+			}
+		}
+
+		child = next;
+	}
+
+	spin_unlock(&threads_lock);
+
+	spin_lock(&reap_wait.lock);
+	thread->wait_next = reap_list;
+	reap_list = thread;
+	spin_unlock(&reap_wait.lock);
+
+	wake_up(&reap_wait);
+
+	thread->state = THREAD_ZOMBIE;
+	schedule();
+
+	// Zombies are never picked again
+	abort();
+}
+
+/**
+ * Free what exited threads held on to in the background, so exit stays
+ * cheap however big the address space
+ * @param arg unused
+ */
+static void reaper(void *arg) {
+	(void)arg;
+
+	for (;;) {
+		uint32_t flags = spin_lock_irqsave(&reap_wait.lock);
+
+		while (!reap_list)
+			sleep_on(&reap_wait);
+
+		thread_t *thread = reap_list;
+		reap_list = 0;
+
+		spin_unlock_irqrestore(&reap_wait.lock, flags);
+
+		while (thread) {
+			thread_t *next = thread->wait_next;
+
+			// Its stack is in use until the switch away from it is done
+			while (thread->on_cpu)
+				cpu_relax();
+
+			pd_put(thread->pd);
+			kstack_free(thread->esp0);
+			thread->pd = 0;
+			thread->esp0 = 0;
+
+			flags = spin_lock_irqsave(&threads_lock);
+
+			if (thread->ppid) {
+				thread->reaped = true;
+			} else {
+				thread_unlink(thread);
+				thread_free(thread);
+			}
+
+			spin_unlock_irqrestore(&threads_lock, flags);
+			thread = next;
+		}
+
+		wake_up(&exit_wait);
+	}
+}
+
+// Start the reaper, once threads can be scheduled
+void reaper_init() {
+	scheduler_add(construct_thread(reaper, 0));
+}
+
+/**
+ * Look up a thread by pid, with interrupts disabled. The list of threads
+ * stays locked, so the thread can't be freed until thread_find_done().
+ * @param  pid pid
+ * @return     thread, or 0
+ */
+thread_t *thread_find(uint32_t pid) {
+	spin_lock(&threads_lock);
+
+	thread_t *thread = all_threads;
+	while (thread && thread->pid != pid)
+		thread = thread->all_next;
+
+	return thread;
+}
+
+// Let threads be freed again after thread_find()
+void thread_find_done() {
+	spin_unlock(&threads_lock);
+}
+
+/**
+ * Look for a reaped child of the current thread and take it off the list
+ * @param  pid   child, or -1 for any
+ * @param  child where the child is returned
+ * @return       1 if one was taken, 0 if only live ones match, -1 if none
+ */
+static int32_t take_child(int32_t pid, thread_t **child) {
+	uint32_t me = current_thread->pid;
+	int32_t found = -1;
+
+	uint32_t flags = spin_lock_irqsave(&threads_lock);
+
+	for (thread_t *thread = all_threads; thread; thread = thread->all_next) {
+		if (thread->ppid != me || (pid != -1 && thread->pid != (uint32_t)pid))
+			continue;
+
+		found = 0;
+
+		if (thread->reaped) {
+			thread_unlink(thread);
+			*child = thread;
+			found = 1;
+			break;
+		}
+	}
+
+	spin_unlock_irqrestore(&threads_lock, flags);
+	return found;
+}
+
+/**
+ * Wait for a child made by fork() or thread_create() to exit, as a system
+ * call
+ * @param  pid    child, or -1 for any
+ * @param  status where the exit status is stored in user memory, may be 0
+ * @return        pid of the child, or -1 if there's no such child or status
+ *                can't be stored
+ */
+int32_t waitpid(int32_t pid, int32_t *status) {
+	if (status && !user_range(status, sizeof(int32_t)))
+		return -1;
+
+	thread_t *child = 0;
+	int32_t found;
+
+	wait_event(&exit_wait, (found = take_child(pid, &child)) != 0);
+
+	if (found < 0)
+		return -1;
+
+	int32_t code = child->exit_code;
+	uint32_t child_pid = child->pid;
+	thread_free(child);
+
+	if (status && !copy_to_user(status, &code, sizeof(code)))
+		return -1;
+
+	return child_pid;
+}
 
 void exec(char *name) {
 	fs_node_t *node = fs_finddir(fs_root, name);
@@ -103,18 +507,18 @@ void exec(char *name) {
 	if (!node)
 		return;
 
-	// Allocate memory for user text
-	for (uint32_t i=0; i<node->length; i+=0x1000)
-		map_page(i, PT_RW | PT_USER);
+	// Drop whatever the previous image had paged in
+	vm_unmap_all(current_pd);
 
-	// Allocate memory for user stack
-	map_page(USER_STACK, PT_RW | PT_USER);
+	// Binary is loaded to 0x00000000 page by page as it is touched
+	uint32_t image_end = (node->length + 0xFFF) & ~0xFFF;
+	vm_map_file(current_pd, 0, image_end, PT_RW | PT_USER, node, 0, node->length);
 
-	// Load binary to 0x00000000
-	fs_read(node, 0, node->length, (void *)0);
+	// User stack is zero-filled on demand below the kernel
+	vm_map_anon(current_pd, VIRTUAL_BASE - USER_STACK_LIM, VIRTUAL_BASE, PT_RW | PT_USER);
 
-	asm volatile("mov %%esp, %0" : "=r" (current_thread->esp0));
-	tss.esp0 = current_thread->esp0;
+	// Anything left on the kernel stack is dropped on the way to user mode
+	this_cpu()->tss.esp0 = current_thread->esp0;
 
 	// Start executing as user
 	become_user(USER_DS, USER_STACK, USER_CS, (void *)0x0);
@@ -0,0 +1,73 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <task/syscall.h>
+#include <task/uaccess.h>
+
+// Instructions that touch user memory, and where to go if they can't
+static const struct {
+    uint8_t *start;
+    uint8_t *end;
+    uint8_t *fault;
+} fixups[] = {
+    { sysenter_args, sysenter_args_end, sysenter_args_fault },
+    { copy_user_start, copy_user_end, copy_user_fault },
+    { touch_user_start, touch_user_end, touch_user_fault },
+};
+
+/**
+ * Copy a buffer in from user mode
+ * @param  dst kernel buffer
+ * @param  src user buffer
+ * @param  len bytes to copy
+ * @return     false if the user buffer isn't all there
+ */
+bool copy_from_user(void *dst, const void *src, uint32_t len) {
+    return user_range(src, len) && !copy_user(dst, src, len);
+}
+
+/**
+ * Copy a buffer out to user mode
+ * @param  dst user buffer
+ * @param  src kernel buffer
+ * @param  len bytes to copy
+ * @return     false if the user buffer isn't all there
+ */
+bool copy_to_user(void *dst, const void *src, uint32_t len) {
+    return user_range(dst, len) && !copy_user(dst, src, len);
+}
+
+/**
+ * Copy a terminated string in from user mode
+ * @param  dst kernel buffer of max bytes
+ * @param  src user string
+ * @param  max size of the buffer
+ * @return     length of the string, or -1 if it isn't all there or too long
+ */
+int32_t strncpy_from_user(char *dst, const char *src, uint32_t max) {
+    for (uint32_t i = 0; i < max; i++) {
+        if (!copy_from_user(&dst[i], &src[i], 1))
+            return -1;
+        if (!dst[i])
+            return i;
+    }
+
+    return -1;
+}
+
+/**
+ * Recover from a page fault on user memory that isn't there, when kernel
+ * mode accessed it on behalf of user mode. The access then fails instead.
+ * @param  regs trap frame of the fault
+ * @return      whether the fault was one of these
+ */
+bool uaccess_fixup(registers_t *regs) {
+    for (uint32_t i = 0; i < sizeof(fixups) / sizeof(fixups[0]); i++) {
+        if (regs->eip >= (uint32_t)fixups[i].start && regs->eip < (uint32_t)fixups[i].end) {
+            regs->eip = (uint32_t)fixups[i].fault;
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,46 @@
+; Accesses to user memory that may fault. A fault the page fault handler
+; can't resolve, e.g. on an address no region covers, resumes at the
+; matching *_fault label instead, see uaccess_fixup().
+
+[SECTION .text]
+
+global copy_user
+global copy_user_start
+global copy_user_end
+global copy_user_fault
+global touch_user
+global touch_user_start
+global touch_user_end
+global touch_user_fault
+
+; uint32_t copy_user(void *dst, const void *src, uint32_t len), returns the
+; number of bytes not copied. REP MOVSB keeps its progress in the registers,
+; so after a fault ecx holds what's left.
+copy_user:
+	push esi
+	push edi
+	mov edi, [esp + 12]
+	mov esi, [esp + 16]
+	mov ecx, [esp + 20]
+	cld
+copy_user_start:
+	rep movsb
+copy_user_end:
+copy_user_fault:
+	mov eax, ecx
+	pop edi
+	pop esi
+	ret
+
+; bool touch_user(uint32_t *addr), writes the word without changing it, so
+; it's paged in and a copy-on-write page is copied
+touch_user:
+	mov ecx, [esp + 4]
+touch_user_start:
+	lock add dword [ecx], 0
+touch_user_end:
+	mov eax, 1
+	ret
+touch_user_fault:
+	xor eax, eax
+	ret
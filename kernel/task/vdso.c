@@ -0,0 +1,73 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <core/clock.h>
+#include <memory/paging.h>
+#include <task/syscall.h>
+#include <task/vdso.h>
+
+// Data page as the kernel sees it, writable in the direct map
+vdso_data_t *vdso_data;
+
+// Map a kernel page that user mode can read, returning it in the direct map
+static void *vdso_map(uint32_t virt) {
+    map_page(virt, PT_USER | PT_GLOBAL);
+    *pde_of(virt) |= PD_USER;
+    invlpg((void *)virt);
+
+    return phys_to_virt(get_phys((void *)virt));
+}
+
+/**
+ * Map the vDSO code and data pages, read-only and executable from user mode.
+ * The kernel half is shared, so every address space has them from here on.
+ * @param sysenter whether this CPU can enter the kernel through SYSENTER,
+ *                 int 0x80 is used otherwise
+ */
+void vdso_init(bool sysenter) {
+    uint8_t *code = vdso_map(VDSO_BASE);
+    memcpy(code, vdso_start, vdso_end - vdso_start);
+
+    if (!sysenter)
+        memcpy(code, vdso_int80, vdso_int80_end - vdso_int80);
+
+    vdso_data_t *data = vdso_map(VDSO_DATA);
+    memset(data, 0, PAGE_SIZE);
+
+    // Time is only extrapolated from counters user mode can read
+    if (clocksource) {
+        data->tsc = clocksource->vdso;
+        data->mult = clocksource->mult;
+        data->shift = clocksource->shift;
+    }
+
+    vdso_data = data;
+
+    printf("vDSO: system calls through %s, time %s\n", sysenter ? "SYSENTER" : "int 0x80",
+           data->tsc ? "from the TSC" : "from the kernel");
+}
+
+/**
+ * Publish the state of the monotonic clock, called by ktime_update() with
+ * the clock locked
+ * @param cycle_last counter value the time was read at
+ * @param ns         time at cycle_last
+ * @param frac       fraction of a ns carried over
+ */
+void vdso_update_time(uint64_t cycle_last, uint64_t ns, uint64_t frac) {
+    vdso_data_t *data = vdso_data;
+
+    if (!data || !data->tsc)
+        return;
+
+    data->seq++;
+    asm volatile("" : : : "memory");
+
+    data->cycle_last = cycle_last;
+    data->ns = ns;
+    data->frac = frac;
+
+    asm volatile("" : : : "memory");
+    data->seq++;
+}
@@ -0,0 +1,52 @@
+#include <stdint.h>
+
+#include <core/cpu.h>
+#include <task/scheduler.h>
+#include <task/wait.h>
+
+/**
+ * Block the current thread on a wait queue until wake_up() is called on it.
+ * Must be called with the queue locked and interrupts disabled, use
+ * wait_event() instead. The lock is dropped while blocked.
+ * @param wq queue to wait on
+ */
+void sleep_on(wait_queue_t *wq) {
+    thread_t *thread = current_thread;
+
+    thread->wait_next = 0;
+    if (wq->tail)
+        wq->tail->wait_next = thread;
+    else
+        wq->head = thread;
+    wq->tail = thread;
+
+    // Blocked before the lock is dropped, so a waker finds it that way
+    thread->state = THREAD_BLOCKED;
+
+    spin_unlock(&wq->lock);
+    schedule();
+    spin_lock(&wq->lock);
+}
+
+/**
+ * Make every thread waiting on a queue runnable again
+ * @param wq queue to wake
+ */
+void wake_up(wait_queue_t *wq) {
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+
+    thread_t *thread = wq->head;
+    wq->head = 0;
+    wq->tail = 0;
+
+    spin_unlock(&wq->lock);
+
+    while (thread) {
+        thread_t *next = thread->wait_next;
+        thread->wait_next = 0;
+        scheduler_wake(thread);
+        thread = next;
+    }
+
+    irq_restore(flags);
+}